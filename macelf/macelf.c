@@ -736,6 +736,7 @@ int main(int argc, char **argv, char **envp)
 
     elf = argv[startarg];
     program_invocation_name = elf;
+    MOJOELF_set_init_args(argc - startarg, argv + startarg, NULL);  // constructors see the ELF's cmdline.
 
     if (!ld_library_path)  // try this if nothing else was specified.
         ld_library_path = getenv("LD_LIBRARY_PATH");
@@ -16,10 +16,27 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <dlfcn.h>
 
 #include "mojoelf.h"
 
+#ifndef MAP_FIXED_NOREPLACE  // Linux 4.17+; older kernels take it as a hint.
+#ifdef __linux__
+#define MAP_FIXED_NOREPLACE 0x100000
+#else
+#define MAP_FIXED_NOREPLACE 0
+#endif
+#endif
+
+#ifndef MADV_POPULATE_READ  // Linux 5.14+; older kernels say EINVAL.
+#ifdef __linux__
+#define MADV_POPULATE_READ 22
+#else
+#define MADV_POPULATE_READ -1
+#endif
+#endif
+
 // ELF specifications: http://refspecs.freestandards.org/elf/
 
 // If not defined, force to current x86/x86_64 Linux OSABI and version.
@@ -47,6 +64,120 @@
 #define MOJOELF_REDUCE_LIBC_DEPENDENCIES 0
 #endif
 
+#ifndef MOJOELF_SUPPORT_THREADS
+#define MOJOELF_SUPPORT_THREADS 1
+#endif
+
+// Keep relocated images in MOJOELF_Callbacks::cache_dir between runs.
+#ifndef MOJOELF_SUPPORT_CACHE
+#define MOJOELF_SUPPORT_CACHE 1
+#endif
+
+// Share read-only pages between instances of an image (needs memfds).
+#ifndef MOJOELF_SUPPORT_SHARED_TEXT
+#if MOJOELF_SUPPORT_THREADS && defined(__linux__)
+#define MOJOELF_SUPPORT_SHARED_TEXT 1
+#else
+#define MOJOELF_SUPPORT_SHARED_TEXT 0
+#endif
+#endif
+
+// Load pre-relocated images from an image server (see mojoelfd/).
+#ifndef MOJOELF_SUPPORT_REMOTE
+#ifdef __linux__
+#define MOJOELF_SUPPORT_REMOTE 1
+#else
+#define MOJOELF_SUPPORT_REMOTE 0
+#endif
+#endif
+
+#if MOJOELF_SUPPORT_THREADS
+#include <pthread.h>
+#endif
+
+#if MOJOELF_SUPPORT_SHARED_TEXT || MOJOELF_SUPPORT_REMOTE
+#include <sys/syscall.h>
+#define MFD_CLOEXEC_FLAG 1  // MFD_CLOEXEC, without needing linux/memfd.h.
+#endif
+
+#if MOJOELF_SUPPORT_REMOTE
+#include <sys/socket.h>
+#include <sys/un.h>
+#define MFD_ALLOW_SEALING_FLAG 2  // MFD_ALLOW_SEALING, same deal.
+#ifndef F_ADD_SEALS  // older headers, or no _GNU_SOURCE.
+#define F_ADD_SEALS 1033
+#define F_GET_SEALS 1034
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
+#define MOJOELF_REMOTE_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+#endif
+
+// Max worker threads we'll spin up ourselves if the app doesn't supply
+//  an executor callback.
+#ifndef MOJOELF_MAX_THREADS
+#define MOJOELF_MAX_THREADS 32
+#endif
+
+// Relocation tables smaller than this get processed on the calling thread.
+#ifndef MOJOELF_PARALLEL_RELOC_THRESHOLD
+#define MOJOELF_PARALLEL_RELOC_THRESHOLD 16384
+#endif
+
+// Relocations per work item. This is fixed, not derived from the thread
+//  count, so the work split is the same on every machine.
+#ifndef MOJOELF_RELOC_CHUNK_SIZE
+#define MOJOELF_RELOC_CHUNK_SIZE 4096
+#endif
+
+// Unique symbols per work item when resolving in parallel.
+#ifndef MOJOELF_SYMBOL_CHUNK_SIZE
+#define MOJOELF_SYMBOL_CHUNK_SIZE 256
+#endif
+
+// Bytes of an image MOJOELF_load_step() copies between looks at the clock.
+#ifndef MOJOELF_COPY_CHUNK_SIZE
+#define MOJOELF_COPY_CHUNK_SIZE (64 * 1024)
+#endif
+
+// Symbols MOJOELF_load_step() indexes between looks at the clock.
+#ifndef MOJOELF_EXPORT_CHUNK_SIZE
+#define MOJOELF_EXPORT_CHUNK_SIZE 1024
+#endif
+
+// Thread-local storage in loaded images. This needs the x86 Linux TLS ABI,
+//  and pthreads for the per-thread blocks of images loaded later on.
+#ifndef MOJOELF_SUPPORT_TLS
+#if MOJOELF_SUPPORT_THREADS && defined(__linux__)
+#define MOJOELF_SUPPORT_TLS 1
+#else
+#define MOJOELF_SUPPORT_TLS 0
+#endif
+#endif
+
+#if MOJOELF_SUPPORT_TLS && !MOJOELF_SUPPORT_THREADS
+#error MOJOELF_SUPPORT_TLS needs MOJOELF_SUPPORT_THREADS.
+#endif
+
+// Bytes of static TLS we reserve in every thread of the process, for images
+//  loaded with MOJOELF_FLAG_STATIC_TLS. Zero disables the static TLS path.
+#ifndef MOJOELF_STATIC_TLS_SIZE
+#define MOJOELF_STATIC_TLS_SIZE 4096
+#endif
+
+// Largest alignment a static TLS block can ask for.
+#define MOJOELF_STATIC_TLS_ALIGN 64
+
+// A thread that touches a dynamic TLS block without having called
+//  MOJOELF_tls_thread_init() gets it allocated on the spot, and there's no
+//  way to report failure from there. Nonzero aborts the process; zero hands
+//  the image a NULL pointer, which it will probably crash on anyway.
+#ifndef MOJOELF_TLS_OOM_ABORT
+#define MOJOELF_TLS_OOM_ABORT 1
+#endif
+
 #if (MOJOELF_SUPPORT_DLERROR && MOJOELF_SUPPORT_DLOPEN_FILE)
 #include <errno.h>
 #else
@@ -63,6 +194,7 @@
 #endif
 
 typedef intptr_t intptr;
+typedef int32_t int32;
 typedef uint8_t uint8;
 typedef uint16_t uint16;
 typedef uint32_t uint32;
@@ -130,26 +262,42 @@ typedef uintptr_t uintptr;
 
 #if !MOJOELF_SUPPORT_DLERROR
     #define set_dlerror(x) do {} while (0)
+    #define take_dlerror() ((const char *) NULL)
 #else
+    // Each thread gets its own error, like dlerror() does, so concurrent
+    //  loads can't clobber each other's.
+    #if MOJOELF_SUPPORT_THREADS
+    static __thread const char *dlerror_msg = NULL;
+    #else
     static const char *dlerror_msg = NULL;
+    #endif
     static inline void set_dlerror(const char *msg) { dlerror_msg = msg; }
 
-    const char *MOJOELF_dlerror(void)
+    static inline const char *take_dlerror(void)
     {
         const char *retval = dlerror_msg;
         dlerror_msg = NULL;
         return retval;
+    } // take_dlerror
+
+    const char *MOJOELF_dlerror(void)
+    {
+        return take_dlerror();
     } // MOJOELF_dlerror
 #endif
 
 // The usual ELF defines from the spec...
 #define ELF_ST_BIND(i) ((i) >> 4)
+#define ELF_ST_TYPE(i) ((i) & 0xF)
 #define ET_EXEC 2
 #define ET_DYN 3
 #define PT_LOAD 1
 #define PT_DYNAMIC 2
+#define PT_NOTE 4
+#define PT_TLS 7
 #define DT_NULL 0
 #define DT_NEEDED 1
+#define DT_PLTGOT 3
 #define DT_STRTAB 5
 #define DT_STRSZ 10
 #define DT_SYMTAB 6
@@ -166,16 +314,36 @@ typedef uintptr_t uintptr;
 #define DT_PLTRELSZ 2
 #define DT_INIT 12
 #define DT_FINI 13
+#define DT_SONAME 14
 #define DT_INIT_ARRAY 25
 #define DT_INIT_ARRAYSZ 27
-#define DT_FINI_ARRAY 25
+#define DT_FINI_ARRAY 26
 #define DT_FINI_ARRAYSZ 28
+#define DT_TEXTREL 22
 #define DT_RUNPATH 29
+#define DT_FLAGS 30
+#define DF_TEXTREL 4
+#define SHT_PROGBITS 1
+#define SHT_STRTAB 3
+#define SHT_RELA 4
+#define SHT_HASH 5
 #define SHT_NOBITS 8
+#define SHT_REL 9
 #define SHT_DYNSYM 11
+#define SHT_INIT_ARRAY 14
+#define SHT_PREINIT_ARRAY 16
+#define SHT_RELR 19
+#define SHT_GNU_HASH 0x6FFFFFF6
+#define SHT_GNU_VERDEF 0x6FFFFFFD
+#define SHT_GNU_VERNEED 0x6FFFFFFE
+#define SHT_GNU_VERSYM 0x6FFFFFFF
+#define SHF_ALLOC 2
+#define SHF_EXECINSTR 4
 #define SHN_UNDEF 0
 #define SHN_ABS 0xFFF1
 #define STB_WEAK 2
+#define STT_TLS 6
+#define STT_GNU_IFUNC 10
 #define EI_CLASS 4
 #define EI_DATA 5
 #define EI_VERSION 6
@@ -190,6 +358,18 @@ typedef uintptr_t uintptr;
 #define R_GLOB_DATA 6
 #define R_JUMP_SLOT 7
 #define R_RELATIVE 8
+#if defined(__i386__)
+#define R_TPOFF 14
+#define R_DTPMOD 35
+#define R_DTPOFF 36
+#define R_TPOFF_NEG 37  // R_386_TLS_TPOFF32, the negated offset.
+#define R_IRELATIVE 42
+#elif defined(__x86_64__)
+#define R_DTPMOD 16
+#define R_DTPOFF 17
+#define R_TPOFF 18
+#define R_IRELATIVE 37
+#endif
 
 typedef struct ElfHeader
 {
@@ -274,8 +454,32 @@ typedef struct ElfSymbols
 {
     char *sym;
     void *addr;
+    uint32 hash;  // gnu_hash() of sym.
+    int next;  // next index in this hash bucket, -1 for end of chain.
 } ElfSymbols;
 
+// What a MOJOELF_FLAG_RELOADABLE image's imports resolved to, indexed like
+//  the export list, so MOJOELF_dlreload() doesn't have to ask the app again.
+typedef struct ElfImportTable
+{
+    ElfSymbols *syms;
+    int syms_count;
+    int *buckets;  // hash index into syms; -1 for empty buckets.
+    uint32 bucket_mask;  // number of buckets, minus one.
+    char *names;  // every syms[i].sym points in here.
+} ElfImportTable;
+
+// Whole pages of a mapped image that nothing reads once it's loaded, for
+//  MOJOELF_trim() to give back.
+typedef struct ElfTrimRange
+{
+    size_t offset;  // from mmapaddr; page aligned.
+    size_t len;  // a multiple of the page size.
+    int init;  // nonzero if it's only dead once constructors have run.
+} ElfTrimRange;
+
+#define MOJOELF_TRIM_RANGES 4
+
 typedef struct ElfHandle  // this is what MOJOELF_dlopen_*() returns.
 {
     int mmaps_count;
@@ -283,6 +487,8 @@ typedef struct ElfHandle  // this is what MOJOELF_dlopen_*() returns.
     size_t mmaplen;
     int syms_count;
     ElfSymbols *syms;
+    int *buckets;  // hash index into syms; -1 for empty buckets.
+    uint32 bucket_mask;  // number of buckets, minus one.
     void *entry;
     void *fini;          // single destructor
     void **fini_array;   // fini array function in shared library.
@@ -290,6 +496,32 @@ typedef struct ElfHandle  // this is what MOJOELF_dlopen_*() returns.
     int dlopens_count;
     void **dlopens;
     MOJOELF_UnloaderCallback unloader;  // unloader callback.
+    struct ElfTlsModule *tls;  // NULL if there's no PT_TLS segment.
+    struct ElfSharedText *sharedtext;  // shared read-only pages, or NULL.
+    struct ElfShareKey *sharekey;  // non-NULL if other loads can reuse us.
+    int refcount;  // MOJOELF_dlclose() calls until we really unload.
+    struct ElfHandle *next_shared;  // next in shared_handles.
+    MOJOELF_Callbacks callbacks;  // what we were loaded with, for reloads.
+    struct ElfArena *arena;  // where mmapaddr came from, or NULL.
+    ElfImportTable *imports;  // MOJOELF_FLAG_RELOADABLE only, else NULL.
+    void *metadata;  // dlopens, syms, etc, if they don't follow the handle.
+    int in_workspace;  // from MOJOELF_dlopen_workspace(); the app owns us.
+    void *init;  // MOJOELF_FLAG_DEFER_INIT: what MOJOELF_run_init() calls.
+    void **init_array;  // ...and the init array.
+    int init_array_count;  // ...and how many are in it.
+    int init_pending;  // 1 until MOJOELF_run_init() runs those, 2 while it does.
+    int init_on_dlsym;  // MOJOELF_FLAG_INIT_ON_DLSYM: MOJOELF_dlsym() runs them.
+    uint64 init_seq;  // when constructors ran, process-wide; 0 if they haven't.
+    struct ElfHandle **init_deps;  // deferred handles we import from; run first.
+    int init_deps_count;  // number of entries in init_deps.
+    #if MOJOELF_SUPPORT_THREADS
+    pthread_t init_thread;  // who's running them while init_pending is 2.
+    #endif
+    struct ElfNamespaceLib *nslib;  // our place in a MOJOELF_Namespace, or NULL.
+    ElfTrimRange trims[MOJOELF_TRIM_RANGES];  // what MOJOELF_trim() can release.
+    int trim_count;  // number of used entries in trims.
+    uint64 imagehash;  // names our profile in cache_dir; only valid if hashed.
+    int hashed;  // nonzero if the load actually calculated imagehash.
 } ElfHandle;
 
 
@@ -370,14 +602,266 @@ static inline void Memcopy(void *dst, const void *src, size_t len)
 } // Memzero
 #endif
 
-static inline void *Malloc(const size_t len)
+// This is the same hash that DT_GNU_HASH sections use.
+static inline uint32 gnu_hash(const char *str)
+{
+    uint32 hash = 5381;
+    uint8 ch;
+    while ((ch = (uint8) *(str++)) != '\0')
+        hash = (hash << 5) + hash + ch;
+    return hash;
+} // gnu_hash
+
+// Fast hash of a whole image, to recognize one we've seen before. This is
+//  four lanes of multiply-rotate, xxHash64-style, 32 bytes per round.
+static inline uint64 hash_rotl(const uint64 x, const int bits)
+{
+    return (x << bits) | (x >> (64 - bits));
+} // hash_rotl
+
+static inline uint64 hash_round(uint64 acc, const uint64 val)
+{
+    acc += val * 0xC2B2AE3D27D4EB4FULL;
+    acc = hash_rotl(acc, 31);
+    return acc * 0x9E3779B185EBCA87ULL;
+} // hash_round
+
+static inline uint64 hash_buffer(const uint8 *buf, const size_t len)
+{
+    const uint8 *end = buf + len;
+    uint64 lanes[4] = {
+        0x60EA27EEADC0B5D6ULL, 0xC2B2AE3D27D4EB4FULL, 0, 0x61C8864E7A143579ULL
+    };
+    uint64 hash;
+    uint64 val;
+
+    while ((end - buf) >= 32)
+    {
+        int i;
+        for (i = 0; i < 4; i++, buf += 8)
+        {
+            Memcopy(&val, buf, 8);
+            lanes[i] = hash_round(lanes[i], val);
+        } // for
+    } // while
+
+    hash = hash_rotl(lanes[0], 1) + hash_rotl(lanes[1], 7) +
+           hash_rotl(lanes[2], 12) + hash_rotl(lanes[3], 18) + (uint64) len;
+
+    while ((end - buf) >= 8)
+    {
+        Memcopy(&val, buf, 8);
+        hash = hash_rotl(hash ^ hash_round(0, val), 27) * 0x9E3779B185EBCA87ULL;
+        buf += 8;
+    } // while
+
+    while (buf < end)
+        hash = hash_rotl(hash ^ (*(buf++) * 0x27D4EB2F165667C5ULL), 11) * 0x9E3779B185EBCA87ULL;
+
+    hash ^= hash >> 33;
+    hash *= 0xC2B2AE3D27D4EB4FULL;
+    hash ^= hash >> 29;
+    hash *= 0x165667B19E3779F9ULL;
+    hash ^= hash >> 32;
+    return hash;
+} // hash_buffer
+
+// SHA-256, for when a collision would hand someone the wrong library:
+//  MOJOELF_FLAG_SHARE_IDENTICAL trusts this alone to say two images match.
+static const uint32 sha256_k[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1,
+    0x923F82A4, 0xAB1C5ED5, 0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+    0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174, 0xE49B69C1, 0xEFBE4786,
+    0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147,
+    0x06CA6351, 0x14292967, 0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+    0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85, 0xA2BFE8A1, 0xA81A664B,
+    0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A,
+    0x5B9CCA4F, 0x682E6FF3, 0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+    0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+static inline uint32 sha256_rotr(const uint32 x, const int bits)
+{
+    return (x >> bits) | (x << (32 - bits));
+} // sha256_rotr
+
+static void sha256_block(uint32 *state, const uint8 *block)
+{
+    uint32 w[64];
+    uint32 v[8];
+    int i;
+
+    for (i = 0; i < 16; i++, block += 4)
+    {
+        w[i] = (((uint32) block[0]) << 24) | (((uint32) block[1]) << 16) |
+               (((uint32) block[2]) << 8) | ((uint32) block[3]);
+    } // for
+
+    for (i = 16; i < 64; i++)
+    {
+        const uint32 s0 = sha256_rotr(w[i-15], 7) ^ sha256_rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+        const uint32 s1 = sha256_rotr(w[i-2], 17) ^ sha256_rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    } // for
+
+    for (i = 0; i < 8; i++)
+        v[i] = state[i];
+
+    for (i = 0; i < 64; i++)
+    {
+        const uint32 s1 = sha256_rotr(v[4], 6) ^ sha256_rotr(v[4], 11) ^ sha256_rotr(v[4], 25);
+        const uint32 ch = (v[4] & v[5]) ^ ((~v[4]) & v[6]);
+        const uint32 t1 = v[7] + s1 + ch + sha256_k[i] + w[i];
+        const uint32 s0 = sha256_rotr(v[0], 2) ^ sha256_rotr(v[0], 13) ^ sha256_rotr(v[0], 22);
+        const uint32 maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        v[7] = v[6];
+        v[6] = v[5];
+        v[5] = v[4];
+        v[4] = v[3] + t1;
+        v[3] = v[2];
+        v[2] = v[1];
+        v[1] = v[0];
+        v[0] = t1 + s0 + maj;
+    } // for
+
+    for (i = 0; i < 8; i++)
+        state[i] += v[i];
+} // sha256_block
+
+static void sha256_buffer(const uint8 *buf, const size_t len, uint8 *digest)
+{
+    uint32 state[8] = {
+        0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+        0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+    };
+    const uint64 bits = ((uint64) len) * 8;
+    uint8 tail[128];
+    size_t taillen;
+    size_t i;
+
+    for (i = 0; (len - i) >= 64; i += 64)
+        sha256_block(state, buf + i);
+
+    // Whatever's left, a 0x80, zeros, and the length in bits, big-endian.
+    taillen = len - i;
+    Memzero(tail, sizeof (tail));
+    Memcopy(tail, buf + i, taillen);
+    tail[taillen] = 0x80;
+    taillen = (taillen < 56) ? 64 : 128;
+    for (i = 0; i < 8; i++)
+        tail[taillen - 1 - i] = (uint8) (bits >> (i * 8));
+
+    sha256_block(state, tail);
+    if (taillen == 128)
+        sha256_block(state, tail + 64);
+
+    for (i = 0; i < 32; i++)
+        digest[i] = (uint8) (state[i / 4] >> (24 - ((i % 4) * 8)));
+} // sha256_buffer
+
+// The app's allocator, from MOJOELF_set_allocator(), or NULL for libc's.
+static MOJOELF_AllocCallback app_alloc = NULL;
+static MOJOELF_FreeCallback app_free = NULL;
+static void *app_alloc_userdata = NULL;
+
+// Blocks we've allocated and not freed yet, from whichever allocator is
+//  current; MOJOELF_set_allocator() won't swap it out from under them. It's
+//  ALLOCATOR_CHANGING for the moment MOJOELF_set_allocator() is storing the
+//  new one, and nobody allocates until it's done.
+#define ALLOCATOR_CHANGING (-1)
+static int live_allocs = 0;
+
+int MOJOELF_set_allocator(MOJOELF_AllocCallback alloc,
+                          MOJOELF_FreeCallback dealloc, void *userdata)
+{
+    int expected = 0;
+
+    if ((alloc == NULL) || (dealloc == NULL))  // need both, or neither.
+    {
+        alloc = NULL;
+        dealloc = NULL;
+        userdata = NULL;
+    } // if
+
+    if (!__atomic_compare_exchange_n(&live_allocs, &expected, ALLOCATOR_CHANGING,
+                                     0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        set_dlerror("Can't change allocators while memory from this one is in use");
+        return 0;
+    } // if
+
+    app_alloc = alloc;
+    app_free = dealloc;
+    app_alloc_userdata = userdata;
+    __atomic_store_n(&live_allocs, 0, __ATOMIC_RELEASE);
+    return 1;
+} // MOJOELF_set_allocator
+
+static inline void count_alloc(void)
+{
+    int count = __atomic_load_n(&live_allocs, __ATOMIC_RELAXED);
+    while (1)
+    {
+        if (count == ALLOCATOR_CHANGING)
+            count = __atomic_load_n(&live_allocs, __ATOMIC_RELAXED);
+        else if (__atomic_compare_exchange_n(&live_allocs, &count, count + 1,
+                                             1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    } // while
+} // count_alloc
+
+static inline void uncount_alloc(void)
+{
+    __atomic_sub_fetch(&live_allocs, 1, __ATOMIC_RELEASE);
+} // uncount_alloc
+
+static inline void *Alloc(const size_t len)  // contents are undefined.
+{
+    void *retval;
+    count_alloc();
+    if (app_alloc != NULL)
+        retval = app_alloc(app_alloc_userdata, (unsigned long) len);
+    else
+        retval = malloc(len);
+
+    if (retval == NULL)
+    {
+        uncount_alloc();
+        set_dlerror("Out of memory");
+    } // if
+    return retval;
+} // Alloc
+
+static inline void *Malloc(const size_t len)  // zeroed.
 {
-    void *retval = calloc(1, len);
+    void *retval;
+    count_alloc();  // before we look at app_alloc, so it can't change.
+    if (app_alloc == NULL)
+        retval = calloc(1, len);
+    else if ((retval = app_alloc(app_alloc_userdata, (unsigned long) len)) != NULL)
+        Memzero(retval, len);
+
     if (retval == NULL)
+    {
+        uncount_alloc();
         set_dlerror("Out of memory");
+    } // if
     return retval;
 } // Malloc
 
+static inline void Free(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+    else if (app_free != NULL)
+        app_free(app_alloc_userdata, ptr);
+    else
+        free(ptr);
+    uncount_alloc();
+} // Free
+
 typedef struct ElfDynTable
 {
     uint32 d_tag;
@@ -391,6 +875,31 @@ typedef struct ElfDynTable
 typedef void (*ElfInitFn)(int argc, char **argv, char **envp);
 typedef void (*ElfFiniFn)(void);
 
+typedef struct ElfRelocTable
+{
+    const uint8 *entries;  // first entry, in the dlopen() buffer.
+    size_t count;  // number of entries.
+    int is_rela;  // nonzero for ElfRelA entries, zero for ElfRel.
+} ElfRelocTable;
+
+// The parts of an old image that MOJOELF_dlreload() hands to the new one.
+typedef struct ElfReload
+{
+    ElfHandle *handle;  // reuse this instead of allocating a new one.
+    void *mmapaddr;  // old mapping, reused if the new image fits in it.
+    size_t mmaplen;  // size of that mapping.
+    struct ElfArena *arena;  // where that mapping came from, or NULL.
+    void **dlopens;  // old dependencies; unloaded once we have ours.
+    int dlopens_count;  // number of entries in dlopens.
+    ElfImportTable *imports;  // what the old imports resolved to, or NULL.
+    int same_dlopens;  // nonzero if imports are still good for us.
+    void *metadata;  // old handle's separate metadata block, or NULL.
+} ElfReload;
+
+struct ElfRelocTask;
+struct ElfBatch;
+struct ElfNamespace;
+
 // Put a bunch of state we need during dlopen() into one struct; this lets
 //  us split one big function into more manageable chunks.
 typedef struct ElfContext
@@ -401,11 +910,13 @@ typedef struct ElfContext
     ElfHandle *retval;  // allocated handle to be returned from dlopen.
     const ElfDynTable *dyntab;  // PT_DYNAMIC tables.
     int dyntabcount;  // PT_DYNAMIC table count.
+    const ElfProgram *tlsprogram;  // PT_TLS segment, if there is one.
     uintptr base;  // "base address" for relative addressing.
     void *init;   // init function in shared library.
     void **init_array;   // init array function in shared library.
     int init_array_count;  // number of functions in the init array.
     size_t mmaplen;  // number of bytes we want to mmap().
+    size_t align;  // largest PT_LOAD alignment, at least a page.
     const char *strtab;  // string table for dynamic symbols.
     size_t strtablen;  // length in bytes of dynamic symbol string table.
     const ElfSymTable *symtab;  // the symbol table.
@@ -414,11 +925,133 @@ typedef struct ElfContext
     MOJOELF_LoaderCallback loader;    // loader callback.
     MOJOELF_UnloaderCallback unloader;  // unloader callback.
     MOJOELF_ResolverCallback resolver;  // resolver callback.
+    MOJOELF_BatchResolverCallback resolve_batch;  // batch resolver callback.
+    MOJOELF_ExecutorCallback executor;  // runs work items, maybe in parallel.
+    void *userdata;  // app data for the versioned callbacks.
+    unsigned int flags;  // MOJOELF_FLAG_* bits.
+    ElfRelocTable reloctabs[3];  // DT_RELA, DT_REL, DT_JMPREL, if present.
+    int reloctabcount;  // number of used entries in reloctabs.
+    size_t reloccount;  // total relocations in all tables.
+    int has_deferred_relocs;  // nonzero if we saw R_COPY or IFUNC relocs.
+    uint8 *ifuncs;  // per symtab index: 1 for our own IFUNCs, 2 once resolved.
+    MOJOELF_IfuncCallback ifunc;  // app override for running IFUNC resolvers.
+    uintptr plts[4];  // vaddrs of sections that look like PLTs.
+    size_t pltsizes[4];  // sizes in bytes of those sections.
+    int pltcount;  // number of used entries in plts.
+    const char *cache_dir;  // where relocated images get cached, or NULL.
+    uint64 imagehash;  // hash_buffer() of the image, if we're caching.
+    int cachefd;  // open cache entry that might match us, or -1.
+    void *cachebase;  // where that cache entry wants us mapped.
+    int hashed;  // nonzero once imagehash is calculated.
+    uint8 sharedigest[32];  // MOJOELF_FLAG_SHARE_IDENTICAL: sha256_buffer().
+    int digested;  // nonzero once sharedigest is calculated.
+    int snapshot;  // nonzero to cache the image after initializers run.
+    int skip_init;  // nonzero if a snapshot already has initializers' work.
+    uint8 *sharedpages;  // per page: nonzero if mapped from shared text.
+    int layoutfd;  // pre-relocated image from an image server, or -1.
+    void *layoutbase;  // the address that image was relocated for.
+    int prerelocated;  // nonzero if we mapped layoutfd at layoutbase.
+    ElfReload *reload;  // non-NULL if this is MOJOELF_dlreload().
+    struct ElfArena *arena;  // pack the image in here, if non-NULL.
+    MOJOELF_MapCallback map;  // app's replacement for mmap(), or NULL.
+    MOJOELF_ProtectCallback protect;  // app's replacement for mprotect(), or NULL.
+    uint8 *seen;  // per symtab index: nonzero if a relocation uses it.
+    uint32 *imports;  // unique symbol indexes referenced by relocations.
+    int importcount;  // number of entries in imports.
+    uintptr *symaddrs;  // resolved addresses, indexed like symtab.
+    uint8 *importfrom;  // MOJOELF_FLAG_RELOADABLE: IMPORT_FROM_*, like symtab.
+    int needed;  // number of DT_NEEDED entries.
+    uint8 *meta;  // handle's dlopens, syms, buckets and names come from here.
+    size_t metalen;  // bytes available at meta.
+    size_t metaused;  // bytes of meta handed out so far.
+    uint8 *workspace;  // app's memory for everything, or NULL to use the heap.
+    size_t workspacelen;  // bytes available at workspace.
+    size_t workspaceused;  // bytes of workspace handed out so far.
+    const MOJOELF_Callbacks *callbacks;  // normalized copy, for the handle.
+    uint64 deadline;  // CLOCK_MONOTONIC usecs when this step ends, or 0.
+    int yield;  // set when a chunked phase stopped early, with work left.
+    size_t cursor;  // where a chunked phase picks back up; 0 to start one.
+    struct ElfRelocTask *tasks;  // a chunked phase's work items, kept across steps.
+    int taskcount;  // number of entries in tasks.
+    int exportcount;  // symbols build_export_list() counted to export.
+    int cachehit;  // nonzero if the cache had the image already relocated.
+    const struct ElfBatch *batch;  // MOJOELF_dlopen_many()'s set, or NULL.
+    int batchindex;  // which image in batch this is.
+    uintptr *batchifuncs;  // our exported IFUNC resolvers, for the batch.
+    int batchifunccount;  // number of entries in batchifuncs.
+    struct ElfNamespace *ns;  // MOJOELF_namespace_dlopen()'s namespace, or NULL.
+    ElfHandle **nsdeps;  // DT_NEEDED entries the namespace already had.
+    int nsdepcount;  // number of entries in nsdeps.
 } ElfContext;
 
 #define DLOPEN_FAIL(err) do { set_dlerror(err); return 0; } while (0)
 
-static int validate_elf_header(const ElfContext *ctx)
+// Round up, so things carved out of one block stay pointer-aligned.
+#define ALIGN_PTR(x) (((x) + (sizeof (void *) - 1)) & ~(sizeof (void *) - 1))
+
+// Memory that only lives as long as the load. MOJOELF_dlopen_workspace()
+//  carves it from the app's workspace, and never gives any of it back;
+//  MOJOELF_workspace_size() adds up the worst case.
+static void *ctx_alloc(ElfContext *ctx, const size_t len)  // zeroed.
+{
+    uint8 *retval;
+
+    if (ctx->workspace == NULL)
+        return Malloc(len);
+    else if (ALIGN_PTR(len) > (ctx->workspacelen - ctx->workspaceused))
+    {
+        set_dlerror("Workspace is too small");
+        return NULL;
+    } // else if
+
+    retval = ctx->workspace + ctx->workspaceused;
+    ctx->workspaceused += ALIGN_PTR(len);
+    Memzero(retval, len);
+    return retval;
+} // ctx_alloc
+
+static inline void ctx_free(ElfContext *ctx, void *ptr)
+{
+    if (ctx->workspace == NULL)
+        Free(ptr);
+} // ctx_free
+
+// The handle's dlopens, syms, buckets and names all come out of the block
+//  alloc_handle() sized with measure_metadata(), so they never need freeing.
+static void *carve_metadata(ElfContext *ctx, const size_t len)
+{
+    uint8 *retval = ctx->meta + ctx->metaused;
+
+    if (ALIGN_PTR(len) > (ctx->metalen - ctx->metaused))
+    {
+        assert(0);
+        set_dlerror("Bug: handle metadata measured too small");
+        return NULL;
+    } // if
+
+    ctx->metaused += ALIGN_PTR(len);
+    return retval;
+} // carve_metadata
+
+static uint64 now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (((uint64) ts.tv_sec) * 1000000) + (((uint64) ts.tv_nsec) / 1000);
+} // now_usec
+
+// Chunked phases call this between chunks. Once MOJOELF_load_step()'s
+//  time is up, the phase should return early, and it'll get called again
+//  next step to pick up where it left off at ctx->cursor.
+static int out_of_time(ElfContext *ctx)
+{
+    if ((ctx->deadline == 0) || (now_usec() < ctx->deadline))
+        return 0;
+    ctx->yield = 1;
+    return 1;
+} // out_of_time
+
+static int validate_elf_header(ElfContext *ctx)
 {
     const ElfHeader *hdr = ctx->header;
     const uint8 *buf = hdr->e_ident;
@@ -487,6 +1120,38 @@ static int validate_elf_program(const ElfContext *ctx, const ElfProgram *prog)
 } // validate_elf_program
 
 
+// Either of these means constructors run later, not at the end of the load.
+#define DEFERRED_INIT_FLAGS (MOJOELF_FLAG_DEFER_INIT | MOJOELF_FLAG_INIT_ON_DLSYM)
+
+// Images can say their initializers are safe to snapshot with a note
+//  (see MOJOELF_SNAPSHOT_NOTE in mojoelf.h).
+static int has_snapshot_note(const ElfContext *ctx, const ElfProgram *program)
+{
+    const uint8 *ptr = ctx->buf + program->p_offset;
+    const uint8 *end = ptr + program->p_filesz;
+
+    if (ctx->flags & DEFERRED_INIT_FLAGS)
+        return 0;  // snapshots are taken after initializers, and we won't wait.
+
+    while ((end - ptr) >= 12)
+    {
+        const uint32 *note = (const uint32 *) ptr;
+        const uint32 namesz = note[0];
+        const uint32 descsz = note[1];
+        const uint32 type = note[2];
+        const uint8 *name = ptr + 12;
+        const size_t len = 12 + ((namesz + 3) & ~3) + ((descsz + 3) & ~3);
+        if ((len < 12) || (len > (size_t) (end - ptr)))
+            break;  // bogus, ignore the rest.
+        else if ((type == MOJOELF_NOTE_SNAPSHOT) && (namesz == 8) &&
+                 (memcmp(name, "MojoELF", 8) == 0))
+            return 1;
+        ptr += len;
+    } // while
+
+    return 0;
+} // has_snapshot_note
+
 static int process_program_headers(ElfContext *ctx)
 {
     // Figure out the memory range we'll need to allocate.
@@ -509,6 +1174,8 @@ static int process_program_headers(ElfContext *ctx)
                 ctx->mmaplen = endaddr;
             if (program->p_vaddr < ctx->base)
                 ctx->base = program->p_vaddr;
+            if (program->p_align > ctx->align)
+                ctx->align = (size_t) program->p_align;
         } // else if
 
         // When we see this header, take note for later.
@@ -520,6 +1187,18 @@ static int process_program_headers(ElfContext *ctx)
             ctx->dyntab = (const ElfDynTable *) (buf + program->p_offset);
             ctx->dyntabcount = (program->p_filesz / sizeof (ElfDynTable));
         } // else if
+
+        else if ((program->p_type == PT_NOTE) && (has_snapshot_note(ctx, program)))
+            ctx->snapshot = 1;
+
+        else if (program->p_type == PT_TLS)
+        {
+            if (ctx->tlsprogram != NULL)
+                DLOPEN_FAIL("Multiple PT_TLS segments");
+            else if ((program->p_align) && (program->p_align & (program->p_align - 1)))
+                DLOPEN_FAIL("Bogus PT_TLS alignment");
+            ctx->tlsprogram = program;
+        } // else if
     } // for
 
     if (ctx->mmaplen == 0)
@@ -528,6 +1207,8 @@ static int process_program_headers(ElfContext *ctx)
         DLOPEN_FAIL("No PT_DYNAMIC table");
 
     // Calculate the final base address and allocation size.
+    if (ctx->align < MOJOELF_PAGESIZE)
+        ctx->align = MOJOELF_PAGESIZE;
     ctx->base -= (ctx->base % MOJOELF_PAGESIZE);
     ctx->mmaplen -= (size_t) ctx->base;
     ctx->mmaplen += (MOJOELF_PAGESIZE - (ctx->mmaplen % MOJOELF_PAGESIZE));
@@ -565,6 +1246,18 @@ static int process_section_headers(ElfContext *ctx)
             ctx->symtabcount = section->sh_size / MOJOELF_SIZEOF_SYMENT;
             saw_dynsym = 1;
         } // if
+
+        // .plt and .plt.sec are executable with 16-byte entries. Nothing
+        //  else normally is. Remember them in case we patch them later.
+        else if ((section->sh_type == SHT_PROGBITS) &&
+                 (section->sh_flags & SHF_EXECINSTR) &&
+                 (section->sh_entsize == 16) &&
+                 (ctx->pltcount < (sizeof (ctx->plts) / sizeof (ctx->plts[0]))))
+        {
+            ctx->plts[ctx->pltcount] = section->sh_addr;
+            ctx->pltsizes[ctx->pltcount] = section->sh_size;
+            ctx->pltcount++;
+        } // else if
     } // for
 
     if ((!saw_dynsym) && (dt != NULL))
@@ -574,727 +1267,6398 @@ static int process_section_headers(ElfContext *ctx)
 } // process_section_headers
 
 
-// Get the ELF programs into memory at the right place.
-static int map_pages(ElfContext *ctx)
+// Multi-instance mode (MOJOELF_FLAG_SHARE_TEXT): pages that only hold
+//  read-only segments come from one memfd per unique image, mapped shared
+//  into every instance. Only pages with writable data in them stay private.
+//  Without text relocations, nothing ever writes to the shared pages.
+#if MOJOELF_SUPPORT_SHARED_TEXT
+typedef struct ElfSharedText
 {
-    // Get us an aligned block of memory where we can change page permissions.
-    // This is big enough to store all the program blocks and place them at
-    //  the correct relative offsets.
-    // !!! FIXME: should we be mapping each section separately?
-    const size_t offset = (size_t) ctx->header->e_phoff;
-    const ElfProgram *program = (const ElfProgram *) (ctx->buf + offset);
-    const int header_count = (int) ctx->header->e_phnum;
-    const size_t mmaplen = ctx->mmaplen;
-    const int mmapprot = PROT_READ | PROT_WRITE;
-    const int mmapflags = MAP_ANON | MAP_PRIVATE | (ctx->base ? MAP_FIXED : 0);
-    void *mmapaddr = mmap((void *) ctx->base, mmaplen, mmapprot, mmapflags, -1, 0);
+    uint64 imagehash;
+    uint64 imagelen;
+    size_t mmaplen;
+    int fd;  // memfd with the read-only segments at their mapped offsets.
+    int refcount;
+    struct ElfSharedText *next;
+} ElfSharedText;
+
+static ElfSharedText *shared_texts = NULL;
+static pthread_mutex_t shared_texts_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int has_text_relocations(const ElfContext *ctx)
+{
+    const ElfDynTable *dyntab = ctx->dyntab;
     int i;
+    for (i = 0; i < ctx->dyntabcount; i++, dyntab++)
+    {
+        if (dyntab->d_tag == DT_TEXTREL)
+            return 1;
+        else if ((dyntab->d_tag == DT_FLAGS) && (dyntab->d_un.d_val & DF_TEXTREL))
+            return 1;
+    } // for
+    return 0;
+} // has_text_relocations
 
-    if (mmapaddr == ((void *) MAP_FAILED))
-        DLOPEN_FAIL("mmap failed");
+// Mark pages that hold nothing but read-only segments.
+static uint8 *build_shared_page_map(const ElfContext *ctx)
+{
+    const size_t offset = (size_t) ctx->header->e_phoff;
+    const int header_count = (int) ctx->header->e_phnum;
+    const size_t pagecount = ctx->mmaplen / MOJOELF_PAGESIZE;
+    const ElfProgram *program;
+    uint8 *pages = (uint8 *) Malloc(pagecount);
+    int pass, i;
 
-    Memzero(mmapaddr, mmaplen);
-    ctx->retval->mmapaddr = mmapaddr;
-    ctx->retval->mmaplen = mmaplen;
+    if (pages == NULL)
+        return NULL;
 
-    // Put the program blocks at the correct relative positions.
-    for (i = 0; i < header_count; i++, program++)
+    // first pass marks read-only pages, second unmarks anything writable.
+    for (pass = 0; pass < 2; pass++)
     {
-        if ((program->p_type == PT_LOAD) && (program->p_memsz > 0))
+        program = (const ElfProgram *) (ctx->buf + offset);
+        for (i = 0; i < header_count; i++, program++)
         {
-            uint8 *ptr = ((uint8 *) mmapaddr) + (program->p_vaddr - ctx->base);
-            Memcopy(ptr, ctx->buf + program->p_offset, program->p_filesz);
-        } // if
+            if ((program->p_type == PT_LOAD) && (program->p_memsz > 0) &&
+                (((program->p_flags & 2) != 0) == (pass == 1)))
+            {
+                const size_t start = (program->p_vaddr - ctx->base) / MOJOELF_PAGESIZE;
+                const size_t end = ((program->p_vaddr - ctx->base) + program->p_memsz +
+                                    (MOJOELF_PAGESIZE - 1)) / MOJOELF_PAGESIZE;
+                size_t j;
+                for (j = start; (j < end) && (j < pagecount); j++)
+                    pages[j] = (pass == 0);
+            } // if
+        } // for
     } // for
 
-    // we mprotect() these pages later in the process, since fixups might want
-    //  to write to memory that will eventually be marked read-only, etc.
-    //  That happens in protect_pages().
-
-    return 1;
-} // map_pages
+    return pages;
+} // build_shared_page_map
 
-// Mark ELF pages with proper permissions.
-static int protect_pages(ElfContext *ctx)
+static ElfSharedText *create_shared_text(ElfContext *ctx)
 {
     const size_t offset = (size_t) ctx->header->e_phoff;
     const ElfProgram *program = (const ElfProgram *) (ctx->buf + offset);
     const int header_count = (int) ctx->header->e_phnum;
-    const int mmapprot = PROT_READ | PROT_WRITE;
-    void *mmapaddr = (void *) ctx->retval->mmapaddr;
+    ElfSharedText *text = NULL;
+    uint8 *ptr = MAP_FAILED;
+    int fd = -1;
     int i;
 
+    fd = (int) syscall(SYS_memfd_create, "mojoelf-text", MFD_CLOEXEC_FLAG);
+    if (fd == -1)
+        return NULL;
+    else if (ftruncate(fd, (off_t) ctx->mmaplen) == -1)
+        goto failed;
+
+    ptr = (uint8 *) mmap(NULL, ctx->mmaplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED)
+        goto failed;
+
+    // we only need the read-only segments; the rest of the file stays sparse.
     for (i = 0; i < header_count; i++, program++)
     {
-        if ((program->p_type == PT_LOAD) && (program->p_memsz > 0))
-        {
-            uint8 *ptr = ((uint8 *) mmapaddr) + (program->p_vaddr - ctx->base);
-            const size_t len = (const size_t) program->p_memsz;
-            const int prot = ((program->p_flags & 1) ? PROT_EXEC : 0)  |
-                             ((program->p_flags & 2) ? PROT_WRITE : 0) |
-                             ((program->p_flags & 4) ? PROT_READ : 0)  ;
-            if ((prot != mmapprot) && (mprotect(ptr, len, prot) == -1))
-                DLOPEN_FAIL("mprotect failed");
-        } // if
+        if ((program->p_type == PT_LOAD) && (program->p_memsz > 0) && ((program->p_flags & 2) == 0))
+            Memcopy(ptr + (program->p_vaddr - ctx->base), ctx->buf + program->p_offset, program->p_filesz);
     } // for
 
-    return 1;  // all good.
-} // protect_pages
+    munmap(ptr, ctx->mmaplen);
 
-static int walk_dynamic_table(ElfContext *ctx)
+    text = (ElfSharedText *) Malloc(sizeof (ElfSharedText));
+    if (text == NULL)
+        goto failed;
+
+    text->imagehash = ctx->imagehash;
+    text->imagelen = (uint64) ctx->buflen;
+    text->mmaplen = ctx->mmaplen;
+    text->fd = fd;
+    text->refcount = 1;
+    return text;
+
+failed:
+    close(fd);
+    return NULL;
+} // create_shared_text
+
+// Same hash, same lengths: now make sure every page we'd map from text
+//  holds exactly what copy_segments() would have put there. Caller holds
+//  shared_texts_mutex.
+static int shared_text_matches(const ElfContext *ctx, const ElfSharedText *text,
+                               const uint8 *pages)
 {
-    // preliminary walkthrough of the dynamic table.
-    const ElfDynTable *dyntab = ctx->dyntab;
-    const ElfDynTable **dyntabs = ctx->dyntabs;
-    const int dyntabcount = ctx->dyntabcount;
-    uint8 *mmapaddr = (uint8 *) ctx->retval->mmapaddr;
-    uintptr strtaboffset = 0;
-    int i;
+    const size_t offset = (size_t) ctx->header->e_phoff;
+    const int header_count = (int) ctx->header->e_phnum;
+    const size_t pagecount = ctx->mmaplen / MOJOELF_PAGESIZE;
+    uint8 *expected = (uint8 *) Malloc(MOJOELF_PAGESIZE * 2);
+    uint8 *actual = expected + MOJOELF_PAGESIZE;
+    int retval = 1;
+    size_t i;
 
-    for (i = 0; i < dyntabcount; i++, dyntab++)
+    if (expected == NULL)
     {
-        const int tag = (int) dyntab->d_tag;
+        (void) take_dlerror();
+        return 0;  // we'll just make a new one.
+    } // if
 
-        if (tag == DT_NULL)
-            continue;
-        else if (tag == DT_NEEDED)
-        {
-            ctx->retval->dlopens_count++;
+    for (i = 0; (retval) && (i < pagecount); i++)
+    {
+        const uintptr pagestart = i * MOJOELF_PAGESIZE;
+        const uintptr pageend = pagestart + MOJOELF_PAGESIZE;
+        const ElfProgram *program = (const ElfProgram *) (ctx->buf + offset);
+        int j;
+
+        if (!pages[i])
             continue;
-        } // if
 
-        if (tag < (sizeof (ctx->dyntabs) / sizeof (ctx->dyntabs[0])))
+        Memzero(expected, MOJOELF_PAGESIZE);
+        for (j = 0; j < header_count; j++, program++)
         {
-            if (dyntabs[tag] != NULL)
-                DLOPEN_FAIL("Illegal duplicate dynamic tables");
-            dyntabs[tag] = dyntab;
-        } // if
-    } // for
+            if ((program->p_type == PT_LOAD) && (program->p_filesz > 0) && ((program->p_flags & 2) == 0))
+            {
+                const uintptr start = program->p_vaddr - ctx->base;
+                const uintptr end = start + program->p_filesz;
+                if ((start < pageend) && (end > pagestart))
+                {
+                    const uintptr from = (start > pagestart) ? start : pagestart;
+                    const uintptr to = (end < pageend) ? end : pageend;
+                    Memcopy(expected + (from - pagestart),
+                            ctx->buf + program->p_offset + (from - start), to - from);
+                } // if
+            } // if
+        } // for
 
-    // okay, all the tables are indexed now, so we don't have to worry about
-    //  dupes or missing fields, or ordering issues.
-    // Now that we've shuffled this stuff into an index, process it.
+        if (pread(text->fd, actual, MOJOELF_PAGESIZE, (off_t) pagestart) != MOJOELF_PAGESIZE)
+            retval = 0;
+        else if (memcmp(expected, actual, MOJOELF_PAGESIZE) != 0)
+            retval = 0;
+    } // for
 
-    if (dyntabs[DT_STRTAB] == NULL)
-        DLOPEN_FAIL("No DT_STRTAB table");
-    else if (dyntabs[DT_STRSZ] == NULL)
-        DLOPEN_FAIL("No DT_STRSZ table");
-    else if (dyntabs[DT_SYMTAB] == NULL)
-        DLOPEN_FAIL("No DT_SYMTAB table");
-    else if (dyntabs[DT_SYMENT] == NULL)
-        DLOPEN_FAIL("No DT_SYMENT table");
-    else if (dyntabs[DT_SYMENT]->d_un.d_val != MOJOELF_SIZEOF_SYMENT)
-        DLOPEN_FAIL("Bogus DT_SYMENT value");
+    Free(expected);
+    return retval;
+} // shared_text_matches
 
-    // We don't know the size of the symbol table yet. We check that later
-    //  in process_section_headers()...
-    ctx->symtab = (const ElfSymTable *)
-                    (ctx->buf + (dyntabs[DT_SYMTAB]->d_un.d_ptr - ctx->base));
+// Find or make the shared pages for this image, and map them over the
+//  parts of our new mapping that can use them. If any of this fails, we
+//  just keep private copies, like usual.
+static void attach_shared_text(ElfContext *ctx)
+{
+    uint8 *mmapaddr = (uint8 *) ctx->retval->mmapaddr;
+    const size_t pagecount = ctx->mmaplen / MOJOELF_PAGESIZE;
+    ElfSharedText *text = NULL;
+    uint8 *pages = NULL;
+    size_t i;
 
-    if (dyntabs[DT_RELA])
+    if ((ctx->flags & MOJOELF_FLAG_SHARE_TEXT) == 0)
+        return;
+    else if (has_text_relocations(ctx))
+        return;  // every instance needs its own text.
+    else if ((pages = build_shared_page_map(ctx)) == NULL)
     {
-        if (dyntabs[DT_RELASZ] == NULL)
-            DLOPEN_FAIL("No DT_RELASZ table");
-        else if (dyntabs[DT_RELAENT] == NULL)
-            DLOPEN_FAIL("No DT_RELAENT table");
-        else if (dyntabs[DT_RELAENT]->d_un.d_val != MOJOELF_SIZEOF_RELAENT)
-            DLOPEN_FAIL("Unsupported/bogus DT_RELAENT value");
-        else if (dyntabs[DT_RELASZ]->d_un.d_val % MOJOELF_SIZEOF_RELAENT)
-            DLOPEN_FAIL("Bogus DT_RELASZ value");
-        else if ((dyntabs[DT_RELA]->d_un.d_ptr - ctx->base) +
-                 dyntabs[DT_RELASZ]->d_un.d_val >= ctx->buflen)
-            DLOPEN_FAIL("Bogus DT_RELA value");
-    } // if
+        (void) take_dlerror();
+        return;
+    } // else if
 
-    if (dyntabs[DT_REL])
+    if (!ctx->hashed)
     {
-        if (dyntabs[DT_RELSZ] == NULL)
-            DLOPEN_FAIL("No DT_RELSZ table");
-        else if (dyntabs[DT_RELENT] == NULL)
-            DLOPEN_FAIL("No DT_RELENT table");
-        else if (dyntabs[DT_RELENT]->d_un.d_val != MOJOELF_SIZEOF_RELENT)
-            DLOPEN_FAIL("Unsupported/bogus DT_RELENT value");
-        else if (dyntabs[DT_RELSZ]->d_un.d_val % MOJOELF_SIZEOF_RELENT)
-            DLOPEN_FAIL("Bogus DT_RELSZ value");
-        else if ((dyntabs[DT_REL]->d_un.d_ptr - ctx->base) >= ctx->buflen)
-            DLOPEN_FAIL("Bogus DT_REL value");
+        ctx->imagehash = hash_buffer(ctx->buf, ctx->buflen);
+        ctx->hashed = 1;
     } // if
 
-    if (dyntabs[DT_JMPREL])
+    pthread_mutex_lock(&shared_texts_mutex);
+    for (text = shared_texts; text != NULL; text = text->next)
     {
-        if (dyntabs[DT_PLTREL] == NULL)
-            DLOPEN_FAIL("No DT_PLTREL table");
-        else if (dyntabs[DT_PLTRELSZ] == NULL)
-            DLOPEN_FAIL("No DT_PLTRELSZ table");
-        else if ((dyntabs[DT_JMPREL]->d_un.d_ptr - ctx->base) +
-                 dyntabs[DT_PLTRELSZ]->d_un.d_val >= ctx->buflen)
-            DLOPEN_FAIL("Bogus DT_PLTREL value");
-
-        if (dyntabs[DT_PLTREL]->d_un.d_val == DT_REL)
+        if ((text->imagehash == ctx->imagehash) &&
+            (text->imagelen == (uint64) ctx->buflen) &&
+            (text->mmaplen == ctx->mmaplen) &&
+            (shared_text_matches(ctx, text, pages)))
         {
-            if (dyntabs[DT_RELENT] == NULL)  // DT_RELENT
-                DLOPEN_FAIL("No DT_RELENT table");
-            else if (dyntabs[DT_RELENT]->d_un.d_val != MOJOELF_SIZEOF_RELENT)
-                DLOPEN_FAIL("Unsupported/bogus DT_RELENT value");
-            else if (dyntabs[DT_PLTRELSZ]->d_un.d_val % MOJOELF_SIZEOF_RELENT)
-                DLOPEN_FAIL("Bogus DT_PLTRELSZ value");
+            text->refcount++;
+            break;
         } // if
+    } // for
 
-        else if (dyntabs[DT_PLTREL]->d_un.d_val == DT_RELA)
+    if (text == NULL)
+    {
+        text = create_shared_text(ctx);
+        if (text != NULL)
         {
-            if (dyntabs[DT_RELAENT] == NULL)  // DT_RELAENT
-                DLOPEN_FAIL("No DT_RELAENT table");
-            else if (dyntabs[DT_RELAENT]->d_un.d_val != MOJOELF_SIZEOF_RELAENT)
-                DLOPEN_FAIL("Unsupported/bogus DT_RELAENT value");
-            else if (dyntabs[DT_PLTRELSZ]->d_un.d_val % MOJOELF_SIZEOF_RELAENT)
-                DLOPEN_FAIL("Bogus DT_PLTRELSZ value");
-        } // else if
+            text->next = shared_texts;
+            shared_texts = text;
+        } // if
+    } // if
+    pthread_mutex_unlock(&shared_texts_mutex);
+
+    if (text == NULL)
+    {
+        (void) take_dlerror();
+        Free(pages);
+        return;
+    } // if
+
+    ctx->retval->sharedtext = text;
 
+    // map runs of shareable pages. The fixups never touch these, and
+    //  protect_pages() sets the final permissions.
+    for (i = 0; i < pagecount; )
+    {
+        size_t end = i;
+        while ((end < pagecount) && (pages[end]))
+            end++;
+
+        if (end > i)
+        {
+            void *addr = mmapaddr + (i * MOJOELF_PAGESIZE);
+            const size_t len = (end - i) * MOJOELF_PAGESIZE;
+            const off_t fileoffset = (off_t) (i * MOJOELF_PAGESIZE);
+            if (mmap(addr, len, PROT_READ, MAP_SHARED | MAP_FIXED, text->fd, fileoffset) == MAP_FAILED)
+            {
+                // put private memory back; copy_segments() fills it.
+                if (mmap(addr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_FIXED, -1, 0) != addr)
+                    break;  // !!! FIXME: we're in real trouble here.
+                Memzero(pages + i, end - i);
+            } // if
+            i = end;
+        } // if
         else
         {
-            DLOPEN_FAIL("Bogus DT_PLTREL value");
+            i++;
         } // else
-    } // if
+    } // for
 
-    strtaboffset = dyntabs[DT_STRTAB]->d_un.d_ptr - ctx->base;
-    ctx->strtablen = (size_t) dyntabs[DT_STRSZ]->d_un.d_val;
-    ctx->strtab = (const char *) (ctx->buf + strtaboffset);
-    if (ctx->strtablen == 0)  // technically this is allowed, but oh well.
-        DLOPEN_FAIL("Dynamic string table is empty");
-    else if ((strtaboffset + ctx->strtablen) > ctx->buflen)
-        DLOPEN_FAIL("Dynamic string table has bogus offset and/or length");
-    else if (ctx->strtab[0] != '\0')
-        DLOPEN_FAIL("Dynamic string table doesn't start with null byte");
-    else if (ctx->strtab[ctx->strtablen - 1] != '\0')
-        DLOPEN_FAIL("Dynamic string table doesn't end with null byte");
+    ctx->sharedpages = pages;
+} // attach_shared_text
 
-    if (dyntabs[DT_INIT])
-        ctx->init = mmapaddr + (dyntabs[DT_INIT]->d_un.d_ptr-ctx->base);
+static void release_shared_text(ElfSharedText *text)
+{
+    int last = 0;
 
-    if (dyntabs[DT_FINI])
-        ctx->retval->fini = mmapaddr + (dyntabs[DT_FINI]->d_un.d_ptr-ctx->base);
+    if (text == NULL)
+        return;
 
-    if (dyntabs[DT_INIT_ARRAY])
+    pthread_mutex_lock(&shared_texts_mutex);
+    if (--text->refcount == 0)
     {
-        if (dyntabs[DT_INIT_ARRAYSZ] == NULL)
-            DLOPEN_FAIL("No DT_INIT_ARRAYSZ table");
-        else if (dyntabs[DT_INIT_ARRAYSZ]->d_un.d_val % sizeof (void*))
-            DLOPEN_FAIL("Bogus DT_INIT_ARRAYSZ value");
-        else if ((dyntabs[DT_INIT_ARRAY]->d_un.d_ptr - ctx->base) +
-                 dyntabs[DT_INIT_ARRAYSZ]->d_un.d_val >= ctx->buflen)
-            DLOPEN_FAIL("Bogus DT_INIT_ARRAY value");
-        ctx->init_array = (void **) (mmapaddr + (dyntabs[DT_INIT_ARRAY]->d_un.d_ptr-ctx->base));
-        ctx->init_array_count = (int) (dyntabs[DT_INIT_ARRAYSZ]->d_un.d_val / sizeof (void*));
+        ElfSharedText **prev = &shared_texts;
+        while (*prev != text)
+            prev = &(*prev)->next;
+        *prev = text->next;
+        last = 1;
     } // if
+    pthread_mutex_unlock(&shared_texts_mutex);
 
-    if (dyntabs[DT_FINI_ARRAY])
+    if (last)
     {
-        if (dyntabs[DT_FINI_ARRAYSZ] == NULL)
-            DLOPEN_FAIL("No DT_FINI_ARRAYSZ table");
-        else if (dyntabs[DT_FINI_ARRAYSZ]->d_un.d_val % sizeof (void*))
-            DLOPEN_FAIL("Bogus DT_FINI_ARRAYSZ value");
-        else if ((dyntabs[DT_FINI_ARRAY]->d_un.d_ptr - ctx->base) +
-                 dyntabs[DT_FINI_ARRAYSZ]->d_un.d_val >= ctx->buflen)
-            DLOPEN_FAIL("Bogus DT_FINI_ARRAY value");
-        ctx->retval->fini_array = (void **) (mmapaddr + (dyntabs[DT_FINI_ARRAY]->d_un.d_ptr-ctx->base));
-        ctx->retval->fini_array_count = (int) (dyntabs[DT_FINI_ARRAYSZ]->d_un.d_val / sizeof (void*));
+        close(text->fd);
+        Free(text);
     } // if
+} // release_shared_text
 
-    return 1;
-} // walk_dynamic_table
-
+#else
+#define attach_shared_text(ctx) do {} while (0)
+#define release_shared_text(text) do {} while (0)
+#endif
 
-// We might need to load symbols in other libraries. The app-supplied
-//  callbacks will be given a chance to handle symbol resolution here.
-static int load_external_dependencies(ElfContext *ctx)
+// Copy into the mapping, skipping any pages that are shared text. Those
+//  already have the right bytes, and they aren't writable.
+static void copy_to_image(ElfContext *ctx, uintptr offset, const uint8 *src, size_t len)
 {
-    const ElfDynTable *dyntab = ctx->dyntab;
-    const int dyntabcount = ctx->dyntabcount;
-    const char *rpath = NULL;
-    const char *runpath = NULL;
-    int dlopens_count = 0;
-    int i;
+    uint8 *mmapaddr = (uint8 *) ctx->retval->mmapaddr;
 
-    if (ctx->dyntabs[DT_RPATH] != NULL)
+    if (ctx->sharedpages == NULL)
     {
-        const size_t offset = ctx->dyntabs[DT_RPATH]->d_un.d_val;
-        if (offset >= ctx->strtablen)
-            DLOPEN_FAIL("Bogus DT_RPATH string");
-        rpath = ctx->strtab + offset;
+        Memcopy(mmapaddr + offset, src, len);
+        return;
     } // if
 
-    if (ctx->dyntabs[DT_RUNPATH] != NULL)
+    while (len > 0)
     {
-        const size_t offset = ctx->dyntabs[DT_RUNPATH]->d_un.d_val;
-        if (offset >= ctx->strtablen)
-            DLOPEN_FAIL("Bogus DT_RUNPATH string");
-        runpath = ctx->strtab + offset;
-    } // if
-
-    if (ctx->retval->dlopens_count == 0)
-        return 1;  // nothing to do.
+        size_t chunk = MOJOELF_PAGESIZE - (offset % MOJOELF_PAGESIZE);
+        if (chunk > len)
+            chunk = len;
+        if (!ctx->sharedpages[offset / MOJOELF_PAGESIZE])
+            Memcopy(mmapaddr + offset, src, chunk);
+        offset += chunk;
+        src += chunk;
+        len -= chunk;
+    } // while
+} // copy_to_image
 
-    ctx->retval->dlopens = (void **) Malloc(ctx->retval->dlopens_count * sizeof (void *));
-    if (ctx->retval->dlopens == NULL)
-        return 0;
+// Put the program blocks at the correct relative positions. If there's a
+//  cache entry that might replace the writable ones, those can wait.
+//  If _pos isn't NULL, it's how many bytes are already copied, counting the
+//  blocks end to end, and this stops early if the step runs out of time.
+static void copy_segments_from(ElfContext *ctx, const int writable, size_t *_pos)
+{
+    const size_t offset = (size_t) ctx->header->e_phoff;
+    const ElfProgram *program = (const ElfProgram *) (ctx->buf + offset);
+    const int header_count = (int) ctx->header->e_phnum;
+    size_t skip = (_pos != NULL) ? *_pos : 0;
+    int i;
 
-    // Find the libraries to load.
-    for (i = 0; i < dyntabcount; i++, dyntab++)
+    for (i = 0; i < header_count; i++, program++)
     {
-        if (dyntab->d_tag == DT_NEEDED)
+        if ((program->p_type == PT_LOAD) && (program->p_memsz > 0) &&
+            ((program->p_flags & 2) ? writable : 1))
         {
-            const size_t offset = dyntab->d_un.d_val;
-            if (offset >= ctx->strtablen)
-                DLOPEN_FAIL("Bogus DT_NEEDED string");
-            else
+            const uintptr offset = program->p_vaddr - ctx->base;
+            const size_t len = (size_t) program->p_filesz;
+            size_t pos = skip;
+
+            if (skip >= len)
             {
-                const char *str = ctx->strtab + offset;
-                void *handle = NULL;
+                skip -= len;  // done with this one already.
+                continue;
+            } // if
 
-                dbgprintf(("asking loader for \"%s\" (rpath \"%s\", runpath \"%s\") ...\n", str, rpath, runpath));
-                handle = ctx->loader(str, rpath, runpath);
-                if (!handle)
-                    DLOPEN_FAIL("Couldn't load dependency");
+            skip = 0;
+            if (_pos == NULL)
+            {
+                copy_to_image(ctx, offset + pos, ctx->buf + program->p_offset + pos, len - pos);
+                continue;
+            } // if
 
-                ctx->retval->dlopens[dlopens_count++] = handle;
-                if (dlopens_count >= ctx->retval->dlopens_count)
-                    return 1;  // done!
-            } // else
+            while (pos < len)
+            {
+                size_t chunk = len - pos;
+                if (chunk > MOJOELF_COPY_CHUNK_SIZE)
+                    chunk = MOJOELF_COPY_CHUNK_SIZE;
+                copy_to_image(ctx, offset + pos, ctx->buf + program->p_offset + pos, chunk);
+                pos += chunk;
+                *_pos += chunk;
+                if (out_of_time(ctx))
+                    return;
+            } // while
         } // if
     } // for
+} // copy_segments_from
 
-    assert(0);
-    DLOPEN_FAIL("Bug: didn't see as many DT_NEEDED on second pass");
-} // load_external_dependencies
+static int copy_segments(ElfContext *ctx, const int writable)
+{
+    copy_segments_from(ctx, writable, NULL);
+    return 1;
+} // copy_segments
 
+// Address-space arenas (MOJOELF_arena_create()). The app reserves one big
+//  range up front, and images get packed into it back to back instead of
+//  landing wherever mmap() likes. Parts of the range not in use are
+//  PROT_NONE, so they cost address space but no memory.
+typedef struct ElfArenaBlock
+{
+    size_t offset;  // from the start of the arena.
+    size_t len;  // in bytes, always a multiple of the page size.
+    struct ElfArenaBlock *next;  // next free block, sorted by offset.
+} ElfArenaBlock;
 
-static int resolve_symbol(ElfContext *ctx, const uint32 sym, uintptr *_addr)
+typedef struct ElfArena
 {
-    const ElfSymTable *symbol = ctx->symtab + sym;
-    const char *symstr = NULL;
-    void *addr = NULL;
+    uint8 *base;  // start of the reserved range.
+    size_t size;  // size in bytes of the reserved range.
+    size_t guard;  // bytes of PROT_NONE left after each image.
+    ElfArenaBlock *free_blocks;  // unused ranges, sorted and coalesced.
+    #if MOJOELF_SUPPORT_THREADS
+    pthread_mutex_t mutex;
+    #endif
+} ElfArena;
 
-    if ((symbol->st_value) && ((symbol->st_value - ctx->base) > ctx->retval->mmaplen))
-        DLOPEN_FAIL("Bogus symbol address");
-    else if (symbol->st_name >= ctx->strtablen)
-        DLOPEN_FAIL("Bogus symbol name");
+#if MOJOELF_SUPPORT_THREADS
+#define lock_arena(arena) pthread_mutex_lock(&(arena)->mutex)
+#define unlock_arena(arena) pthread_mutex_unlock(&(arena)->mutex)
+#else
+#define lock_arena(arena) do {} while (0)
+#define unlock_arena(arena) do {} while (0)
+#endif
 
-    symstr = ctx->strtab + symbol->st_name;
+void *MOJOELF_arena_create(const unsigned long size, const unsigned int flags)
+{
+    const size_t len = (((size_t) size) + (MOJOELF_PAGESIZE-1)) & ~((size_t) (MOJOELF_PAGESIZE-1));
+    ElfArena *arena = NULL;
+    void *base = MAP_FAILED;
 
-    if (*symstr == '\0')
-        addr = ((uint8 *) ctx->retval->mmapaddr) + symbol->st_value;
-    else
+    if (len == 0)
     {
-        dbgprintf(("Resolving '%s' ...\n", symstr));
-
-        int i;
-        for (i = 0; (addr == NULL) && (i < ctx->retval->dlopens_count); i++)
-            addr = ctx->resolver(ctx->retval->dlopens[i], symstr);
+        set_dlerror("Bogus arena size");
+        return NULL;
+    } // if
 
-        if (addr == NULL)
-        {
-            // try our own export table?
-            addr = MOJOELF_dlsym(ctx->retval, symstr);
-            if (addr == NULL)
-            {
-                addr = ctx->resolver(NULL, symstr);  // last try.
-                if (addr == NULL)
-                {
-                    if (ELF_ST_BIND(symbol->st_info) != STB_WEAK)
-                        DLOPEN_FAIL("Couldn't resolve symbol");
-                } // if
-            } // if
-        } // if
+    arena = (ElfArena *) Malloc(sizeof (ElfArena));
+    if (arena == NULL)
+        return NULL;
 
-        dbgprintf(("Resolved '%s' to %p ...\n", symstr, addr));
+    arena->free_blocks = (ElfArenaBlock *) Malloc(sizeof (ElfArenaBlock));
+    if (arena->free_blocks == NULL)
+    {
+        Free(arena);
+        return NULL;
     } // if
 
-    *_addr = (uintptr) addr;
-    return 1;
-} // resolve_symbol
+    base = mmap(NULL, len, PROT_NONE, MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        set_dlerror("mmap failed");
+        Free(arena->free_blocks);
+        Free(arena);
+        return NULL;
+    } // if
 
+    arena->base = (uint8 *) base;
+    arena->size = len;
+    arena->guard = (flags & MOJOELF_ARENA_GUARD_PAGES) ? MOJOELF_PAGESIZE : 0;
+    arena->free_blocks->offset = 0;
+    arena->free_blocks->len = len;
+    #if MOJOELF_SUPPORT_THREADS
+    pthread_mutex_init(&arena->mutex, NULL);
+    #endif
+    return arena;
+} // MOJOELF_arena_create
 
-static int do_fixup(ElfContext *ctx, const uint32 r_type, const uint32 r_sym,
-                    const uintptr r_offset, const intptr r_addend)
+void MOJOELF_arena_destroy(void *_arena)
 {
-    uint8 *mmapaddr = (uint8 *) ctx->retval->mmapaddr;
-    uintptr *fixup = (uintptr *) (mmapaddr + (r_offset - ctx->base));
-    uintptr addr = 0;
+    ElfArena *arena = (ElfArena *) _arena;
+    ElfArenaBlock *block;
 
-    if (r_sym >= ctx->symtabcount)
-        DLOPEN_FAIL("Bogus symbol index");
-    else if ((r_sym) && (!resolve_symbol(ctx, r_sym, &addr)))
-        return 0;
+    if (arena == NULL)
+        return;
 
-    switch (r_type)
+    munmap(arena->base, arena->size);
+    while ((block = arena->free_blocks) != NULL)
     {
-        // There are way more than these, but these seem to be the
-        //  only ones average libraries use.
-        // Note libc.so.6 itself also seems to use: R_*_64, R_*_TPOFF64
-// !!! FIXME: This is all x86-specific. Research x86_64.
-        case R_COPY:
-            if (!r_sym)
-                DLOPEN_FAIL("Bogus copy fixup");
-            // !!! FIXME: this should check the source and dest symbols,
-            // !!! FIXME:  use the smaller size (but they _should_ match
-            // !!! FIXME:  if everything is built correctly. Naturally, this
-            // !!! FIXME:  will fail to be true eventually).
-            memcpy(fixup, (void *) addr, (ctx->symtab+r_sym)->st_size);
-            break;
-        case R_GLOB_DATA:
-        case R_JUMP_SLOT:
-            *fixup = addr;
-            break;
-        case R_RELATIVE:
-            *fixup += (uintptr) (mmapaddr + r_addend);
-            break;
-        case R_32:  // !!! FIXME: presumable should be (uint32), not (uintptr).
-            *fixup += (uintptr) (addr + r_addend);
-            break;
-        case R_PC32:  // !!! FIXME: presumable should be (uint32), not (uintptr).
-            *fixup += (uintptr) ((addr + r_addend) - ((uintptr) fixup));
-            break;
-        case R_NONE:
-            break;  // do nothing.
-        default:
-            DLOPEN_FAIL("write me");  // haven't seen this yet.
+        arena->free_blocks = block->next;
+        Free(block);
+    } // while
+
+    #if MOJOELF_SUPPORT_THREADS
+    pthread_mutex_destroy(&arena->mutex);
+    #endif
+    Free(arena);
+} // MOJOELF_arena_destroy
+
+// First fit, so images loaded in the same order land in the same places.
+static void *arena_alloc(ElfArena *arena, const size_t len)
+{
+    const size_t want = len + arena->guard;
+    ElfArenaBlock **prev = &arena->free_blocks;
+    ElfArenaBlock *block;
+    void *retval = NULL;
+
+    lock_arena(arena);
+    for (block = *prev; block != NULL; prev = &block->next, block = *prev)
+    {
+        if (block->len >= want)
+        {
+            retval = arena->base + block->offset;
+            block->offset += want;
+            block->len -= want;
+            if (block->len == 0)
+            {
+                *prev = block->next;
+                Free(block);
+            } // if
             break;
-    } // switch
+        } // if
+    } // for
+    unlock_arena(arena);
+
+    if (retval == NULL)
+        set_dlerror("Arena is full");
+    return retval;
+} // arena_alloc
+
+static void arena_release(ElfArena *arena, void *addr, const size_t len)
+{
+    const size_t offset = (size_t) (((uint8 *) addr) - arena->base);
+    const size_t total = len + arena->guard;
+    ElfArenaBlock *before = NULL;
+    ElfArenaBlock *after = NULL;
+    ElfArenaBlock *block = NULL;
+
+    // drop the pages, but keep the address range.
+    mmap(addr, len, PROT_NONE, MAP_ANON | MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, -1, 0);
+
+    lock_arena(arena);
+    for (after = arena->free_blocks; (after != NULL) && (after->offset < offset); after = after->next)
+        before = after;
+
+    if ((before != NULL) && ((before->offset + before->len) == offset))
+    {
+        block = before;
+        block->len += total;
+    } // if
+    else if ((block = (ElfArenaBlock *) Malloc(sizeof (ElfArenaBlock))) == NULL)
+    {
+        unlock_arena(arena);
+        (void) take_dlerror();
+        return;  // oh well, we just can't reuse this range.
+    } // else if
+    else
+    {
+        block->offset = offset;
+        block->len = total;
+        block->next = after;
+        if (before != NULL)
+            before->next = block;
+        else
+            arena->free_blocks = block;
+    } // else
+
+    if ((after != NULL) && ((block->offset + block->len) == after->offset))
+    {
+        block->len += after->len;
+        block->next = after->next;
+        Free(after);
+    } // if
+    unlock_arena(arena);
+} // arena_release
+
+static void unmap_image(const MOJOELF_Callbacks *cb, ElfArena *arena,
+                        void *addr, const size_t len)
+{
+    if (addr == MAP_FAILED)
+        return;
+    else if (cb->map != NULL)  // the app mapped it, so the app unmaps it.
+    {
+        if (cb->unmap != NULL)
+            cb->unmap(cb->userdata, addr, (unsigned long) len);
+    } // else if
+    else if (arena != NULL)
+        arena_release(arena, addr, len);
+    else
+        munmap(addr, len);
+} // unmap_image
+
+// Get the ELF programs into memory at the right place.
+static int map_pages(ElfContext *ctx)
+{
+    // Get us an aligned block of memory where we can change page permissions.
+    // This is big enough to store all the program blocks and place them at
+    //  the correct relative offsets.
+    // !!! FIXME: should we be mapping each section separately?
+    const size_t mmaplen = ctx->mmaplen;
+    const int mmapprot = PROT_READ | PROT_WRITE;
+    const int mmapflags = MAP_ANON | MAP_PRIVATE | (ctx->base ? MAP_FIXED : 0);
+    void *mmapaddr = MAP_FAILED;
+    void *preferred = NULL;
+
+    // MOJOELF_dlreload() keeps the old image's address range if we fit.
+    //  Mapping over it gets us fresh zeroed pages without giving it up.
+    if ((ctx->reload != NULL) && (ctx->reload->mmapaddr != MAP_FAILED))
+    {
+        ElfReload *reload = ctx->reload;
+        uint8 *oldaddr = (uint8 *) reload->mmapaddr;
+        size_t oldlen = reload->mmaplen;
+        if ((reload->arena == NULL) && (ctx->map == NULL) && (ctx->base == 0) && (mmaplen <= oldlen))
+        {
+            mmapaddr = mmap(oldaddr, mmaplen, mmapprot, mmapflags | MAP_FIXED, -1, 0);
+            if (mmapaddr != MAP_FAILED)
+            {
+                oldaddr += mmaplen;  // just give back what we don't need.
+                oldlen -= mmaplen;
+            } // if
+        } // if
+
+        // arenas get the whole thing back; first fit usually hands the
+        //  same spot right back to us below. Apps get it back too, with
+        //  a hint that we'd like it again.
+        if (oldlen > 0)
+            unmap_image(&ctx->retval->callbacks, reload->arena, oldaddr, oldlen);
+        if (ctx->map != NULL)
+            preferred = reload->mmapaddr;
+        reload->mmapaddr = MAP_FAILED;
+    } // if
+
+    // The app wants to place this itself. It has to hand back zeroed memory
+    //  we can read and write, but we'd rather not trust a pool to be clean.
+    if ((mmapaddr == ((void *) MAP_FAILED)) && (ctx->map != NULL))
+    {
+        const int fixed = (ctx->base != 0);
+        void *want = fixed ? ((void *) ctx->base) : preferred;
+        mmapaddr = ctx->map(ctx->userdata, want, (unsigned long) mmaplen,
+                            (unsigned long) ctx->align, fixed);
+        if (mmapaddr == NULL)
+            DLOPEN_FAIL("App's map callback failed");
+        else if ((fixed) && (mmapaddr != want))
+        {
+            unmap_image(&ctx->retval->callbacks, NULL, mmapaddr, mmaplen);
+            DLOPEN_FAIL("App's map callback ignored fixed address");
+        } // else if
+        else if ((((uintptr) mmapaddr) % ctx->align) != 0)
+        {
+            unmap_image(&ctx->retval->callbacks, NULL, mmapaddr, mmaplen);
+            DLOPEN_FAIL("App's map callback returned misaligned memory");
+        } // else if
+        Memzero(mmapaddr, mmaplen);
+    } // if
+
+    if ((mmapaddr == ((void *) MAP_FAILED)) && (ctx->arena != NULL) && (ctx->base == 0))
+    {
+        void *addr = arena_alloc(ctx->arena, mmaplen);
+        if (addr == NULL)
+            return 0;
+        mmapaddr = mmap(addr, mmaplen, mmapprot, mmapflags | MAP_FIXED, -1, 0);
+        if (mmapaddr == ((void *) MAP_FAILED))
+        {
+            arena_release(ctx->arena, addr, mmaplen);
+            DLOPEN_FAIL("mmap failed");
+        } // if
+        ctx->retval->arena = ctx->arena;
+    } // if
+
+    // A cache entry is only good at the address it was made at, so try
+    //  for that first, without stomping on anything that's there now.
+    if ((mmapaddr == ((void *) MAP_FAILED)) && (ctx->base == 0) && (ctx->cachebase != NULL))
+    {
+        mmapaddr = mmap(ctx->cachebase, mmaplen, mmapprot, mmapflags | MAP_FIXED_NOREPLACE, -1, 0);
+        if ((mmapaddr != MAP_FAILED) && (mmapaddr != ctx->cachebase))
+        {
+            munmap(mmapaddr, mmaplen);  // old kernel, took it as a hint.
+            mmapaddr = MAP_FAILED;
+        } // if
+    } // if
+
+    #if MOJOELF_SUPPORT_REMOTE
+    // An image server's copy is only good where it was relocated, too, but
+    //  if it fits, it's already laid out: text stays shared with every other
+    //  process mapping it, and data pages get copied on first write.
+    if (ctx->layoutfd != -1)
+    {
+        mmapaddr = mmap(ctx->layoutbase, mmaplen, mmapprot, MAP_PRIVATE | MAP_FIXED_NOREPLACE, ctx->layoutfd, 0);
+        if ((mmapaddr != MAP_FAILED) && (mmapaddr != ctx->layoutbase))
+        {
+            munmap(mmapaddr, mmaplen);  // old kernel, took it as a hint.
+            mmapaddr = MAP_FAILED;
+        } // if
+
+        if (mmapaddr != ((void *) MAP_FAILED))
+        {
+            ctx->retval->mmapaddr = mmapaddr;
+            ctx->retval->mmaplen = mmaplen;
+            ctx->prerelocated = 1;
+            return 1;
+        } // if
+    } // if
+    #endif
+
+    if (mmapaddr == ((void *) MAP_FAILED))
+        mmapaddr = mmap((void *) ctx->base, mmaplen, mmapprot, mmapflags, -1, 0);
+
+    if (mmapaddr == ((void *) MAP_FAILED))
+        DLOPEN_FAIL("mmap failed");
+
+    // Fresh anonymous pages are already zeroed, so don't touch them here;
+    //  pages that a cache entry replaces never have to be faulted in.
+    ctx->retval->mmapaddr = mmapaddr;
+    ctx->retval->mmaplen = mmaplen;
+
+    // we mprotect() these pages later in the process, since fixups might want
+    //  to write to memory that will eventually be marked read-only, etc.
+    //  That happens in protect_pages().
+
+    attach_shared_text(ctx);
+    return 1;  // copy_image() fills it in.
+} // map_pages
 
+// This is its own phase, so MOJOELF_load_step() can spread a big image
+//  over several steps.
+static int copy_image(ElfContext *ctx)
+{
+    if (!ctx->prerelocated)  // the image server's copy is already laid out.
+        copy_segments_from(ctx, (ctx->cachefd == -1), &ctx->cursor);
     return 1;
-} // do_fixup
+} // copy_image
+
+static inline int segment_prot(const ElfProgram *program)
+{
+    return ((program->p_flags & 1) ? PROT_EXEC : 0)  |
+           ((program->p_flags & 2) ? PROT_WRITE : 0) |
+           ((program->p_flags & 4) ? PROT_READ : 0)  ;
+} // segment_prot
+
+static inline int protect_image(ElfContext *ctx, void *addr, const size_t len,
+                                const int prot)
+{
+    if (ctx->protect != NULL)
+        return ctx->protect(ctx->userdata, addr, (unsigned long) len, prot) ? 0 : -1;
+    return mprotect(addr, len, prot);
+} // protect_image
+
+// Mark ELF pages with proper permissions.
+static int protect_pages(ElfContext *ctx)
+{
+    const size_t offset = (size_t) ctx->header->e_phoff;
+    const ElfProgram *program = (const ElfProgram *) (ctx->buf + offset);
+    const int header_count = (int) ctx->header->e_phnum;
+    const int mmapprot = PROT_READ | PROT_WRITE;
+    void *mmapaddr = (void *) ctx->retval->mmapaddr;
+    int i;
+
+    for (i = 0; i < header_count; i++, program++)
+    {
+        if ((program->p_type == PT_LOAD) && (program->p_memsz > 0))
+        {
+            uint8 *ptr = ((uint8 *) mmapaddr) + (program->p_vaddr - ctx->base);
+            const size_t len = (const size_t) program->p_memsz;
+            const int prot = segment_prot(program);
+            if ((prot != mmapprot) && (protect_image(ctx, ptr, len, prot) == -1))
+                DLOPEN_FAIL("mprotect failed");
+        } // if
+    } // for
+
+    return 1;  // all good.
+} // protect_pages
+
+// preliminary walkthrough of the dynamic table. This only looks at the
+//  buffer, so we know what the handle needs before we allocate it.
+static int index_dynamic_table(ElfContext *ctx)
+{
+    const ElfDynTable *dyntab = ctx->dyntab;
+    const ElfDynTable **dyntabs = ctx->dyntabs;
+    const int dyntabcount = ctx->dyntabcount;
+    uintptr strtaboffset = 0;
+    int i;
+
+    for (i = 0; i < dyntabcount; i++, dyntab++)
+    {
+        const int tag = (int) dyntab->d_tag;
+
+        if (tag == DT_NULL)
+            continue;
+        else if (tag == DT_NEEDED)
+        {
+            ctx->needed++;
+            continue;
+        } // if
+
+        if (tag < (sizeof (ctx->dyntabs) / sizeof (ctx->dyntabs[0])))
+        {
+            if (dyntabs[tag] != NULL)
+                DLOPEN_FAIL("Illegal duplicate dynamic tables");
+            dyntabs[tag] = dyntab;
+        } // if
+    } // for
+
+    // okay, all the tables are indexed now, so we don't have to worry about
+    //  dupes or missing fields, or ordering issues.
+    // Now that we've shuffled this stuff into an index, process it.
+
+    if (dyntabs[DT_STRTAB] == NULL)
+        DLOPEN_FAIL("No DT_STRTAB table");
+    else if (dyntabs[DT_STRSZ] == NULL)
+        DLOPEN_FAIL("No DT_STRSZ table");
+    else if (dyntabs[DT_SYMTAB] == NULL)
+        DLOPEN_FAIL("No DT_SYMTAB table");
+    else if (dyntabs[DT_SYMENT] == NULL)
+        DLOPEN_FAIL("No DT_SYMENT table");
+    else if (dyntabs[DT_SYMENT]->d_un.d_val != MOJOELF_SIZEOF_SYMENT)
+        DLOPEN_FAIL("Bogus DT_SYMENT value");
+
+    // We don't know the size of the symbol table yet. We check that later
+    //  in process_section_headers()...
+    ctx->symtab = (const ElfSymTable *)
+                    (ctx->buf + (dyntabs[DT_SYMTAB]->d_un.d_ptr - ctx->base));
+
+    if (dyntabs[DT_RELA])
+    {
+        if (dyntabs[DT_RELASZ] == NULL)
+            DLOPEN_FAIL("No DT_RELASZ table");
+        else if (dyntabs[DT_RELAENT] == NULL)
+            DLOPEN_FAIL("No DT_RELAENT table");
+        else if (dyntabs[DT_RELAENT]->d_un.d_val != MOJOELF_SIZEOF_RELAENT)
+            DLOPEN_FAIL("Unsupported/bogus DT_RELAENT value");
+        else if (dyntabs[DT_RELASZ]->d_un.d_val % MOJOELF_SIZEOF_RELAENT)
+            DLOPEN_FAIL("Bogus DT_RELASZ value");
+        else if ((dyntabs[DT_RELA]->d_un.d_ptr - ctx->base) +
+                 dyntabs[DT_RELASZ]->d_un.d_val >= ctx->buflen)
+            DLOPEN_FAIL("Bogus DT_RELA value");
+    } // if
+
+    if (dyntabs[DT_REL])
+    {
+        if (dyntabs[DT_RELSZ] == NULL)
+            DLOPEN_FAIL("No DT_RELSZ table");
+        else if (dyntabs[DT_RELENT] == NULL)
+            DLOPEN_FAIL("No DT_RELENT table");
+        else if (dyntabs[DT_RELENT]->d_un.d_val != MOJOELF_SIZEOF_RELENT)
+            DLOPEN_FAIL("Unsupported/bogus DT_RELENT value");
+        else if (dyntabs[DT_RELSZ]->d_un.d_val % MOJOELF_SIZEOF_RELENT)
+            DLOPEN_FAIL("Bogus DT_RELSZ value");
+        else if ((dyntabs[DT_REL]->d_un.d_ptr - ctx->base) >= ctx->buflen)
+            DLOPEN_FAIL("Bogus DT_REL value");
+    } // if
+
+    if (dyntabs[DT_JMPREL])
+    {
+        if (dyntabs[DT_PLTREL] == NULL)
+            DLOPEN_FAIL("No DT_PLTREL table");
+        else if (dyntabs[DT_PLTRELSZ] == NULL)
+            DLOPEN_FAIL("No DT_PLTRELSZ table");
+        else if ((dyntabs[DT_JMPREL]->d_un.d_ptr - ctx->base) +
+                 dyntabs[DT_PLTRELSZ]->d_un.d_val >= ctx->buflen)
+            DLOPEN_FAIL("Bogus DT_PLTREL value");
+
+        if (dyntabs[DT_PLTREL]->d_un.d_val == DT_REL)
+        {
+            if (dyntabs[DT_RELENT] == NULL)  // DT_RELENT
+                DLOPEN_FAIL("No DT_RELENT table");
+            else if (dyntabs[DT_RELENT]->d_un.d_val != MOJOELF_SIZEOF_RELENT)
+                DLOPEN_FAIL("Unsupported/bogus DT_RELENT value");
+            else if (dyntabs[DT_PLTRELSZ]->d_un.d_val % MOJOELF_SIZEOF_RELENT)
+                DLOPEN_FAIL("Bogus DT_PLTRELSZ value");
+        } // if
+
+        else if (dyntabs[DT_PLTREL]->d_un.d_val == DT_RELA)
+        {
+            if (dyntabs[DT_RELAENT] == NULL)  // DT_RELAENT
+                DLOPEN_FAIL("No DT_RELAENT table");
+            else if (dyntabs[DT_RELAENT]->d_un.d_val != MOJOELF_SIZEOF_RELAENT)
+                DLOPEN_FAIL("Unsupported/bogus DT_RELAENT value");
+            else if (dyntabs[DT_PLTRELSZ]->d_un.d_val % MOJOELF_SIZEOF_RELAENT)
+                DLOPEN_FAIL("Bogus DT_PLTRELSZ value");
+        } // else if
+
+        else
+        {
+            DLOPEN_FAIL("Bogus DT_PLTREL value");
+        } // else
+    } // if
+
+    strtaboffset = dyntabs[DT_STRTAB]->d_un.d_ptr - ctx->base;
+    ctx->strtablen = (size_t) dyntabs[DT_STRSZ]->d_un.d_val;
+    ctx->strtab = (const char *) (ctx->buf + strtaboffset);
+    if (ctx->strtablen == 0)  // technically this is allowed, but oh well.
+        DLOPEN_FAIL("Dynamic string table is empty");
+    else if ((strtaboffset + ctx->strtablen) > ctx->buflen)
+        DLOPEN_FAIL("Dynamic string table has bogus offset and/or length");
+    else if (ctx->strtab[0] != '\0')
+        DLOPEN_FAIL("Dynamic string table doesn't start with null byte");
+    else if (ctx->strtab[ctx->strtablen - 1] != '\0')
+        DLOPEN_FAIL("Dynamic string table doesn't end with null byte");
+
+    return 1;
+} // index_dynamic_table
+
+// Now that we're mapped, find the initializers and finalizers.
+static int walk_dynamic_table(ElfContext *ctx)
+{
+    const ElfDynTable **dyntabs = ctx->dyntabs;
+    uint8 *mmapaddr = (uint8 *) ctx->retval->mmapaddr;
+
+    if (dyntabs[DT_INIT])
+        ctx->init = mmapaddr + (dyntabs[DT_INIT]->d_un.d_ptr-ctx->base);
+
+    if (dyntabs[DT_FINI])
+        ctx->retval->fini = mmapaddr + (dyntabs[DT_FINI]->d_un.d_ptr-ctx->base);
+
+    if (dyntabs[DT_INIT_ARRAY])
+    {
+        if (dyntabs[DT_INIT_ARRAYSZ] == NULL)
+            DLOPEN_FAIL("No DT_INIT_ARRAYSZ table");
+        else if (dyntabs[DT_INIT_ARRAYSZ]->d_un.d_val % sizeof (void*))
+            DLOPEN_FAIL("Bogus DT_INIT_ARRAYSZ value");
+        else if ((dyntabs[DT_INIT_ARRAY]->d_un.d_ptr - ctx->base) +
+                 dyntabs[DT_INIT_ARRAYSZ]->d_un.d_val > ctx->retval->mmaplen)
+            DLOPEN_FAIL("Bogus DT_INIT_ARRAY value");
+        ctx->init_array = (void **) (mmapaddr + (dyntabs[DT_INIT_ARRAY]->d_un.d_ptr-ctx->base));
+        ctx->init_array_count = (int) (dyntabs[DT_INIT_ARRAYSZ]->d_un.d_val / sizeof (void*));
+    } // if
+
+    if (dyntabs[DT_FINI_ARRAY])
+    {
+        if (dyntabs[DT_FINI_ARRAYSZ] == NULL)
+            DLOPEN_FAIL("No DT_FINI_ARRAYSZ table");
+        else if (dyntabs[DT_FINI_ARRAYSZ]->d_un.d_val % sizeof (void*))
+            DLOPEN_FAIL("Bogus DT_FINI_ARRAYSZ value");
+        else if ((dyntabs[DT_FINI_ARRAY]->d_un.d_ptr - ctx->base) +
+                 dyntabs[DT_FINI_ARRAYSZ]->d_un.d_val > ctx->retval->mmaplen)
+            DLOPEN_FAIL("Bogus DT_FINI_ARRAY value");
+        ctx->retval->fini_array = (void **) (mmapaddr + (dyntabs[DT_FINI_ARRAY]->d_un.d_ptr-ctx->base));
+        ctx->retval->fini_array_count = (int) (dyntabs[DT_FINI_ARRAYSZ]->d_un.d_val / sizeof (void*));
+    } // if
+
+    return 1;
+} // walk_dynamic_table
+
+
+// Exported-symbol lookup that doesn't touch the dlerror state, so it's safe
+//  to call from worker threads during relocation.
+static void *find_exported_symbol_hashed(const ElfHandle *h, const char *sym,
+                                         const uint32 hash)
+{
+    int i;
+
+    if (h->buckets == NULL)
+        return NULL;  // no exports.
+
+    for (i = h->buckets[hash & h->bucket_mask]; i != -1; i = h->syms[i].next)
+    {
+        const ElfSymbols *s = &h->syms[i];
+        if ((s->hash == hash) && (Strcmp(s->sym, sym) == 0))
+            return s->addr;
+    } // for
+
+    return NULL;
+} // find_exported_symbol_hashed
+
+static inline void *find_exported_symbol(const ElfHandle *h, const char *sym)
+{
+    return find_exported_symbol_hashed(h, sym, gnu_hash(sym));
+} // find_exported_symbol
+
+
+// MOJOELF_dlopen_many() loads a set of images that can import from each
+//  other. Once every image in the set has its export index built, each of
+//  them can see the others through this.
+typedef struct ElfBatch
+{
+    ElfContext **ctxs;  // every image in the set, in the app's order.
+    const char **sonames;  // each image's DT_SONAME, or NULL.
+    int count;  // number of images in the set.
+} ElfBatch;
+
+// The rest of the set gets searched in the app's order, after our own
+//  exports, and before the resolver's last try.
+static void *find_batch_symbol(const ElfContext *ctx, const char *sym,
+                               const uint32 hash)
+{
+    const ElfBatch *batch = ctx->batch;
+    int i;
+
+    if (batch == NULL)
+        return NULL;
+
+    for (i = 0; i < batch->count; i++)
+    {
+        void *addr;
+        if (i == ctx->batchindex)
+            continue;  // we already checked our own.
+        addr = find_exported_symbol_hashed(batch->ctxs[i]->retval, sym, hash);
+        if (addr != NULL)
+            return addr;
+    } // for
+
+    return NULL;
+} // find_batch_symbol
+
+static int is_batch_soname(const ElfContext *ctx, const char *soname)
+{
+    const ElfBatch *batch = ctx->batch;
+    int i;
+
+    if (batch == NULL)
+        return 0;
+
+    for (i = 0; i < batch->count; i++)
+    {
+        if ((batch->sonames[i] != NULL) && (Strcmp(batch->sonames[i], soname) == 0))
+            return 1;
+    } // for
+
+    return 0;
+} // is_batch_soname
+
+// Returns which other image in the set has this address, or -1.
+static int find_batch_image(const ElfContext *ctx, const uintptr addr)
+{
+    const ElfBatch *batch = ctx->batch;
+    int i;
+
+    if (batch == NULL)
+        return -1;
+
+    for (i = 0; i < batch->count; i++)
+    {
+        const ElfHandle *h = batch->ctxs[i]->retval;
+        const uintptr start = (uintptr) h->mmapaddr;
+        if ((i != ctx->batchindex) && (addr >= start) && (addr < (start + h->mmaplen)))
+            return i;
+    } // for
+
+    return -1;
+} // find_batch_image
+
+// Nonzero if we resolved something to another image's IFUNC resolver, which
+//  has to run before we have the real address, like our own do.
+static int is_batch_ifunc(const ElfContext *ctx, const uintptr addr)
+{
+    const int image = find_batch_image(ctx, addr);
+    const ElfContext *other;
+    int i;
+
+    if (image == -1)
+        return 0;
+
+    other = ctx->batch->ctxs[image];
+    for (i = 0; i < other->batchifunccount; i++)
+    {
+        if (other->batchifuncs[i] == addr)
+            return 1;
+    } // for
+
+    return 0;
+} // is_batch_ifunc
+
+// A MOJOELF_Namespace is a set of handles that import from each other, like
+//  the libraries glibc's dlopen() puts in one process. Every export of its
+//  global handles goes in one hash index, so resolving against all of them
+//  is one lookup instead of one per handle.
+typedef struct ElfNamespaceSym
+{
+    const ElfSymbols *sym;  // in the handle's own export list.
+    ElfHandle *handle;  // the handle that exports it.
+    struct ElfNamespaceSym *next;  // next in this bucket, in load order.
+} ElfNamespaceSym;
+
+typedef struct ElfNamespaceLib
+{
+    struct ElfNamespace *ns;  // the namespace we're in.
+    ElfHandle *handle;  // what MOJOELF_namespace_dlopen() returned.
+    int global;  // nonzero if syms are in the namespace's index.
+    ElfNamespaceSym *syms;  // one per export, indexed like handle->syms.
+    const char *soname;  // our DT_SONAME, or NULL.
+    ElfHandle **deps;  // members our DT_NEEDED named; we hold a use of each.
+    int depcount;  // number of entries in deps.
+    int users;  // later members whose DT_NEEDED named us.
+    int closed;  // app closed us while we had users; close when they're gone.
+    struct ElfNamespaceLib *prev;  // previous in load order.
+    struct ElfNamespaceLib *next;  // next in load order.
+} ElfNamespaceLib;
+
+typedef struct ElfNamespace
+{
+    MOJOELF_Callbacks callbacks;  // every load in here uses these.
+    ElfNamespaceLib *first;  // first handle loaded.
+    ElfNamespaceLib *last;  // last handle loaded.
+    ElfNamespaceSym **buckets;  // every global export, by gnu_hash().
+    uint32 bucket_mask;  // number of buckets, minus one.
+    int symcount;  // number of entries in buckets.
+    #if MOJOELF_SUPPORT_THREADS
+    pthread_mutex_t mutex;  // recursive, so callbacks and constructors can use us.
+    #endif
+} ElfNamespace;
+
+#if MOJOELF_SUPPORT_THREADS
+#define lock_namespace(ns) pthread_mutex_lock(&(ns)->mutex)
+#define unlock_namespace(ns) pthread_mutex_unlock(&(ns)->mutex)
+#else
+#define lock_namespace(ns) do {} while (0)
+#define unlock_namespace(ns) do {} while (0)
+#endif
+
+// The first global handle to export this, in load order, wins.
+static const ElfNamespaceSym *find_global_symbol(const ElfNamespace *ns,
+                                                 const char *sym,
+                                                 const uint32 hash)
+{
+    const ElfNamespaceSym *s;
+
+    if (ns->buckets == NULL)
+        return NULL;  // no global exports yet.
+
+    for (s = ns->buckets[hash & ns->bucket_mask]; s != NULL; s = s->next)
+    {
+        if ((s->sym->hash == hash) && (Strcmp(s->sym->sym, sym) == 0))
+            return s;
+    } // for
+
+    return NULL;
+} // find_global_symbol
+
+// Inside a namespace, the global handles get searched first, then the
+//  ones our DT_NEEDED entries named, even if they're local.
+static void *find_namespace_symbol(const ElfContext *ctx, const char *sym,
+                                   const uint32 hash)
+{
+    const ElfNamespaceSym *s;
+    void *addr;
+    int i;
+
+    if (ctx->ns == NULL)
+        return NULL;
+
+    s = find_global_symbol(ctx->ns, sym, hash);
+    addr = s ? s->sym->addr : NULL;
+    for (i = 0; (addr == NULL) && (i < ctx->nsdepcount); i++)
+        addr = find_exported_symbol_hashed(ctx->nsdeps[i], sym, hash);
+
+    return addr;
+} // find_namespace_symbol
+
+static ElfHandle *find_namespace_soname(const ElfContext *ctx, const char *soname)
+{
+    const ElfNamespaceLib *lib;
+
+    if (ctx->ns == NULL)
+        return NULL;
+
+    for (lib = ctx->ns->first; lib != NULL; lib = lib->next)
+    {
+        if ((lib->soname != NULL) && (Strcmp(lib->soname, soname) == 0))
+            return lib->handle;
+    } // for
+
+    return NULL;
+} // find_namespace_soname
+
+// A string-valued dynamic table entry, like DT_RPATH. Leaves *_str alone if
+//  there isn't one, and fails with err if it points outside the string table.
+static int dynamic_string(const ElfContext *ctx, const ElfDynTable *dyntab,
+                          const char *err, const char **_str)
+{
+    if (dyntab != NULL)
+    {
+        const size_t offset = dyntab->d_un.d_val;
+        if (offset >= ctx->strtablen)
+            DLOPEN_FAIL(err);
+        *_str = ctx->strtab + offset;
+    } // if
+
+    return 1;
+} // dynamic_string
+
+// We might need to load symbols in other libraries. The app-supplied
+//  callbacks will be given a chance to handle symbol resolution here.
+static int load_external_dependencies(ElfContext *ctx)
+{
+    const ElfDynTable *dyntab = ctx->dyntab;
+    const int dyntabcount = ctx->dyntabcount;
+    const char *rpath = NULL;
+    const char *runpath = NULL;
+    int dlopens_count = 0;
+    int i;
+
+    if (!dynamic_string(ctx, ctx->dyntabs[DT_RPATH], "Bogus DT_RPATH string", &rpath))
+        return 0;
+    else if (!dynamic_string(ctx, ctx->dyntabs[DT_RUNPATH], "Bogus DT_RUNPATH string", &runpath))
+        return 0;
+
+    if (ctx->needed == 0)
+        return 1;  // nothing to do.
+
+    ctx->retval->dlopens = (void **) carve_metadata(ctx, ctx->needed * sizeof (void *));
+    if (ctx->retval->dlopens == NULL)
+        return 0;
+    ctx->retval->dlopens_count = ctx->needed;
+
+    if (ctx->ns != NULL)
+    {
+        ctx->nsdeps = (ElfHandle **) ctx_alloc(ctx, ctx->needed * sizeof (ElfHandle *));
+        if (ctx->nsdeps == NULL)
+            return 0;
+    } // if
+
+    // Find the libraries to load.
+    for (i = 0; i < dyntabcount; i++, dyntab++)
+    {
+        if (dyntab->d_tag == DT_NEEDED)
+        {
+            const size_t offset = dyntab->d_un.d_val;
+            if (offset >= ctx->strtablen)
+                DLOPEN_FAIL("Bogus DT_NEEDED string");
+            else
+            {
+                const char *str = ctx->strtab + offset;
+                ElfHandle *nsdep = find_namespace_soname(ctx, str);
+                void *handle = NULL;
+
+                if (is_batch_soname(ctx, str))
+                    handle = NULL;  // MOJOELF_dlopen_many() is loading this one.
+                else if (nsdep != NULL)
+                    ctx->nsdeps[ctx->nsdepcount++] = nsdep;  // already in our namespace.
+                else
+                {
+                    dbgprintf(("asking loader for \"%s\" (rpath \"%s\", runpath \"%s\") ...\n", str, rpath, runpath));
+                    handle = ctx->loader(str, rpath, runpath);
+                    if (!handle)
+                        DLOPEN_FAIL("Couldn't load dependency");
+                } // else
+
+                ctx->retval->dlopens[dlopens_count++] = handle;
+                if (dlopens_count >= ctx->retval->dlopens_count)
+                    return 1;  // done!
+            } // else
+        } // if
+    } // for
+
+    assert(0);
+    DLOPEN_FAIL("Bug: didn't see as many DT_NEEDED on second pass");
+} // load_external_dependencies
+
+
+// Which lookup found each import, so MOJOELF_dlreload() knows what it can
+//  trust later. Only a DT_NEEDED dependency's answer is pinned down by our
+//  dlopens[]; namespaces, batches and resolver(NULL) can change under us.
+#define IMPORT_FROM_NOWHERE 0  // unresolved weak symbol, or nameless.
+#define IMPORT_FROM_NAMESPACE 1
+#define IMPORT_FROM_DEPENDENCY 2
+#define IMPORT_FROM_SELF 3
+#define IMPORT_FROM_BATCH 4
+#define IMPORT_FROM_GLOBAL 5
+
+static inline void note_import_source(ElfContext *ctx, const uint32 sym, const uint8 from)
+{
+    if (ctx->importfrom != NULL)
+        ctx->importfrom[sym] = from;
+} // note_import_source
+
+// MOJOELF_dlreload(): if the old image imported this from the same
+//  dependencies we have, it's still the same address. remember_imports()
+//  only kept the ones that came from dependencies.
+static int find_previous_import(const ElfContext *ctx, const char *sym,
+                                const uint32 hash, void **_addr)
+{
+    const ElfImportTable *table;
+    int i;
+
+    if ((ctx->reload == NULL) || (!ctx->reload->same_dlopens))
+        return 0;
+
+    table = ctx->reload->imports;
+    for (i = table->buckets[hash & table->bucket_mask]; i != -1; i = table->syms[i].next)
+    {
+        const ElfSymbols *s = &table->syms[i];
+        if ((s->hash == hash) && (Strcmp(s->sym, sym) == 0))
+        {
+            *_addr = s->addr;
+            return 1;
+        } // if
+    } // for
+
+    return 0;
+} // find_previous_import
+
+static int resolve_symbol(ElfContext *ctx, const uint32 sym, uintptr *_addr)
+{
+    const ElfSymTable *symbol = ctx->symtab + sym;
+    const char *symstr = NULL;
+    void *addr = NULL;
+
+    if ((symbol->st_value) && ((symbol->st_value - ctx->base) > ctx->retval->mmaplen))
+        DLOPEN_FAIL("Bogus symbol address");
+    else if (symbol->st_name >= ctx->strtablen)
+        DLOPEN_FAIL("Bogus symbol name");
+
+    symstr = ctx->strtab + symbol->st_name;
+
+    if (*symstr == '\0')
+        addr = ((uint8 *) ctx->retval->mmapaddr) + symbol->st_value;
+    else
+    {
+        dbgprintf(("Resolving '%s' ...\n", symstr));
+
+        uint8 from = IMPORT_FROM_DEPENDENCY;
+        int i;
+        if (!find_previous_import(ctx, symstr, gnu_hash(symstr), &addr))
+        {
+            addr = find_namespace_symbol(ctx, symstr, gnu_hash(symstr));
+            if (addr != NULL)
+                from = IMPORT_FROM_NAMESPACE;
+        } // if
+        for (i = 0; (addr == NULL) && (i < ctx->retval->dlopens_count); i++)
+        {
+            if (ctx->retval->dlopens[i] != NULL)  // NULL if it's in our batch or namespace.
+                addr = ctx->resolver(ctx->retval->dlopens[i], symstr);
+        } // for
+
+        if (addr == NULL)
+        {
+            // try our own export table?
+            from = IMPORT_FROM_SELF;
+            addr = find_exported_symbol(ctx->retval, symstr);
+            if (addr == NULL)  // then the rest of MOJOELF_dlopen_many()'s set?
+            {
+                from = IMPORT_FROM_BATCH;
+                addr = find_batch_symbol(ctx, symstr, gnu_hash(symstr));
+            } // if
+            if (addr == NULL)
+            {
+                from = IMPORT_FROM_GLOBAL;
+                addr = ctx->resolver(NULL, symstr);  // last try.
+                if (addr == NULL)
+                {
+                    from = IMPORT_FROM_NOWHERE;
+                    if (ELF_ST_BIND(symbol->st_info) != STB_WEAK)
+                        DLOPEN_FAIL("Couldn't resolve symbol");
+                } // if
+            } // if
+        } // if
+
+        note_import_source(ctx, sym, from);
+
+        dbgprintf(("Resolved '%s' to %p ...\n", symstr, addr));
+    } // if
+
+    *_addr = (uintptr) addr;
+    return 1;
+} // resolve_symbol
+
+
+typedef void *(*ElfIfuncResolverFn)(void);
+
+static void *call_ifunc(ElfContext *ctx, const char *sym, const uintptr resolver)
+{
+    dbgprintf(("Running IFUNC resolver for '%s' at %p ...\n", sym ? sym : "(irelative)", (void *) resolver));
+    if (ctx->ifunc != NULL)
+        return ctx->ifunc(ctx->userdata, sym, (void *) resolver);
+    // glibc calls x86 resolvers with no arguments, too.
+    return ((ElfIfuncResolverFn) resolver)();
+} // call_ifunc
+
+
+// Thread-local storage. On x86, static TLS blocks live at fixed offsets from
+//  the thread pointer, so code compiled for the initial-exec model just reads
+//  %fs:offset (%gs on i386) and needs a constant in its GOT. We can't get at
+//  glibc's static TLS area, so we reserve some of our own in every thread and
+//  hand out pieces of it to images loaded with MOJOELF_FLAG_STATIC_TLS.
+//  Everything else gets a block per thread, allocated the first time that
+//  thread calls our __tls_get_addr().
+#if MOJOELF_SUPPORT_TLS
+typedef struct ElfTlsBlock
+{
+    struct ElfTlsModule *module;  // who owns this block.
+    struct ElfTlsBlock *prev;  // in module->blocks.
+    struct ElfTlsBlock *next;
+    struct ElfTlsThread *thread;  // which thread this block is for.
+    struct ElfTlsBlock *thread_prev;  // in thread->blocks.
+    struct ElfTlsBlock *thread_next;
+    uint8 *data;  // the actual block, aligned.
+} ElfTlsBlock;
+
+typedef struct ElfTlsThread  // every dynamic block one thread has.
+{
+    ElfTlsBlock *blocks;
+} ElfTlsThread;
+
+typedef struct ElfTlsModule  // DTPMOD relocations point at these.
+{
+    const uint8 *image;  // initial contents (.tdata), in the mapped pages.
+    size_t imagelen;  // bytes of image; the rest of the block is zeroed.
+    size_t blocklen;  // total bytes in the block.
+    size_t align;  // block alignment.
+    int is_static;  // nonzero if we're in the static TLS reserve.
+    intptr tpoff;  // static only: block offset from the thread pointer.
+    int static_index;  // static only: our slot in static_tls_inits.
+    pthread_key_t key;  // dynamic only: this thread's ElfTlsBlock.
+    ElfTlsBlock *blocks;  // dynamic only: every thread's block.
+    struct ElfTlsModule *prev;  // dynamic only: in dynamic_tls_modules.
+    struct ElfTlsModule *next;
+} ElfTlsModule;
+
+typedef struct ElfTlsIndex  // what the compiler hands __tls_get_addr().
+{
+    uintptr module;
+    uintptr offset;
+} ElfTlsIndex;
+
+typedef struct ElfStaticTlsInit
+{
+    const uint8 *image;  // NULL once the image is closed.
+    size_t imagelen;
+    size_t blocklen;
+    size_t offset;  // into static_tls_reserve.
+} ElfStaticTlsInit;
+
+// also protects dynamic_tls_modules, and every dynamic block's links.
+static pthread_mutex_t static_tls_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ElfStaticTlsInit *static_tls_inits = NULL;
+static ElfTlsModule *dynamic_tls_modules = NULL;  // relocated and usable.
+
+// Modules' own keys have no destructor, since pthread_key_delete() doesn't
+//  wait for ones that are already running, and free_tls() would free the
+//  module out from under them. Exiting threads clean up through this key
+//  instead, which is never deleted.
+static pthread_once_t tls_thread_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tls_thread_key;
+static int tls_thread_key_okay = 0;
+
+#if MOJOELF_STATIC_TLS_SIZE > 0
+static int static_tls_init_count = 0;
+static size_t static_tls_used = 0;
+static __thread int static_tls_initialized = 0;  // inits done in this thread.
+
+// initial-exec keeps this at the same offset from the thread pointer in
+//  every thread, even if we're built into a shared library.
+static __thread uint8 static_tls_reserve[MOJOELF_STATIC_TLS_SIZE]
+    __attribute__((tls_model("initial-exec"), aligned(MOJOELF_STATIC_TLS_ALIGN)));
+#endif
+
+static inline uint8 *get_thread_pointer(void)
+{
+    uint8 *retval;
+    #if MOJOELF_64BIT
+    __asm__ ("movq %%fs:0, %0" : "=r" (retval));
+    #else
+    __asm__ ("movl %%gs:0, %0" : "=r" (retval));
+    #endif
+    return retval;
+} // get_thread_pointer
+
+static int reserve_static_tls(ElfTlsModule *module)
+{
+    #if MOJOELF_STATIC_TLS_SIZE == 0
+    return 0;
+    #else
+    const size_t align = module->align;
+    ElfStaticTlsInit *ptr = NULL;
+    size_t offset;
+
+    if (align > MOJOELF_STATIC_TLS_ALIGN)
+        return 0;
+
+    pthread_mutex_lock(&static_tls_mutex);
+
+    // Space in the reserve is never reused, since other threads may still
+    //  be looking at it.
+    offset = (static_tls_used + (align - 1)) & ~(align - 1);
+    if ((offset + module->blocklen) > MOJOELF_STATIC_TLS_SIZE)
+    {
+        pthread_mutex_unlock(&static_tls_mutex);
+        return 0;  // full.
+    } // if
+
+    ptr = (ElfStaticTlsInit *) Alloc((static_tls_init_count + 1) * sizeof (ElfStaticTlsInit));
+    if (ptr == NULL)
+    {
+        pthread_mutex_unlock(&static_tls_mutex);
+        return 0;
+    } // if
+
+    if (static_tls_init_count > 0)
+        Memcopy(ptr, static_tls_inits, static_tls_init_count * sizeof (ElfStaticTlsInit));
+    Free(static_tls_inits);
+    static_tls_inits = ptr;
+    ptr += static_tls_init_count;
+    ptr->image = NULL;  // filled in by init_tls(), after relocation.
+    ptr->imagelen = 0;
+    ptr->blocklen = module->blocklen;
+    ptr->offset = offset;
+    static_tls_used = offset + module->blocklen;
+
+    module->is_static = 1;
+    module->static_index = static_tls_init_count++;
+    module->tpoff = (intptr) ((static_tls_reserve + offset) - get_thread_pointer());
+
+    pthread_mutex_unlock(&static_tls_mutex);
+    return 1;
+    #endif
+} // reserve_static_tls
+
+// Caller holds static_tls_mutex.
+static void free_tls_block(ElfTlsBlock *block)
+{
+    ElfTlsModule *module = block->module;
+    ElfTlsThread *thread = block->thread;
+
+    if (block->prev != NULL)
+        block->prev->next = block->next;
+    else
+        module->blocks = block->next;
+    if (block->next != NULL)
+        block->next->prev = block->prev;
+
+    if (block->thread_prev != NULL)
+        block->thread_prev->thread_next = block->thread_next;
+    else
+        thread->blocks = block->thread_next;
+    if (block->thread_next != NULL)
+        block->thread_next->thread_prev = block->thread_prev;
+
+    Free(block);
+} // free_tls_block
+
+// tls_thread_key's destructor: this thread is exiting.
+static void free_tls_thread(void *_thread)
+{
+    ElfTlsThread *thread = (ElfTlsThread *) _thread;
+    pthread_mutex_lock(&static_tls_mutex);
+    while (thread->blocks != NULL)
+        free_tls_block(thread->blocks);
+    pthread_mutex_unlock(&static_tls_mutex);
+    Free(thread);
+} // free_tls_thread
+
+static void create_tls_thread_key(void)
+{
+    tls_thread_key_okay = (pthread_key_create(&tls_thread_key, free_tls_thread) == 0);
+} // create_tls_thread_key
+
+// Caller holds static_tls_mutex.
+static ElfTlsBlock *alloc_tls_block(ElfTlsModule *module)
+{
+    const size_t len = sizeof (ElfTlsBlock) + module->align + module->blocklen;
+    ElfTlsThread *thread = (ElfTlsThread *) pthread_getspecific(tls_thread_key);
+    ElfTlsBlock *block = NULL;
+    uintptr data;
+
+    if (thread == NULL)
+    {
+        thread = (ElfTlsThread *) Malloc(sizeof (ElfTlsThread));
+        if (thread == NULL)
+            return NULL;  // dlerror is set.
+        else if (pthread_setspecific(tls_thread_key, thread) != 0)
+        {
+            Free(thread);
+            set_dlerror("Out of memory");
+            return NULL;
+        } // else if
+    } // if
+
+    block = (ElfTlsBlock *) Malloc(len);
+    if (block == NULL)
+        return NULL;  // dlerror is set.
+
+    data = (uintptr) (block + 1);
+    data = (data + (module->align - 1)) & ~((uintptr) (module->align - 1));
+    block->module = module;
+    block->thread = thread;
+    block->data = (uint8 *) data;
+    Memcopy(block->data, module->image, module->imagelen);  // rest is zeroed.
+
+    block->prev = NULL;
+    block->next = module->blocks;
+    if (module->blocks != NULL)
+        module->blocks->prev = block;
+    module->blocks = block;
+
+    block->thread_prev = NULL;
+    block->thread_next = thread->blocks;
+    if (thread->blocks != NULL)
+        thread->blocks->thread_prev = block;
+    thread->blocks = block;
+
+    pthread_setspecific(module->key, block);
+    return block;
+} // alloc_tls_block
+
+int MOJOELF_tls_thread_init(void)
+{
+    ElfTlsModule *module;
+    int retval = 1;
+
+    pthread_mutex_lock(&static_tls_mutex);
+
+    #if MOJOELF_STATIC_TLS_SIZE > 0
+    while (static_tls_initialized < static_tls_init_count)
+    {
+        const ElfStaticTlsInit *init = &static_tls_inits[static_tls_initialized];
+        if (init->image != NULL)
+        {
+            uint8 *block = static_tls_reserve + init->offset;
+            Memcopy(block, init->image, init->imagelen);
+            Memzero(block + init->imagelen, init->blocklen - init->imagelen);
+            static_tls_initialized++;
+        } // if
+        else if (init->blocklen == 0)  // closed.
+            static_tls_initialized++;
+        else
+            break;  // still loading; we'll catch it next time.
+    } // while
+    #endif
+
+    // Allocate dynamic blocks now, while we can still report failure.
+    for (module = dynamic_tls_modules; module != NULL; module = module->next)
+    {
+        if (pthread_getspecific(module->key) != NULL)
+            continue;
+        else if (alloc_tls_block(module) == NULL)
+        {
+            retval = 0;  // dlerror is already set.
+            break;
+        } // else if
+    } // for
+
+    pthread_mutex_unlock(&static_tls_mutex);
+    return retval;
+} // MOJOELF_tls_thread_init
+
+static inline void *tls_get_addr(const ElfTlsIndex *ti)
+{
+    ElfTlsModule *module = (ElfTlsModule *) ti->module;
+    ElfTlsBlock *block;
+
+    if (module->is_static)
+        return get_thread_pointer() + module->tpoff + ti->offset;
+
+    block = (ElfTlsBlock *) pthread_getspecific(module->key);
+    if (block == NULL)
+    {
+        // This thread never called MOJOELF_tls_thread_init(), so we allocate
+        //  here, where there's nobody to report an error to.
+        pthread_mutex_lock(&static_tls_mutex);
+        block = alloc_tls_block(module);
+        pthread_mutex_unlock(&static_tls_mutex);
+        if (block == NULL)
+        {
+            dbgprintf(("MojoELF: out of memory for thread-local data\n"));
+            #if MOJOELF_TLS_OOM_ABORT
+            abort();
+            #else
+            return NULL;
+            #endif
+        } // if
+    } // if
+    return block->data + ti->offset;
+} // tls_get_addr
+
+// Images get these instead of the system's __tls_get_addr, which wouldn't
+//  know what to do with our module pointers.
+static void *tls_get_addr_stack(ElfTlsIndex *ti)
+{
+    return tls_get_addr(ti);
+} // tls_get_addr_stack
+
+#if MOJOELF_32BIT
+static __attribute__((regparm(1))) void *tls_get_addr_regparm(ElfTlsIndex *ti)
+{
+    return tls_get_addr(ti);
+} // tls_get_addr_regparm
+#endif
+
+static int setup_tls(ElfContext *ctx)
+{
+    const ElfProgram *program = ctx->tlsprogram;
+    uint8 *mmapaddr = (uint8 *) ctx->retval->mmapaddr;
+    ElfTlsModule *module = NULL;
+
+    if (program == NULL)
+        return 1;  // nothing to do.
+    else if ((program->p_filesz) &&
+             (((program->p_vaddr - ctx->base) + program->p_filesz) > ctx->mmaplen))
+        DLOPEN_FAIL("Bogus PT_TLS segment");
+
+    module = (ElfTlsModule *) Malloc(sizeof (ElfTlsModule));
+    if (module == NULL)
+        return 0;
+
+    module->image = mmapaddr + (program->p_vaddr - ctx->base);
+    module->imagelen = program->p_filesz;
+    module->blocklen = program->p_memsz;
+    module->align = (program->p_align > 1) ? program->p_align : 1;
+
+    if ((ctx->flags & MOJOELF_FLAG_STATIC_TLS) && (reserve_static_tls(module)))
+    {
+        ctx->retval->tls = module;
+        return 1;
+    } // if
+
+    pthread_once(&tls_thread_key_once, create_tls_thread_key);
+    if ((!tls_thread_key_okay) || (pthread_key_create(&module->key, NULL) != 0))
+    {
+        Free(module);
+        DLOPEN_FAIL("Couldn't create TLS key");
+    } // if
+
+    ctx->retval->tls = module;
+    return 1;
+} // setup_tls
+
+// Relocations are done, so the TLS image is final: copy it into this
+//  thread's static block, or allocate this thread's dynamic block. Other
+//  threads pick it up from MOJOELF_tls_thread_init().
+static int init_tls(ElfContext *ctx)
+{
+    ElfTlsModule *module = ctx->retval->tls;
+    if (module == NULL)
+        return 1;  // nothing to do.
+
+    pthread_mutex_lock(&static_tls_mutex);
+    if (module->is_static)
+    {
+        static_tls_inits[module->static_index].image = module->image;
+        static_tls_inits[module->static_index].imagelen = module->imagelen;
+    } // if
+    else
+    {
+        module->prev = NULL;
+        module->next = dynamic_tls_modules;
+        if (dynamic_tls_modules != NULL)
+            dynamic_tls_modules->prev = module;
+        dynamic_tls_modules = module;
+    } // else
+    pthread_mutex_unlock(&static_tls_mutex);
+
+    return MOJOELF_tls_thread_init();
+} // init_tls
+
+static void free_tls(ElfTlsModule *module)
+{
+    if (module == NULL)
+        return;
+
+    if (module->is_static)
+    {
+        // the reserve space is gone for good, but forget the image.
+        ElfStaticTlsInit *init;
+        pthread_mutex_lock(&static_tls_mutex);
+        init = &static_tls_inits[module->static_index];
+        init->image = NULL;
+        init->imagelen = 0;
+        init->blocklen = 0;
+        pthread_mutex_unlock(&static_tls_mutex);
+    } // if
+    else
+    {
+        pthread_mutex_lock(&static_tls_mutex);
+        if (module->prev != NULL)
+            module->prev->next = module->next;
+        else if (dynamic_tls_modules == module)
+            dynamic_tls_modules = module->next;
+        if (module->next != NULL)
+            module->next->prev = module->prev;
+
+        // Exiting threads free their blocks under this lock, too, so
+        //  whatever's still here belongs to a thread that isn't done yet.
+        while (module->blocks != NULL)
+            free_tls_block(module->blocks);
+        pthread_mutex_unlock(&static_tls_mutex);
+
+        pthread_key_delete(module->key);
+    } // else
+
+    Free(module);
+} // free_tls
+
+#else
+int MOJOELF_tls_thread_init(void) { return 1; }
+
+static int setup_tls(ElfContext *ctx)
+{
+    if (ctx->tlsprogram != NULL)
+        DLOPEN_FAIL("Thread-local storage isn't supported in this build");
+    return 1;
+} // setup_tls
+
+static int init_tls(ElfContext *ctx) { return 1; }
+#define free_tls(module) do {} while (0)
+#endif
+
+// TLS symbols aren't addresses, they're offsets into their module's block,
+//  and __tls_get_addr has to be ours. Neither goes to the resolver.
+//  Sets *_handled to nonzero if this took care of the symbol.
+static int resolve_tls_symbol(ElfContext *ctx, const uint32 sym, int *_handled)
+{
+    const ElfSymTable *symbol = ctx->symtab + sym;
+
+    *_handled = 0;
+
+    if (symbol->st_name >= ctx->strtablen)
+        DLOPEN_FAIL("Bogus symbol name");
+
+    else if (ELF_ST_TYPE(symbol->st_info) == STT_TLS)
+    {
+        if (symbol->st_shndx == SHN_UNDEF)
+            DLOPEN_FAIL("TLS symbols from other modules aren't supported");
+        else if (ctx->retval->tls == NULL)
+            DLOPEN_FAIL("TLS symbol, but no PT_TLS segment");
+        ctx->symaddrs[sym] = symbol->st_value;
+        *_handled = 1;
+    } // if
+
+    #if MOJOELF_SUPPORT_TLS
+    else
+    {
+        const char *symstr = ctx->strtab + symbol->st_name;
+        if (Strcmp(symstr, "__tls_get_addr") == 0)
+        {
+            ctx->symaddrs[sym] = (uintptr) tls_get_addr_stack;
+            *_handled = 1;
+        } // if
+        #if MOJOELF_32BIT
+        else if (Strcmp(symstr, "___tls_get_addr") == 0)
+        {
+            ctx->symaddrs[sym] = (uintptr) tls_get_addr_regparm;
+            *_handled = 1;
+        } // else if
+        #endif
+    } // else
+    #endif
+
+    return 1;
+} // resolve_tls_symbol
+
+static int do_fixup(ElfContext *ctx, const uint32 r_type, const uint32 r_sym,
+                    const uintptr r_offset, const intptr r_addend,
+                    const int is_rela)
+{
+    uint8 *mmapaddr = (uint8 *) ctx->retval->mmapaddr;
+    uintptr *fixup = (uintptr *) (mmapaddr + (r_offset - ctx->base));
+    const uintptr addr = ctx->symaddrs[r_sym];  // resolved before we got here.
+
+    switch (r_type)
+    {
+        // There are way more than these, but these seem to be the
+        //  only ones average libraries use.
+        // Note libc.so.6 itself also seems to use: R_*_64, R_*_TPOFF64
+// !!! FIXME: This is all x86-specific. Research x86_64.
+        case R_COPY:
+            if (!r_sym)
+                DLOPEN_FAIL("Bogus copy fixup");
+            // !!! FIXME: this should check the source and dest symbols,
+            // !!! FIXME:  use the smaller size (but they _should_ match
+            // !!! FIXME:  if everything is built correctly. Naturally, this
+            // !!! FIXME:  will fail to be true eventually).
+            memcpy(fixup, (void *) addr, (ctx->symtab+r_sym)->st_size);
+            break;
+        case R_GLOB_DATA:
+        case R_JUMP_SLOT:
+            *fixup = addr;
+            break;
+        case R_RELATIVE:  // RELA images store the addend in place, too.
+            if (is_rela)
+                *fixup = (uintptr) (mmapaddr + r_addend);
+            else
+                *fixup += (uintptr) mmapaddr;
+            break;
+        case R_32:  // !!! FIXME: presumable should be (uint32), not (uintptr).
+            *fixup += (uintptr) (addr + r_addend);
+            break;
+        case R_PC32:  // !!! FIXME: presumable should be (uint32), not (uintptr).
+            *fixup += (uintptr) ((addr + r_addend) - ((uintptr) fixup));
+            break;
+        case R_DTPMOD:
+            if (ctx->retval->tls == NULL)
+                DLOPEN_FAIL("TLS relocation, but no PT_TLS segment");
+            *fixup = (uintptr) ctx->retval->tls;
+            break;
+        case R_DTPOFF:  // addr is the symbol's offset in the TLS block.
+            if (is_rela)
+                *fixup = (uintptr) (addr + r_addend);
+            else
+                *fixup += addr;
+            break;
+        case R_TPOFF:
+            #if MOJOELF_SUPPORT_TLS
+            if ((ctx->retval->tls == NULL) || (!ctx->retval->tls->is_static))
+                DLOPEN_FAIL("Image needs static TLS");
+            if (is_rela)
+                *fixup = (uintptr) (ctx->retval->tls->tpoff + addr + r_addend);
+            else
+                *fixup += (uintptr) (ctx->retval->tls->tpoff + addr);
+            break;
+            #else
+            DLOPEN_FAIL("Image needs static TLS");
+            #endif
+        #ifdef R_TPOFF_NEG
+        case R_TPOFF_NEG:
+            #if MOJOELF_SUPPORT_TLS
+            if ((ctx->retval->tls == NULL) || (!ctx->retval->tls->is_static))
+                DLOPEN_FAIL("Image needs static TLS");
+            *fixup -= (uintptr) (ctx->retval->tls->tpoff + addr);
+            break;
+            #else
+            DLOPEN_FAIL("Image needs static TLS");
+            #endif
+        #endif
+        case R_IRELATIVE:  // REL tables keep the resolver address in place.
+            {
+                const uintptr vaddr = is_rela ? ((uintptr) r_addend) : *fixup;
+                const uintptr resolver = (uintptr) (mmapaddr + (vaddr - ctx->base));
+                *fixup = (uintptr) call_ifunc(ctx, NULL, resolver);
+            }
+            break;
+        case R_NONE:
+            break;  // do nothing.
+        default:
+            DLOPEN_FAIL("write me");  // haven't seen this yet.
+            break;
+    } // switch
+
+    return 1;
+} // do_fixup
+
+
+// Pull the r_info/r_offset/r_addend out of either flavor of table entry.
+static inline void get_reloc(const ElfRelocTable *table, const size_t idx,
+                             uint32 *r_type, uint32 *r_sym,
+                             uintptr *r_offset, intptr *r_addend)
+{
+    if (table->is_rela)
+    {
+        const ElfRelA *rela = ((const ElfRelA *) table->entries) + idx;
+        *r_type = ELF_R_TYPE(rela->r_info);
+        *r_sym = ELF_R_SYM(rela->r_info);
+        *r_offset = rela->r_offset;
+        *r_addend = rela->r_addend;
+    } // if
+    else
+    {
+        const ElfRel *rel = ((const ElfRel *) table->entries) + idx;
+        *r_type = ELF_R_TYPE(rel->r_info);
+        *r_sym = ELF_R_SYM(rel->r_info);
+        *r_offset = rel->r_offset;
+        *r_addend = 0;
+    } // else
+} // get_reloc
+
+static void add_reloc_table(ElfContext *ctx, const ElfDynTable *dt,
+                            const ElfDynTable *dtsz, const int is_rela)
+{
+    const size_t offset = ((size_t) dt->d_un.d_ptr) - ctx->base;
+    const size_t entsize = is_rela ? MOJOELF_SIZEOF_RELAENT : MOJOELF_SIZEOF_RELENT;
+    ElfRelocTable *table = &ctx->reloctabs[ctx->reloctabcount++];
+    table->entries = ctx->buf + offset;
+    table->count = ((size_t) dtsz->d_un.d_val) / entsize;
+    table->is_rela = is_rela;
+    ctx->reloccount += table->count;
+} // add_reloc_table
+
+static void add_reloc_tables(ElfContext *ctx)
+{
+    const ElfDynTable **dyntabs = ctx->dyntabs;
+
+    // Order matters here: this is the order relocations are applied in.
+    if (dyntabs[DT_RELA] != NULL)
+        add_reloc_table(ctx, dyntabs[DT_RELA], dyntabs[DT_RELASZ], 1);
+    if (dyntabs[DT_REL] != NULL)
+        add_reloc_table(ctx, dyntabs[DT_REL], dyntabs[DT_RELSZ], 0);
+    if (dyntabs[DT_JMPREL] != NULL)
+    {
+        const int is_rela = (dyntabs[DT_PLTREL]->d_un.d_val == DT_RELA);
+        assert(is_rela || (dyntabs[DT_PLTREL]->d_un.d_val == DT_REL));
+        add_reloc_table(ctx, dyntabs[DT_JMPREL], dyntabs[DT_PLTRELSZ], is_rela);
+    } // if
+} // add_reloc_tables
+
+// Gather the relocation tables, and make a list of every unique symbol they
+//  reference, so each one only has to be resolved once, no matter how many
+//  relocations point at it.
+static int collect_imports(ElfContext *ctx)
+{
+    size_t pos = 0;  // index into all the tables, end to end.
+    int i;
+
+    if (ctx->cursor == 0)  // not picking up where the last step left off?
+    {
+        add_reloc_tables(ctx);
+
+        if (ctx->symtabcount > 0)
+        {
+            ctx->symaddrs = (uintptr *) ctx_alloc(ctx, ctx->symtabcount * sizeof (uintptr));
+            ctx->seen = (uint8 *) ctx_alloc(ctx, ctx->symtabcount);
+            if ((ctx->symaddrs == NULL) || (ctx->seen == NULL))
+                return 0;
+            else if (ctx->flags & MOJOELF_FLAG_RELOADABLE)
+            {
+                ctx->importfrom = (uint8 *) ctx_alloc(ctx, ctx->symtabcount);
+                if (ctx->importfrom == NULL)
+                    return 0;
+            } // else if
+        } // if
+    } // if
+
+    for (i = 0; i < ctx->reloctabcount; i++)
+    {
+        const ElfRelocTable *table = &ctx->reloctabs[i];
+        size_t j;
+
+        if (ctx->cursor >= (pos + table->count))
+        {
+            pos += table->count;
+            continue;  // did this whole table already.
+        } // if
+
+        for (j = ctx->cursor - pos; j < table->count; j++)
+        {
+            uint32 r_type, r_sym;
+            uintptr r_offset;
+            intptr r_addend;
+            get_reloc(table, j, &r_type, &r_sym, &r_offset, &r_addend);
+            if (r_sym >= ctx->symtabcount)
+                DLOPEN_FAIL("Bogus symbol index");
+            else if ((r_type == R_COPY) || (r_type == R_IRELATIVE))
+                ctx->has_deferred_relocs = 1;
+            if ((r_sym) && (!ctx->seen[r_sym]))
+            {
+                ctx->seen[r_sym] = 1;
+                ctx->importcount++;
+            } // if
+
+            ctx->cursor++;
+            if ( ((ctx->cursor % MOJOELF_RELOC_CHUNK_SIZE) == 0) &&
+                 (ctx->cursor < ctx->reloccount) && (out_of_time(ctx)) )
+                return 1;
+        } // for
+
+        pos += table->count;
+    } // for
+
+    if (ctx->importcount > 0)
+    {
+        int importcount = 0;
+        ctx->imports = (uint32 *) ctx_alloc(ctx, ctx->importcount * sizeof (uint32));
+        if (ctx->imports == NULL)
+            return 0;
+
+        // walk the symbol table instead of the relocations, so the list
+        //  comes out sorted and deterministic.
+        for (i = 1; i < ctx->symtabcount; i++)
+        {
+            int handled = 0;
+            if (!ctx->seen[i])
+                continue;
+            else if (!resolve_tls_symbol(ctx, (uint32) i, &handled))
+                return 0;
+            else if (!handled)
+                ctx->imports[importcount++] = (uint32) i;
+        } // for
+        assert(importcount <= ctx->importcount);
+        ctx->importcount = importcount;
+    } // if
+
+    ctx_free(ctx, ctx->seen);
+    ctx->seen = NULL;
+    return 1;
+} // collect_imports
+
+
+// One slice of work for a (maybe) parallel pass. Results go into disjoint
+//  memory, so no locking needed; errors are reported after everyone's done.
+typedef struct ElfRelocTask
+{
+    ElfContext *ctx;
+    const ElfRelocTable *table;  // NULL when resolving symbols.
+    size_t start;  // first index to process.
+    size_t end;  // one past the last index to process.
+    int failed;  // nonzero if this slice failed.
+    const char *error;  // dlerror string from the failure, if any.
+} ElfRelocTask;
+
+static void resolve_symbols_task(void *_task)
+{
+    ElfRelocTask *task = (ElfRelocTask *) _task;
+    ElfContext *ctx = task->ctx;
+    size_t i;
+
+    for (i = task->start; i < task->end; i++)
+    {
+        const uint32 sym = ctx->imports[i];
+        if (!resolve_symbol(ctx, sym, &ctx->symaddrs[sym]))
+        {
+            task->failed = 1;
+            task->error = take_dlerror();
+            return;
+        } // if
+    } // for
+} // resolve_symbols_task
+
+// R_COPY reads memory other relocations might write, and IFUNC resolvers
+//  can only run once everything else is relocated (and executable), so
+//  these wait for apply_deferred_relocations().
+static inline int is_deferred_reloc(const ElfContext *ctx, const uint32 r_type,
+                                    const uint32 r_sym)
+{
+    if ((r_type == R_COPY) || (r_type == R_IRELATIVE))
+        return 1;
+    return ((ctx->ifuncs != NULL) && (ctx->ifuncs[r_sym] != 0));
+} // is_deferred_reloc
+
+static void apply_relocations_task(void *_task)
+{
+    ElfRelocTask *task = (ElfRelocTask *) _task;
+    ElfContext *ctx = task->ctx;
+    size_t i;
+
+    for (i = task->start; i < task->end; i++)
+    {
+        uint32 r_type, r_sym;
+        uintptr r_offset;
+        intptr r_addend;
+        get_reloc(task->table, i, &r_type, &r_sym, &r_offset, &r_addend);
+        if (is_deferred_reloc(ctx, r_type, r_sym))
+            continue;  // these happen in order, after everything else.
+        else if ((r_type == R_RELATIVE) && (ctx->prerelocated))
+            continue;  // the image server already did these.
+        else if (!do_fixup(ctx, r_type, r_sym, r_offset, r_addend, task->table->is_rela))
+        {
+            task->failed = 1;
+            task->error = take_dlerror();
+            return;
+        } // if
+    } // for
+} // apply_relocations_task
+
+
+#if MOJOELF_SUPPORT_THREADS
+typedef struct ElfWorkQueue
+{
+    MOJOELF_TaskCallback fn;
+    void **tasks;
+    int count;
+    volatile int next;
+} ElfWorkQueue;
+
+static void *workqueue_thread(void *_queue)
+{
+    ElfWorkQueue *queue = (ElfWorkQueue *) _queue;
+    while (1)
+    {
+        const int i = __sync_fetch_and_add(&queue->next, 1);
+        if (i >= queue->count)
+            break;
+        queue->fn(queue->tasks[i]);
+    } // while
+    return NULL;
+} // workqueue_thread
+
+// This is what we use if the app didn't hand us an executor: spin up some
+//  threads for the duration of the call, and help out on this one.
+static void internal_executor(void *userdata, MOJOELF_TaskCallback fn,
+                              void **tasks, int count)
+{
+    pthread_t threads[MOJOELF_MAX_THREADS];
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    ElfWorkQueue queue;
+    int threadcount = (cpus > 0) ? ((int) cpus) : 1;
+    int i;
+
+    if (threadcount > MOJOELF_MAX_THREADS)
+        threadcount = MOJOELF_MAX_THREADS;
+    if (threadcount > count)
+        threadcount = count;
+    threadcount--;  // this thread does work, too.
+
+    queue.fn = fn;
+    queue.tasks = tasks;
+    queue.count = count;
+    queue.next = 0;
+
+    for (i = 0; i < threadcount; i++)
+    {
+        if (pthread_create(&threads[i], NULL, workqueue_thread, &queue) != 0)
+        {
+            threadcount = i;  // oh well, run with what we have.
+            break;
+        } // if
+    } // for
+
+    workqueue_thread(&queue);
+
+    for (i = 0; i < threadcount; i++)
+        pthread_join(threads[i], NULL);
+} // internal_executor
+#endif
+
+// Run a list of work items, in parallel if we have a way to do that.
+//  Errors are reported from the earliest failing item, so the result doesn't
+//  depend on how the work got scheduled. MOJOELF_load_step() runs them one
+//  at a time on its own thread, with ctx->cursor counting the ones done, and
+//  stops between items when time is up.
+static int run_tasks(ElfContext *ctx, MOJOELF_TaskCallback fn,
+                     ElfRelocTask *tasks, const int count)
+{
+    int i;
+
+    if ((ctx->deadline != 0) || (ctx->cursor > 0))
+    {
+        while (ctx->cursor < (size_t) count)
+        {
+            fn(&tasks[ctx->cursor]);
+            if (tasks[ctx->cursor++].failed)
+                break;
+            else if ((ctx->cursor < (size_t) count) && (out_of_time(ctx)))
+                return 1;  // pick back up here next step.
+        } // while
+    } // if
+    else if ((count > 1) && (ctx->executor != NULL))
+    {
+        void **ptrs = (void **) ctx_alloc(ctx, count * sizeof (void *));
+        if (ptrs == NULL)
+            return 0;
+        for (i = 0; i < count; i++)
+            ptrs[i] = &tasks[i];
+        ctx->executor(ctx->userdata, fn, ptrs, count);
+        ctx_free(ctx, ptrs);
+    } // if
+    else
+    {
+        for (i = 0; i < count; i++)
+        {
+            fn(&tasks[i]);
+            if (tasks[i].failed)
+                break;
+        } // for
+    } // else
+
+    for (i = 0; i < count; i++)
+    {
+        if (tasks[i].failed)
+        {
+            if (tasks[i].error != NULL)
+                set_dlerror(tasks[i].error);
+            return 0;
+        } // if
+    } // for
+
+    return 1;
+} // run_tasks
+
+// Store anything that got resolved, and filter the rest down to the front
+//  of the arrays, so the batch resolver only sees what's left.
+//  Returns the new count.
+static int compact_batch(ElfContext *ctx, const char **names, uint32 *hashes,
+                         uint32 *syms, void **addrs, const int count,
+                         const uint8 from)
+{
+    int retval = 0;
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        if (addrs[i] != NULL)
+        {
+            dbgprintf(("Resolved '%s' to %p ...\n", names[i], addrs[i]));
+            ctx->symaddrs[syms[i]] = (uintptr) addrs[i];
+            note_import_source(ctx, syms[i], from);
+        } // if
+        else
+        {
+            names[retval] = names[i];
+            hashes[retval] = hashes[i];
+            syms[retval] = syms[i];
+            addrs[retval] = NULL;
+            retval++;
+        } // if
+    } // for
+    return retval;
+} // compact_batch
+
+// Hand the app every unresolved import at once, once per dependency and
+//  then once more with a NULL handle, instead of one callback per symbol.
+//  The search order is the same as resolve_symbol()'s.
+static int resolve_imports_batched(ElfContext *ctx)
+{
+    const int importcount = ctx->importcount;
+    const char **names = NULL;
+    uint32 *hashes = NULL;
+    uint32 *syms = NULL;
+    void **addrs = NULL;
+    int count = 0;
+    int retval = 0;
+    int i;
+
+    names = (const char **) ctx_alloc(ctx, importcount * sizeof (const char *));
+    hashes = (uint32 *) ctx_alloc(ctx, importcount * sizeof (uint32));
+    syms = (uint32 *) ctx_alloc(ctx, importcount * sizeof (uint32));
+    addrs = (void **) ctx_alloc(ctx, importcount * sizeof (void *));
+    if ((names == NULL) || (hashes == NULL) || (syms == NULL) || (addrs == NULL))
+        goto done;
+
+    for (i = 0; i < importcount; i++)
+    {
+        const uint32 sym = ctx->imports[i];
+        const ElfSymTable *symbol = ctx->symtab + sym;
+        const char *symstr;
+
+        if ((symbol->st_value) && ((symbol->st_value - ctx->base) > ctx->retval->mmaplen))
+        {
+            set_dlerror("Bogus symbol address");
+            goto done;
+        } // if
+        else if (symbol->st_name >= ctx->strtablen)
+        {
+            set_dlerror("Bogus symbol name");
+            goto done;
+        } // else if
+
+        symstr = ctx->strtab + symbol->st_name;
+        if (*symstr == '\0')  // nameless, so not really an import.
+        {
+            if (!resolve_symbol(ctx, sym, &ctx->symaddrs[sym]))
+                goto done;
+            continue;
+        } // if
+
+        names[count] = symstr;
+        hashes[count] = gnu_hash(symstr);
+        syms[count] = sym;
+        if (find_previous_import(ctx, symstr, hashes[count], &addrs[count]))
+        {
+            ctx->symaddrs[sym] = (uintptr) addrs[count];
+            note_import_source(ctx, sym, IMPORT_FROM_DEPENDENCY);
+        } // if
+        else
+            count++;
+    } // for
+
+    if ((count > 0) && (ctx->ns != NULL))  // our namespace goes first.
+    {
+        for (i = 0; i < count; i++)
+            addrs[i] = find_namespace_symbol(ctx, names[i], hashes[i]);
+        count = compact_batch(ctx, names, hashes, syms, addrs, count, IMPORT_FROM_NAMESPACE);
+    } // if
+
+    for (i = 0; (count > 0) && (i < ctx->retval->dlopens_count); i++)
+    {
+        if (ctx->retval->dlopens[i] == NULL)
+            continue;  // it's in our batch or namespace.
+        ctx->resolve_batch(ctx->retval->dlopens[i], names,
+                           (const unsigned int *) hashes, addrs, count);
+        count = compact_batch(ctx, names, hashes, syms, addrs, count, IMPORT_FROM_DEPENDENCY);
+    } // for
+
+    for (i = 0; i < count; i++)  // try our own export table?
+        addrs[i] = find_exported_symbol_hashed(ctx->retval, names[i], hashes[i]);
+    count = compact_batch(ctx, names, hashes, syms, addrs, count, IMPORT_FROM_SELF);
+
+    if ((count > 0) && (ctx->batch != NULL))  // then the rest of the set?
+    {
+        for (i = 0; i < count; i++)
+            addrs[i] = find_batch_symbol(ctx, names[i], hashes[i]);
+        count = compact_batch(ctx, names, hashes, syms, addrs, count, IMPORT_FROM_BATCH);
+    } // if
+
+    if (count > 0)  // last try.
+    {
+        ctx->resolve_batch(NULL, names, (const unsigned int *) hashes, addrs, count);
+        count = compact_batch(ctx, names, hashes, syms, addrs, count, IMPORT_FROM_GLOBAL);
+    } // if
+
+    for (i = 0; i < count; i++)
+    {
+        if (ELF_ST_BIND(ctx->symtab[syms[i]].st_info) != STB_WEAK)
+        {
+            dbgprintf(("Couldn't resolve '%s' ...\n", names[i]));
+            set_dlerror("Couldn't resolve symbol");
+            goto done;
+        } // if
+    } // for
+
+    retval = 1;
+
+done:
+    ctx_free(ctx, addrs);
+    ctx_free(ctx, syms);
+    ctx_free(ctx, hashes);
+    ctx_free(ctx, names);
+    return retval;
+} // resolve_imports_batched
+
+// First pass: resolve every unique symbol the relocations want. Slow app
+//  resolvers can do this in parallel if they promise they're thread-safe.
+static int resolve_imports(ElfContext *ctx)
+{
+    const int importcount = ctx->importcount;
+    int retval = 0;
+    int i;
+
+    if (importcount == 0)
+        return 1;  // nothing to do.
+
+    if (ctx->tasks == NULL)  // not picking up where the last step left off?
+    {
+        int taskcount = 1;
+        ElfRelocTask *tasks = NULL;
+
+        if ((ctx->reload != NULL) && (ctx->reload->imports != NULL))
+        {
+            const ElfReload *reload = ctx->reload;
+            const ElfHandle *h = ctx->retval;
+            int same = (reload->dlopens_count == h->dlopens_count);
+            for (i = 0; same && (i < h->dlopens_count); i++)
+                same = (reload->dlopens[i] == h->dlopens[i]);
+            ctx->reload->same_dlopens = same;
+        } // if
+
+        if (ctx->resolve_batch != NULL)
+            return resolve_imports_batched(ctx);
+
+        // steps want small slices, so they can stop between them.
+        if ( (ctx->deadline != 0) ||
+             ( (ctx->flags & MOJOELF_FLAG_THREADSAFE_RESOLVER) &&
+               (ctx->reloccount >= MOJOELF_PARALLEL_RELOC_THRESHOLD) ) )
+        {
+            taskcount = (importcount + (MOJOELF_SYMBOL_CHUNK_SIZE-1)) / MOJOELF_SYMBOL_CHUNK_SIZE;
+        } // if
+
+        tasks = (ElfRelocTask *) ctx_alloc(ctx, taskcount * sizeof (ElfRelocTask));
+        if (tasks == NULL)
+            return 0;
+
+        for (i = 0; i < taskcount; i++)
+        {
+            tasks[i].ctx = ctx;
+            tasks[i].start = ((size_t) i) * MOJOELF_SYMBOL_CHUNK_SIZE;
+            tasks[i].end = tasks[i].start + MOJOELF_SYMBOL_CHUNK_SIZE;
+            if ((taskcount == 1) || (tasks[i].end > importcount))
+                tasks[i].end = importcount;
+        } // for
+
+        ctx->tasks = tasks;
+        ctx->taskcount = taskcount;
+    } // if
+
+    retval = run_tasks(ctx, resolve_symbols_task, ctx->tasks, ctx->taskcount);
+    if (!ctx->yield)
+    {
+        ctx_free(ctx, ctx->tasks);
+        ctx->tasks = NULL;
+    } // if
+    return retval;
+} // resolve_imports
+
+static void free_import_table(ElfImportTable *table)
+{
+    if (table != NULL)
+    {
+        Free(table->names);
+        Free(table->buckets);
+        Free(table->syms);
+        Free(table);
+    } // if
+} // free_import_table
+
+// MOJOELF_FLAG_RELOADABLE: keep what every named import resolved to, as
+//  long as one of our dependencies supplied it. Things in the image itself
+//  move with it, and anything else can give a different answer next time.
+static void remember_imports(ElfContext *ctx)
+{
+    const uint8 *mmapaddr = (const uint8 *) ctx->retval->mmapaddr;
+    const size_t mmaplen = ctx->retval->mmaplen;
+    const uint8 *importfrom = ctx->importfrom;
+    ElfImportTable *table = NULL;
+    uint32 bucket_count = 1;
+    size_t nameslen = 0;
+    char *ptr;
+    int i;
+
+    if (importfrom == NULL)
+        return;  // no imports at all.
+
+    for (i = 0; i < ctx->importcount; i++)
+    {
+        const uint32 sym = ctx->imports[i];
+        const uintptr addr = ctx->symaddrs[sym];
+        const char *symstr = ctx->strtab + ctx->symtab[sym].st_name;
+        if ((addr != 0) && (*symstr != '\0') && (importfrom[sym] == IMPORT_FROM_DEPENDENCY) &&
+            ((addr < (uintptr) mmapaddr) || (addr >= (uintptr) (mmapaddr + mmaplen))))
+            nameslen += strlen(symstr) + 1;
+    } // for
+
+    if (nameslen == 0)
+        return;  // nothing worth keeping.
+
+    table = (ElfImportTable *) Malloc(sizeof (ElfImportTable));
+    if (table == NULL)
+        goto failed;
+
+    while (bucket_count < (uint32) ctx->importcount)
+        bucket_count <<= 1;
+
+    table->syms = (ElfSymbols *) Malloc(ctx->importcount * sizeof (ElfSymbols));
+    table->buckets = (int *) Malloc(bucket_count * sizeof (int));
+    table->names = (char *) Malloc(nameslen);
+    if ((table->syms == NULL) || (table->buckets == NULL) || (table->names == NULL))
+        goto failed;
+
+    table->bucket_mask = bucket_count - 1;
+    for (i = 0; i < bucket_count; i++)
+        table->buckets[i] = -1;
+
+    ptr = table->names;
+    for (i = 0; i < ctx->importcount; i++)
+    {
+        const uint32 sym = ctx->imports[i];
+        const uintptr addr = ctx->symaddrs[sym];
+        const char *symstr = ctx->strtab + ctx->symtab[sym].st_name;
+        if ((addr != 0) && (*symstr != '\0') && (importfrom[sym] == IMPORT_FROM_DEPENDENCY) &&
+            ((addr < (uintptr) mmapaddr) || (addr >= (uintptr) (mmapaddr + mmaplen))))
+        {
+            ElfSymbols *s = &table->syms[table->syms_count];
+            const uint32 hash = gnu_hash(symstr);
+            const uint32 bucket = hash & table->bucket_mask;
+            Strcpy(ptr, symstr);
+            s->sym = ptr;
+            s->addr = (void *) addr;
+            s->hash = hash;
+            s->next = table->buckets[bucket];
+            table->buckets[bucket] = table->syms_count++;
+            ptr += strlen(symstr) + 1;
+        } // if
+    } // for
+
+    ctx->retval->imports = table;
+    return;
+
+failed:  // not fatal, MOJOELF_dlreload() will just resolve everything.
+    (void) take_dlerror();
+    free_import_table(table);
+} // remember_imports
+
+// If a relocation resolved to one of our own STT_GNU_IFUNC symbols (or
+//  another image's, in a MOJOELF_dlopen_many() set), what we have is the
+//  address of its resolver, not the function it picks. Note
+//  these so the relocations wait until the resolvers can run.
+static int mark_local_ifuncs(ElfContext *ctx)
+{
+    const uint8 *mmapaddr = (const uint8 *) ctx->retval->mmapaddr;
+    int i;
+
+    for (i = 0; i < ctx->importcount; i++)
+    {
+        const uint32 sym = ctx->imports[i];
+        const ElfSymTable *symbol = ctx->symtab + sym;
+        if ( ( (ELF_ST_TYPE(symbol->st_info) == STT_GNU_IFUNC) &&
+               (symbol->st_shndx != SHN_UNDEF) &&
+               (ctx->symaddrs[sym] == (uintptr) (mmapaddr + (symbol->st_value - ctx->base))) ) ||
+             ( (ctx->batch != NULL) && (is_batch_ifunc(ctx, ctx->symaddrs[sym])) ) )
+        {
+            if (ctx->ifuncs == NULL)
+            {
+                ctx->ifuncs = (uint8 *) ctx_alloc(ctx, ctx->symtabcount);
+                if (ctx->ifuncs == NULL)
+                    return 0;
+            } // if
+            ctx->ifuncs[sym] = 1;
+            ctx->has_deferred_relocs = 1;
+        } // if
+    } // for
+
+    return 1;
+} // mark_local_ifuncs
+
+// Second pass: write the fixups. Tables get carved into fixed-size chunks
+//  that touch disjoint memory, so they can be applied in any order.
+//  Anything is_deferred_reloc() flags is skipped here.
+static int apply_relocations(ElfContext *ctx)
+{
+    // steps want small slices, so they can stop between them.
+    const size_t chunk = ( (ctx->deadline != 0) ||
+                           ((ctx->reloccount >= MOJOELF_PARALLEL_RELOC_THRESHOLD) &&
+                            (ctx->workspace == NULL)) ) ?
+                            MOJOELF_RELOC_CHUNK_SIZE : ctx->reloccount;
+    int retval = 0;
+    int i;
+
+    if ((ctx->reloccount == 0) || (ctx->cachehit))
+        return 1;  // nothing to do.
+
+    if (ctx->tasks == NULL)  // not picking up where the last step left off?
+    {
+        ElfRelocTask *tasks = NULL;
+        int taskcount = 0;
+
+        for (i = 0; i < ctx->reloctabcount; i++)
+            taskcount += (int) ((ctx->reloctabs[i].count + (chunk-1)) / chunk);
+
+        tasks = (ElfRelocTask *) ctx_alloc(ctx, taskcount * sizeof (ElfRelocTask));
+        if (tasks == NULL)
+            return 0;
+
+        taskcount = 0;
+        for (i = 0; i < ctx->reloctabcount; i++)
+        {
+            const ElfRelocTable *table = &ctx->reloctabs[i];
+            size_t start;
+            for (start = 0; start < table->count; start += chunk)
+            {
+                ElfRelocTask *task = &tasks[taskcount++];
+                task->ctx = ctx;
+                task->table = table;
+                task->start = start;
+                task->end = start + chunk;
+                if (task->end > table->count)
+                    task->end = table->count;
+            } // for
+        } // for
+
+        ctx->tasks = tasks;
+        ctx->taskcount = taskcount;
+    } // if
+
+    retval = run_tasks(ctx, apply_relocations_task, ctx->tasks, ctx->taskcount);
+    if (!ctx->yield)
+    {
+        ctx_free(ctx, ctx->tasks);
+        ctx->tasks = NULL;
+    } // if
+    return retval;
+} // apply_relocations
+
+// On-disk cache of relocated images. After a full load, we write the
+//  relocated writable pages to cache_dir, along with a manifest of what
+//  went into them: the image's contents, where it was mapped, and every
+//  address the resolver handed us. If a later load has the same image, gets
+//  mapped at the same address, and gets the same answers from the resolver,
+//  we map those pages over the image and skip applying relocations. If
+//  anything differs, it's a miss, and the entry is rewritten.
+#if MOJOELF_SUPPORT_CACHE
+#define MOJOELF_CACHE_VERSION 2
+
+typedef struct ElfCacheHeader
+{
+    char magic[8];  // "MOJOELFC"
+    uint32 version;  // MOJOELF_CACHE_VERSION
+    uint32 ptrsize;  // sizeof (uintptr), so 32 and 64-bit builds don't mix.
+    uint64 imagehash;  // hash_buffer() of the whole image.
+    uint64 imagelen;  // size of the image in bytes.
+    uint64 base;  // where the image was mapped.
+    uint64 mmaplen;  // how much was mapped.
+    uint32 rangecount;  // ElfCacheRange entries following this header.
+    uint32 importcount;  // ElfCacheImport entries following the ranges.
+    uint64 dataoffset;  // page-aligned file offset of the first range's data.
+    uint32 snapshot;  // nonzero if pages are from after initializers ran.
+    uint32 reserved;  // zero.
+} ElfCacheHeader;
+
+typedef struct ElfCacheRange  // a page-aligned run of writable pages.
+{
+    uint64 offset;  // from the start of the mapping.
+    uint64 len;
+} ElfCacheRange;
+
+typedef struct ElfCacheImport
+{
+    uint64 sym;  // symbol table index.
+    uint64 addr;  // what it resolved to.
+} ElfCacheImport;
+
+static void make_cache_path(const char *cache_dir, const uint64 imagehash,
+                            const char *ext, char *path)
+{
+    static const char hex[] = "0123456789abcdef";
+    const size_t dirlen = strlen(cache_dir);
+    char *ptr = path + dirlen;
+    int i;
+
+    Memcopy(path, cache_dir, dirlen);
+    *(ptr++) = '/';
+    for (i = 60; i >= 0; i -= 4)
+        *(ptr++) = hex[(imagehash >> i) & 0xF];
+    Strcpy(ptr, ext);
+} // make_cache_path
+
+static void get_cache_path(const ElfContext *ctx, char *path)
+{
+    const char *ext = ctx->snapshot ? ".mojoelf-snapshot" : ".mojoelf-cache";
+    make_cache_path(ctx->cache_dir, ctx->imagehash, ext, path);
+} // get_cache_path
+
+static char *alloc_cache_path(const ElfContext *ctx)
+{
+    // dir + '/' + 16 hex digits + ".mojoelf-snapshot" +
+    //  ".XXXXXX" + null.
+    char *retval = (char *) Malloc(strlen(ctx->cache_dir) + 48);
+    if (retval != NULL)
+        get_cache_path(ctx, retval);
+    return retval;
+} // alloc_cache_path
+
+// Images with TLS, R_COPY, or IFUNCs depend on more than addresses, and
+//  text relocations would touch pages we don't store.
+static int is_cacheable(const ElfContext *ctx)
+{
+    const ElfDynTable *flags = ctx->dyntabs[DT_FLAGS];
+    if ((ctx->cache_dir == NULL) || (ctx->tlsprogram != NULL))
+        return 0;
+    else if (ctx->has_deferred_relocs)
+        return 0;
+    else if (ctx->dyntabs[DT_TEXTREL] != NULL)
+        return 0;
+    else if ((flags != NULL) && (flags->d_un.d_val & DF_TEXTREL))
+        return 0;
+    return 1;
+} // is_cacheable
+
+// Page-aligned ranges covering every writable segment. That's everywhere
+//  relocations can land, without text relocations.
+static int get_writable_ranges(const ElfContext *ctx, ElfCacheRange **_ranges)
+{
+    const size_t offset = (size_t) ctx->header->e_phoff;
+    const ElfProgram *program = (const ElfProgram *) (ctx->buf + offset);
+    const int header_count = (int) ctx->header->e_phnum;
+    ElfCacheRange *ranges = NULL;
+    int count = 0;
+    int i;
+
+    ranges = (ElfCacheRange *) Malloc((header_count + 1) * sizeof (ElfCacheRange));
+    if (ranges == NULL)
+        return -1;
+
+    for (i = 0; i < header_count; i++, program++)
+    {
+        if ((program->p_type == PT_LOAD) && (program->p_memsz > 0) && (program->p_flags & 2))
+        {
+            const uintptr start = program->p_vaddr - ctx->base;
+            const uintptr end = start + program->p_memsz;
+            const uintptr pagestart = start - (start % MOJOELF_PAGESIZE);
+            const uintptr pageend = end + ((MOJOELF_PAGESIZE - (end % MOJOELF_PAGESIZE)) % MOJOELF_PAGESIZE);
+            ranges[count].offset = (uint64) pagestart;
+            ranges[count].len = (uint64) (pageend - pagestart);
+            count++;
+        } // if
+    } // for
+
+    *_ranges = ranges;
+    return count;
+} // get_writable_ranges
+
+// Called before map_pages(), so we know where to ask for the mapping.
+//  This never fails; it just might not find anything.
+static int open_image_cache(ElfContext *ctx)
+{
+    ElfCacheHeader header;
+    char *path = NULL;
+
+    if ((ctx->cache_dir == NULL) || (ctx->tlsprogram != NULL))
+        return 1;
+
+    if (!ctx->hashed)
+    {
+        ctx->imagehash = hash_buffer(ctx->buf, ctx->buflen);
+        ctx->hashed = 1;
+    } // if
+
+    path = alloc_cache_path(ctx);
+    if (path == NULL)
+        return 1;
+
+    ctx->cachefd = open(path, O_RDONLY);
+    Free(path);
+
+    if (ctx->cachefd == -1)
+        return 1;  // not cached yet.
+    else if ( (pread(ctx->cachefd, &header, sizeof (header), 0) != sizeof (header)) ||
+              (memcmp(header.magic, "MOJOELFC", 8) != 0) ||
+              (header.version != MOJOELF_CACHE_VERSION) ||
+              (header.ptrsize != sizeof (uintptr)) ||
+              (header.imagehash != ctx->imagehash) ||
+              (header.imagelen != (uint64) ctx->buflen) ||
+              (header.mmaplen != (uint64) ctx->mmaplen) ||
+              (header.snapshot != (uint32) ctx->snapshot) ||
+              (header.dataoffset % MOJOELF_PAGESIZE) )
+    {
+        close(ctx->cachefd);  // stale or damaged; we'll replace it later.
+        ctx->cachefd = -1;
+        return 1;
+    } // else if
+
+    ctx->cachebase = (void *) (uintptr) header.base;
+    return 1;
+} // open_image_cache
+
+// Everything is resolved. If it all matches the manifest, map the cached
+//  pages over the image and report a hit, so relocations can be skipped.
+//  Returns 1 on a hit, 0 on a miss, -1 if the mapping got wrecked.
+static int restore_cached_image(ElfContext *ctx)
+{
+    uint8 *mmapaddr = (uint8 *) ctx->retval->mmapaddr;
+    ElfCacheHeader header;
+    ElfCacheRange *ranges = NULL;
+    ElfCacheImport *imports = NULL;
+    struct stat statbuf;
+    size_t tablelen = 0;
+    uint64 dataoffset = 0;
+    uint64 datalen = 0;
+    int rangecount = 0;
+    int retval = 0;
+    int i;
+
+    if ((ctx->cachefd == -1) || (!is_cacheable(ctx)))
+        return 0;
+    else if (ctx->cachebase != (void *) mmapaddr)
+        return 0;  // couldn't get the same address this time.
+    else if ((rangecount = get_writable_ranges(ctx, &ranges)) < 0)
+        return 0;
+    else if (pread(ctx->cachefd, &header, sizeof (header), 0) != sizeof (header))
+        goto done;
+    else if ((header.rangecount != rangecount) || (header.importcount != ctx->importcount))
+        goto done;
+
+    tablelen = (rangecount * sizeof (ElfCacheRange)) + (ctx->importcount * sizeof (ElfCacheImport));
+    if (tablelen > 0)
+    {
+        uint8 *tables = (uint8 *) Malloc(tablelen);
+        if (tables == NULL)
+            goto done;
+        else if (pread(ctx->cachefd, tables, tablelen, sizeof (header)) != (ssize_t) tablelen)
+        {
+            Free(tables);
+            goto done;
+        } // else if
+        imports = (ElfCacheImport *) (tables + (rangecount * sizeof (ElfCacheRange)));
+
+        if (memcmp(tables, ranges, rangecount * sizeof (ElfCacheRange)) != 0)
+        {
+            Free(tables);
+            goto done;
+        } // if
+
+        for (i = 0; i < ctx->importcount; i++)
+        {
+            const uint32 sym = ctx->imports[i];
+            if ((imports[i].sym != sym) || (imports[i].addr != (uint64) ctx->symaddrs[sym]))
+                break;  // resolver gave us something different this time.
+        } // for
+
+        Free(tables);
+        if (i < ctx->importcount)
+            goto done;
+    } // if
+
+    // Mapping past the end of the file would hand the image SIGBUS instead
+    //  of a miss, so make sure every page we're about to map is there.
+    for (i = 0; i < rangecount; i++)
+        datalen += ranges[i].len;
+
+    if ((header.dataoffset % MOJOELF_PAGESIZE) || (header.dataoffset < sizeof (header) + tablelen))
+        goto done;
+    else if (fstat(ctx->cachefd, &statbuf) == -1)
+        goto done;
+    else if ((statbuf.st_size < 0) || ((uint64) statbuf.st_size < header.dataoffset))
+        goto done;
+    else if (((uint64) statbuf.st_size - header.dataoffset) < datalen)
+        goto done;
+
+    dataoffset = header.dataoffset;
+    for (i = 0; i < rangecount; i++)
+    {
+        void *addr = mmapaddr + ranges[i].offset;
+        const int prot = PROT_READ | PROT_WRITE;
+        const int flags = MAP_PRIVATE | MAP_FIXED;
+        if (mmap(addr, (size_t) ranges[i].len, prot, flags, ctx->cachefd, (off_t) dataoffset) == MAP_FAILED)
+        {
+            // put back the pages we already replaced, and relocate normally.
+            int j;
+            for (j = 0; j < i; j++)
+            {
+                addr = mmapaddr + ranges[j].offset;
+                if (mmap(addr, (size_t) ranges[j].len, prot, flags | MAP_ANON, -1, 0) == MAP_FAILED)
+                    break;
+            } // for
+            if ((j < i) || (!copy_segments(ctx, 1)))
+                retval = -1;  // we're in trouble now.
+            goto done;
+        } // if
+        dataoffset += ranges[i].len;
+    } // for
+
+    dbgprintf(("Restored relocated image from cache ...\n"));
+    ctx->skip_init = ctx->snapshot;  // snapshots already did this.
+    retval = 1;
+
+done:
+    Free(ranges);
+    return retval;
+} // restore_cached_image
+
+// We write to a temp file and rename it into place, so other processes
+//  never see half a file. mkstemp() picks a name nobody else has, with
+//  O_EXCL, so we never write through something another process (or a
+//  symlink someone planted in cache_dir) left behind. Appends the suffix
+//  to path, so it can be unlinked later.
+static int open_temp_file(char *path)
+{
+    int fd;
+    Strcpy(path + strlen(path), ".XXXXXX");
+    fd = mkstemp(path);
+    if (fd != -1)
+        fchmod(fd, 0644);  // mkstemp() makes it 0600; other users can read it.
+    return fd;
+} // open_temp_file
+
+static int write_all(const int fd, const void *buf, size_t len)
+{
+    const uint8 *ptr = (const uint8 *) buf;
+    while (len > 0)
+    {
+        const ssize_t rc = write(fd, ptr, len);
+        if (rc <= 0)
+            return 0;
+        ptr += rc;
+        len -= (size_t) rc;
+    } // while
+    return 1;
+} // write_all
+
+// Relocations are applied, and for snapshots, initializers have run, too.
+//  Save it all. Failures just mean there's no cache entry next time; the
+//  load still succeeded.
+static void store_cached_image(ElfContext *ctx)
+{
+    const uint8 *mmapaddr = (const uint8 *) ctx->retval->mmapaddr;
+    static const uint8 zeroes[64] = { 0 };
+    ElfCacheHeader header;
+    ElfCacheRange *ranges = NULL;
+    ElfCacheImport import;
+    char *path = NULL;
+    char *tmppath = NULL;
+    size_t pos = 0;
+    int rangecount = 0;
+    int okay = 0;
+    int fd = -1;
+    int i;
+
+    if (!is_cacheable(ctx))
+        return;
+    else if ((rangecount = get_writable_ranges(ctx, &ranges)) < 0)
+        return;
+    else if ((path = alloc_cache_path(ctx)) == NULL)
+        goto done;
+    else if ((tmppath = alloc_cache_path(ctx)) == NULL)
+        goto done;
+
+    fd = open_temp_file(tmppath);
+    if (fd == -1)
+        goto done;
+
+    Memzero(&header, sizeof (header));
+    Memcopy(header.magic, "MOJOELFC", 8);
+    header.version = MOJOELF_CACHE_VERSION;
+    header.ptrsize = sizeof (uintptr);
+    header.imagehash = ctx->imagehash;
+    header.imagelen = (uint64) ctx->buflen;
+    header.base = (uint64) (uintptr) mmapaddr;
+    header.mmaplen = (uint64) ctx->mmaplen;
+    header.rangecount = (uint32) rangecount;
+    header.importcount = (uint32) ctx->importcount;
+    header.snapshot = (uint32) ctx->snapshot;
+    pos = sizeof (header) + (rangecount * sizeof (ElfCacheRange)) +
+          (ctx->importcount * sizeof (ElfCacheImport));
+    header.dataoffset = (uint64) (pos + ((MOJOELF_PAGESIZE - (pos % MOJOELF_PAGESIZE)) % MOJOELF_PAGESIZE));
+
+    if (!write_all(fd, &header, sizeof (header)))
+        goto done;
+    else if (!write_all(fd, ranges, rangecount * sizeof (ElfCacheRange)))
+        goto done;
+
+    for (i = 0; i < ctx->importcount; i++)
+    {
+        import.sym = (uint64) ctx->imports[i];
+        import.addr = (uint64) ctx->symaddrs[ctx->imports[i]];
+        if (!write_all(fd, &import, sizeof (import)))
+            goto done;
+    } // for
+
+    while (pos < header.dataoffset)
+    {
+        size_t len = (size_t) (header.dataoffset - pos);
+        if (len > sizeof (zeroes))
+            len = sizeof (zeroes);
+        if (!write_all(fd, zeroes, len))
+            goto done;
+        pos += len;
+    } // while
+
+    for (i = 0; i < rangecount; i++)
+    {
+        if (!write_all(fd, mmapaddr + ranges[i].offset, (size_t) ranges[i].len))
+            goto done;
+    } // for
+
+    if (close(fd) == -1)
+    {
+        fd = -1;
+        goto done;
+    } // if
+
+    fd = -1;
+    okay = (rename(tmppath, path) == 0);
+
+done:
+    if (fd != -1)
+        close(fd);
+    if ((!okay) && (tmppath != NULL))
+        unlink(tmppath);
+    Free(tmppath);
+    Free(path);
+    Free(ranges);
+} // store_cached_image
+
+// Residency profiles: which pages of an image a process actually touched,
+//  one bit per page, kept in the cache_dir next to the cache entries.
+//  MOJOELF_profile_save() records one; MOJOELF_FLAG_PREFETCH loads fault
+//  those pages in before anything needs them. Offsets are from the start
+//  of the mapping, so a profile is good wherever the image lands.
+#define MOJOELF_PROFILE_VERSION 1
+
+typedef struct ElfProfileHeader
+{
+    char magic[8];  // "MOJOELFP"
+    uint32 version;  // MOJOELF_PROFILE_VERSION
+    uint32 pagesize;  // MOJOELF_PAGESIZE
+    uint64 imagehash;  // hash_buffer() of the whole image.
+    uint64 mmaplen;  // the bitmap that follows has a bit per page of this.
+} ElfProfileHeader;
+
+typedef struct ElfPrefetch
+{
+    uint8 *mmapaddr;
+    size_t pagecount;
+    uint8 *bitmap;  // follows this struct in the same block.
+} ElfPrefetch;
+
+static char *alloc_profile_path(const char *cache_dir, const uint64 imagehash)
+{
+    // dir + '/' + 16 hex digits + ".mojoelf-profile" +
+    //  ".XXXXXX" + null.
+    char *retval = (char *) Malloc(strlen(cache_dir) + 48);
+    if (retval != NULL)
+        make_cache_path(cache_dir, imagehash, ".mojoelf-profile", retval);
+    return retval;
+} // alloc_profile_path
+
+// Returns nonzero if there's a profile that fits, with its bits in bitmap.
+static int read_profile(const char *cache_dir, const uint64 imagehash,
+                        const size_t mmaplen, uint8 *bitmap)
+{
+    const size_t bitmaplen = ((mmaplen / MOJOELF_PAGESIZE) + 7) / 8;
+    char *path = alloc_profile_path(cache_dir, imagehash);
+    ElfProfileHeader header;
+    int retval = 0;
+    int fd = -1;
+
+    if (path == NULL)
+        return 0;
+
+    fd = open(path, O_RDONLY);
+    Free(path);
+    if (fd == -1)
+        return 0;  // nobody saved one yet.
+
+    if ( (pread(fd, &header, sizeof (header), 0) == sizeof (header)) &&
+         (memcmp(header.magic, "MOJOELFP", 8) == 0) &&
+         (header.version == MOJOELF_PROFILE_VERSION) &&
+         (header.pagesize == MOJOELF_PAGESIZE) &&
+         (header.imagehash == imagehash) &&
+         (header.mmaplen == (uint64) mmaplen) )
+    {
+        retval = (pread(fd, bitmap, bitmaplen, sizeof (header)) == (ssize_t) bitmaplen);
+    } // if
+
+    close(fd);
+    return retval;
+} // read_profile
+
+// Fault in every run of pages in the profile. MADV_POPULATE_READ maps them
+//  all now; older kernels only get MADV_WILLNEED, which just starts reading
+//  file-backed pages in. An async one can outlive the handle; if the range
+//  has been unmapped or reused by then, this just faults in (or fails to
+//  fault in) whatever is there now. That wastes I/O, but it only reads.
+static void prefetch_task(void *_prefetch)
+{
+    ElfPrefetch *prefetch = (ElfPrefetch *) _prefetch;
+    const uint8 *bitmap = prefetch->bitmap;
+    size_t i = 0;
+
+    while (i < prefetch->pagecount)
+    {
+        size_t end = i;
+        while ((end < prefetch->pagecount) && (bitmap[end / 8] & (1 << (end % 8))))
+            end++;
+
+        if (end > i)
+        {
+            void *addr = prefetch->mmapaddr + (i * MOJOELF_PAGESIZE);
+            const size_t len = (end - i) * MOJOELF_PAGESIZE;
+            if (madvise(addr, len, MADV_POPULATE_READ) == -1)
+                madvise(addr, len, MADV_WILLNEED);
+        } // if
+
+        i = end + 1;
+    } // while
+
+    Free(prefetch);
+} // prefetch_task
+
+#if MOJOELF_SUPPORT_THREADS
+static void *prefetch_thread(void *prefetch)
+{
+    prefetch_task(prefetch);
+    return NULL;
+} // prefetch_thread
+#endif
+
+// Runs once everything is mapped, cache pages included, so there's
+//  something to fault in. Nothing here fails the load.
+static int prefetch_pages(ElfContext *ctx)
+{
+    const unsigned int flags = MOJOELF_FLAG_PREFETCH | MOJOELF_FLAG_PREFETCH_ASYNC;
+    const size_t pagecount = ctx->retval->mmaplen / MOJOELF_PAGESIZE;
+    ElfPrefetch *prefetch = NULL;
+    int started = 0;
+
+    if (ctx->cache_dir == NULL)
+        return 1;
+
+    // MOJOELF_profile_save() needs this later, whether we prefetch or not.
+    if (!ctx->hashed)
+    {
+        ctx->imagehash = hash_buffer(ctx->buf, ctx->buflen);
+        ctx->hashed = 1;
+    } // if
+    ctx->retval->imagehash = ctx->imagehash;
+    ctx->retval->hashed = 1;
+
+    if ((ctx->flags & flags) == 0)
+        return 1;
+
+    prefetch = (ElfPrefetch *) Malloc(sizeof (ElfPrefetch) + ((pagecount + 7) / 8));
+    if (prefetch == NULL)
+        return 1;
+
+    prefetch->mmapaddr = (uint8 *) ctx->retval->mmapaddr;
+    prefetch->pagecount = pagecount;
+    prefetch->bitmap = (uint8 *) (prefetch + 1);
+    if (!read_profile(ctx->cache_dir, ctx->imagehash, ctx->retval->mmaplen, prefetch->bitmap))
+    {
+        Free(prefetch);
+        return 1;
+    } // if
+
+    #if MOJOELF_SUPPORT_THREADS
+    if (ctx->flags & MOJOELF_FLAG_PREFETCH_ASYNC)
+    {
+        const MOJOELF_Callbacks *cb = ctx->callbacks;
+        if (cb->submit != NULL)
+            started = cb->submit(cb->userdata, prefetch_task, prefetch);
+        else
+        {
+            pthread_attr_t attr;
+            pthread_t thread;
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            started = (pthread_create(&thread, &attr, prefetch_thread, prefetch) == 0);
+            pthread_attr_destroy(&attr);
+        } // else
+    } // if
+    #endif
+
+    if (!started)  // synchronous, or couldn't get a thread; do it here.
+        prefetch_task(prefetch);
+
+    return 1;
+} // prefetch_pages
+
+// Pages this process has touched. /proc/self/pagemap knows exactly, even
+//  for file-backed pages other processes brought in; without it, mincore()
+//  says what's resident, which is close enough.
+static void sample_residency(const ElfHandle *h, uint8 *bitmap)
+{
+    const uintptr firstpage = ((uintptr) h->mmapaddr) / MOJOELF_PAGESIZE;
+    const size_t pagecount = h->mmaplen / MOJOELF_PAGESIZE;
+    uint64 entries[512];
+    unsigned char vec[512];
+    size_t i = 0;
+    size_t j;
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+
+    if (fd != -1)
+    {
+        while (i < pagecount)
+        {
+            const size_t count = ((pagecount - i) < 512) ? (pagecount - i) : 512;
+            const off_t offset = (off_t) ((firstpage + i) * sizeof (uint64));
+            const ssize_t len = (ssize_t) (count * sizeof (uint64));
+            if (pread(fd, entries, (size_t) len, offset) != len)
+                break;
+
+            for (j = 0; j < count; j++)
+            {
+                if (entries[j] & (((uint64) 3) << 62))  // present or swapped.
+                    bitmap[(i + j) / 8] |= (uint8) (1 << ((i + j) % 8));
+            } // for
+            i += count;
+        } // while
+        close(fd);
+    } // if
+
+    if (i == pagecount)
+        return;
+
+    for (i = 0; i < pagecount; i += 512)
+    {
+        const size_t count = ((pagecount - i) < 512) ? (pagecount - i) : 512;
+        uint8 *addr = ((uint8 *) h->mmapaddr) + (i * MOJOELF_PAGESIZE);
+        if (mincore(addr, count * MOJOELF_PAGESIZE, vec) == -1)
+            return;
+
+        for (j = 0; j < count; j++)
+        {
+            if (vec[j] & 1)
+                bitmap[(i + j) / 8] |= (uint8) (1 << ((i + j) % 8));
+        } // for
+    } // for
+} // sample_residency
+
+int MOJOELF_profile_save(void *lib)
+{
+    ElfHandle *h = (ElfHandle *) lib;
+    const char *cache_dir = NULL;
+    const size_t bitmaplen = (h != NULL) ? (((h->mmaplen / MOJOELF_PAGESIZE) + 7) / 8) : 0;
+    ElfProfileHeader header;
+    uint8 *bitmap = NULL;
+    char *path = NULL;
+    char *tmppath = NULL;
+    int okay = 0;
+    int fd = -1;
+
+    if (h == NULL)
+        DLOPEN_FAIL("Bogus library handle");
+    else if ((cache_dir = h->callbacks.cache_dir) == NULL)
+        DLOPEN_FAIL("Library wasn't loaded with a cache_dir");
+    else if (h->mmapaddr == MAP_FAILED)
+        DLOPEN_FAIL("Library isn't mapped");
+    else if (!h->hashed)  // callbacks, remote, reload, workspace loads skip it.
+        DLOPEN_FAIL("Library load didn't hash the image");
+
+    // Keep what earlier runs saw, so each run only adds to it.
+    bitmap = (uint8 *) Malloc(bitmaplen);
+    if (bitmap == NULL)
+        return 0;
+    else if (!read_profile(cache_dir, h->imagehash, h->mmaplen, bitmap))
+        Memzero(bitmap, bitmaplen);  // might have read half of a bad one.
+
+    sample_residency(h, bitmap);
+
+    if ((path = alloc_profile_path(cache_dir, h->imagehash)) == NULL)
+        goto done;
+    else if ((tmppath = alloc_profile_path(cache_dir, h->imagehash)) == NULL)
+        goto done;
+
+    fd = open_temp_file(tmppath);
+    if (fd == -1)
+        goto done;
+
+    Memzero(&header, sizeof (header));
+    Memcopy(header.magic, "MOJOELFP", 8);
+    header.version = MOJOELF_PROFILE_VERSION;
+    header.pagesize = MOJOELF_PAGESIZE;
+    header.imagehash = h->imagehash;
+    header.mmaplen = (uint64) h->mmaplen;
+
+    if (!write_all(fd, &header, sizeof (header)))
+        goto done;
+    else if (!write_all(fd, bitmap, bitmaplen))
+        goto done;
+
+    okay = (close(fd) == 0);
+    fd = -1;
+    if (okay)
+        okay = (rename(tmppath, path) == 0);
+
+done:
+    if (fd != -1)
+        close(fd);
+    if ((!okay) && (tmppath != NULL))
+        unlink(tmppath);
+    Free(tmppath);
+    Free(path);
+    Free(bitmap);
+
+    if (!okay)
+        set_dlerror("Couldn't write profile");
+    return okay;
+} // MOJOELF_profile_save
+
+#else
+static int open_image_cache(ElfContext *ctx) { return 1; }
+#define restore_cached_image(ctx) (0)
+#define store_cached_image(ctx) do {} while (0)
+static int prefetch_pages(ElfContext *ctx) { return 1; }
+
+int MOJOELF_profile_save(void *lib)
+{
+    DLOPEN_FAIL("Profiles need MOJOELF_SUPPORT_CACHE");
+} // MOJOELF_profile_save
+#endif
+
+// Runs after mark_local_ifuncs(), once we know everything the cache entry
+//  has to match. On a hit, apply_relocations() has nothing left to do.
+static int restore_relocated_image(ElfContext *ctx)
+{
+    if (ctx->cursor == 0)  // not partway through copying from a miss?
+    {
+        const int rc = restore_cached_image(ctx);
+        if (rc == 1)
+        {
+            ctx->cachehit = 1;
+            return 1;
+        } // if
+        else if (rc == -1)
+            DLOPEN_FAIL("Couldn't restore image after cache miss");
+    } // if
+
+    // copy_image() left these for the cache; fill them in now.
+    if (ctx->cachefd != -1)
+        copy_segments_from(ctx, 1, &ctx->cursor);
+    return 1;
+} // restore_relocated_image
+
+static int store_relocated_image(ElfContext *ctx)
+{
+    if ((!ctx->cachehit) && (!ctx->snapshot))  // snapshots wait until after initializers.
+        store_cached_image(ctx);
+    return 1;
+} // store_relocated_image
+
+// Last pass, after protect_pages(): R_COPY and anything involving IFUNCs,
+//  serially and in table order, like glibc does. Resolvers run here, so
+//  their code has to be executable, and everything they might touch
+//  has to be relocated already.
+static int apply_deferred_relocations(ElfContext *ctx)
+{
+    int i;
+
+    if (!ctx->has_deferred_relocs)
+        return 1;  // nothing to do.
+
+    for (i = 0; i < ctx->reloctabcount; i++)
+    {
+        const ElfRelocTable *table = &ctx->reloctabs[i];
+        size_t j;
+        for (j = 0; j < table->count; j++)
+        {
+            uint32 r_type, r_sym;
+            uintptr r_offset;
+            intptr r_addend;
+            get_reloc(table, j, &r_type, &r_sym, &r_offset, &r_addend);
+            if (!is_deferred_reloc(ctx, r_type, r_sym))
+                continue;
+            else if ((ctx->ifuncs != NULL) && (ctx->ifuncs[r_sym] == 1))
+            {
+                const char *symstr = ctx->strtab + ctx->symtab[r_sym].st_name;
+                void *addr = call_ifunc(ctx, symstr, ctx->symaddrs[r_sym]);
+                ctx->symaddrs[r_sym] = (uintptr) addr;
+                ctx->ifuncs[r_sym] = 2;
+            } // else if
+
+            if (!do_fixup(ctx, r_type, r_sym, r_offset, r_addend, table->is_rela))
+                return 0;
+        } // for
+    } // for
+
+    return 1;
+} // apply_deferred_relocations
+
+
+// Once every JUMP_SLOT is bound (and we never bind lazily), a PLT entry is
+//  just an indirect jump through a GOT slot that won't change again. If the
+//  target is within rel32 range, make it a direct jump, which saves a load
+//  and an indirect branch on every call that goes through it.
+static int patch_plt_entry(ElfContext *ctx, uint8 *entry)
+{
+    uint8 *mmapaddr = (uint8 *) ctx->retval->mmapaddr;
+    const uint8 *op = NULL;
+    uint8 *insn = entry;
+    uintptr slot = 0;
+    uintptr target = 0;
+    intptr rel = 0;
+    int32 disp = 0;
+    int insnlen = 0;
+    int i;
+
+    // .plt.sec entries start with endbr64 (or endbr32) when IBT is enabled.
+    if ((entry[0] == 0xF3) && (entry[1] == 0x0F) && (entry[2] == 0x1E) &&
+        ((entry[3] == 0xFA) || (entry[3] == 0xFB)))
+        insn += 4;
+
+    op = insn;
+    if (*op == 0xF2)  // MPX "bnd" prefix.
+        op++;
+
+    if (op[0] != 0xFF)
+        return 0;  // not a jmp through memory (PLT0, lazy stub, etc).
+
+    Memcopy(&disp, op + 2, sizeof (disp));
+    insnlen = ((int) (op - insn)) + 6;
+
+    #if MOJOELF_64BIT
+    if (op[1] != 0x25)  // jmp *disp32(%rip)
+        return 0;
+    slot = ((uintptr) (insn + insnlen)) + disp;
+    #else
+    if (op[1] == 0x25)  // jmp *abs32
+        slot = (uintptr) (mmapaddr + (((uintptr) disp) - ctx->base));
+    else if (op[1] == 0xA3)  // jmp *disp32(%ebx), where %ebx is the GOT.
+    {
+        if (ctx->dyntabs[DT_PLTGOT] == NULL)
+            return 0;
+        slot = ((uintptr) (mmapaddr + (ctx->dyntabs[DT_PLTGOT]->d_un.d_ptr - ctx->base))) + disp;
+    } // else if
+    else
+    {
+        return 0;
+    } // else
+    #endif
+
+    if ((slot < ((uintptr) mmapaddr)) ||
+        ((slot + sizeof (uintptr)) > (((uintptr) mmapaddr) + ctx->retval->mmaplen)))
+        return 0;  // not pointing into our GOT?!
+
+    target = *((const uintptr *) slot);
+    if (target == 0)
+        return 0;  // unresolved weak symbol; let it crash the usual way.
+
+    rel = (intptr) (target - (((uintptr) insn) + 5));
+    if ((rel < INT32_MIN) || (rel > INT32_MAX))
+        return 0;  // too far away, keep the indirect jump.
+
+    disp = (int32) rel;
+    insn[0] = 0xE9;  // jmp rel32
+    Memcopy(insn + 1, &disp, sizeof (disp));
+    for (i = 5; i < insnlen; i++)
+        insn[i] = 0xCC;  // int3; never reached.
+
+    return 1;
+} // patch_plt_entry
+
+static int patch_plts(ElfContext *ctx)
+{
+    const size_t offset = (size_t) ctx->header->e_phoff;
+    const int header_count = (int) ctx->header->e_phnum;
+    uint8 *mmapaddr = (uint8 *) ctx->retval->mmapaddr;
+    int i, j;
+
+    if ((ctx->flags & MOJOELF_FLAG_PATCH_PLT) == 0)
+        return 1;  // not requested.
+    else if (ctx->retval->sharedtext != NULL)
+        return 1;  // other instances' GOTs point elsewhere; leave it alone.
+
+    for (i = 0; i < ctx->pltcount; i++)
+    {
+        const ElfProgram *program = (const ElfProgram *) (ctx->buf + offset);
+        const uintptr vaddr = ctx->plts[i];
+        const size_t size = ctx->pltsizes[i];
+        uint8 *start = mmapaddr + (vaddr - ctx->base);
+        uint8 *pagestart = start - (((uintptr) start) % MOJOELF_PAGESIZE);
+        size_t pagelen = (size_t) ((start + size) - pagestart);
+        uint8 *entry;
+        int prot = -1;
+
+        pagelen += (MOJOELF_PAGESIZE - (pagelen % MOJOELF_PAGESIZE)) % MOJOELF_PAGESIZE;
+
+        for (j = 0; j < header_count; j++, program++)
+        {
+            if ((program->p_type == PT_LOAD) && (vaddr >= program->p_vaddr) &&
+                ((vaddr + size) <= (program->p_vaddr + program->p_memsz)))
+            {
+                prot = segment_prot(program);
+                break;
+            } // if
+        } // for
+
+        if (prot == -1)
+            continue;  // not in a loaded segment? Leave it alone.
+
+        // protect_pages() already ran, so make this writable for a moment.
+        //  Nothing can be running this code yet.
+        if (protect_image(ctx, pagestart, pagelen, PROT_READ | PROT_WRITE) == -1)
+            continue;  // oh well, it still works unpatched.
+
+        for (entry = start; (entry + 16) <= (start + size); entry += 16)
+            patch_plt_entry(ctx, entry);
+
+        if (protect_image(ctx, pagestart, pagelen, prot) == -1)
+            DLOPEN_FAIL("mprotect failed");
+    } // for
+
+    return 1;
+} // patch_plts
+
+static int add_exported_symbol(ElfContext *ctx, const char *sym, void *addr)
+{
+    const int syms_count = ctx->retval->syms_count;
+    ElfSymbols *syms = ctx->retval->syms;
+
+    // We don't check for duplicates here. You get the first one in the list!
+
+    syms[syms_count].sym = (char *) carve_metadata(ctx, strlen(sym) + 1);
+    if (syms[syms_count].sym == NULL)
+        return 0;
+
+    Strcpy(syms[syms_count].sym, sym);
+    syms[syms_count].addr = addr;
+    syms[syms_count].hash = gnu_hash(sym);
+    syms[syms_count].next = -1;
+    ctx->retval->syms_count++;
+
+    return 1;
+} // add_exported_symbol
+
+
+static int build_export_index(ElfContext *ctx)
+{
+    ElfHandle *h = ctx->retval;
+    uint32 bucket_count = 1;
+    int i;
+
+    while (bucket_count < (uint32) h->syms_count)
+        bucket_count <<= 1;
+
+    h->buckets = (int *) carve_metadata(ctx, bucket_count * sizeof (int));
+    if (h->buckets == NULL)
+        return 0;
+
+    h->bucket_mask = bucket_count - 1;
+    for (i = 0; i < bucket_count; i++)
+        h->buckets[i] = -1;
+
+    // Insert backwards, so the first of any duplicates is first in its chain.
+    for (i = h->syms_count - 1; i >= 0; i--)
+    {
+        const uint32 bucket = h->syms[i].hash & h->bucket_mask;
+        h->syms[i].next = h->buckets[bucket];
+        h->buckets[bucket] = i;
+    } // for
+
+    return 1;
+} // build_export_index
+
+
+// Exported STT_GNU_IFUNC symbols point at their resolvers until now. Swap
+//  in whatever the resolvers pick, so MOJOELF_dlsym() hands out the real
+//  function, just like the relocations got.
+static int resolve_exported_ifuncs(ElfContext *ctx)
+{
+    ElfHandle *h = ctx->retval;
+    const ElfSymTable *symbol = ctx->symtab + 1;
+    int i;
+
+    for (i = 1; i < ctx->symtabcount; i++, symbol++)
+    {
+        const char *symstr = ctx->strtab + symbol->st_name;
+        uintptr resolver;
+        void *addr = NULL;
+        uint32 hash;
+        int j;
+
+        if ( (ELF_ST_TYPE(symbol->st_info) != STT_GNU_IFUNC) ||
+             (symbol->st_shndx == SHN_UNDEF) || (*symstr == '\0') ||
+             (h->buckets == NULL) )
+            continue;
+
+        resolver = (uintptr) (((uint8 *) h->mmapaddr) + (symbol->st_value - ctx->base));
+        hash = gnu_hash(symstr);
+        for (j = h->buckets[hash & h->bucket_mask]; j != -1; j = h->syms[j].next)
+        {
+            ElfSymbols *s = &h->syms[j];
+            if ((s->hash == hash) && (s->addr == (void *) resolver) &&
+                (Strcmp(s->sym, symstr) == 0))
+            {
+                if ((ctx->ifuncs != NULL) && (ctx->ifuncs[i] == 2))
+                    addr = (void *) ctx->symaddrs[i];  // already ran it.
+                else if (addr == NULL)
+                    addr = call_ifunc(ctx, symstr, resolver);
+                s->addr = addr;
+            } // if
+        } // for
+    } // for
+
+    return 1;
+} // resolve_exported_ifuncs
+
+
+// Returns where a symbol lives in the image if we export it, NULL if not.
+static void *exported_symbol_addr(const ElfContext *ctx, const ElfSymTable *symbol)
+{
+    const uintptr offset = symbol->st_value ? (symbol->st_value - ctx->base) : 0;
+    void *addr = ((uint8 *) ctx->retval->mmapaddr) + offset;
+    const char *symstr = ctx->strtab + symbol->st_name;
+
+    if ((*symstr != '\0') &&
+        (symbol->st_shndx != SHN_UNDEF) &&
+        (symbol->st_shndx != SHN_ABS) &&
+        (ELF_ST_TYPE(symbol->st_info) != STT_TLS) &&
+        (addr != ctx->init) &&
+        (addr != ctx->retval->fini))
+    {
+        return addr;
+    } // if
+
+    return NULL;
+} // exported_symbol_addr
+
+// Two passes over the symbol table: count (and sanity check) what we
+//  export, then copy it into the handle. ctx->cursor runs through the
+//  first pass and then the second, so a step can stop in either one.
+static int build_export_list(ElfContext *ctx)
+{
+    const size_t symtabcount = (size_t) ctx->symtabcount;
+    ElfHandle *h = ctx->retval;
+
+    while (ctx->cursor < symtabcount)
+    {
+        const ElfSymTable *symbol = ctx->symtab + ctx->cursor;
+        const uintptr offset = symbol->st_value ? (symbol->st_value - ctx->base) : 0;
+
+        if (offset > h->mmaplen)
+            DLOPEN_FAIL("Bogus symbol address");
+        else if (symbol->st_name >= ctx->strtablen)
+            DLOPEN_FAIL("Bogus symbol name");
+        else if (exported_symbol_addr(ctx, symbol) != NULL)
+            ctx->exportcount++;
+
+        ctx->cursor++;
+        if (((ctx->cursor % MOJOELF_EXPORT_CHUNK_SIZE) == 0) && (out_of_time(ctx)))
+            return 1;
+    } // while
+
+    if (ctx->exportcount == 0)
+        return 1;  // nothing to do!
+
+    if (h->syms == NULL)
+    {
+        h->syms = (ElfSymbols *) carve_metadata(ctx, sizeof (ElfSymbols) * ctx->exportcount);
+        if (h->syms == NULL)
+            return 0;
+    } // if
+
+    while (h->syms_count < ctx->exportcount)
+    {
+        const ElfSymTable *symbol = ctx->symtab + (ctx->cursor - symtabcount);
+        void *addr = exported_symbol_addr(ctx, symbol);
+
+        if (addr != NULL)
+        {
+            const char *symstr = ctx->strtab + symbol->st_name;
+            dbgprintf(("Exporting '%s' as '%p' ...\n", symstr, addr));
+            if (!add_exported_symbol(ctx, symstr, addr))
+                return 0;
+        } // if
+
+        ctx->cursor++;
+        if ( (h->syms_count < ctx->exportcount) &&
+             ((ctx->cursor % MOJOELF_EXPORT_CHUNK_SIZE) == 0) && (out_of_time(ctx)) )
+            return 1;
+    } // while
+
+    return build_export_index(ctx);
+} // build_export_list
+
+// How much the handle's dlopens, syms, buckets and names will need. This
+//  only looks at the buffer, so we can allocate everything at once, before
+//  mapping anything. It doesn't know where init and fini end up yet, so it
+//  might count a symbol or two more than build_export_list() keeps.
+static size_t measure_metadata(const ElfContext *ctx)
+{
+    const ElfSymTable *symbol = ctx->symtab;
+    size_t nameslen = 0;
+    uint32 symcount = 0;
+    uint32 bucket_count = 0;
+    int i;
+
+    for (i = 0; i < ctx->symtabcount; i++, symbol++)
+    {
+        const char *symstr;
+
+        if (symbol->st_name >= ctx->strtablen)
+            continue;  // build_export_list() will reject this later.
+
+        symstr = ctx->strtab + symbol->st_name;
+        if ((*symstr != '\0') &&
+            (symbol->st_shndx != SHN_UNDEF) &&
+            (symbol->st_shndx != SHN_ABS) &&
+            (ELF_ST_TYPE(symbol->st_info) != STT_TLS))
+        {
+            symcount++;
+            nameslen += ALIGN_PTR(strlen(symstr) + 1);
+        } // if
+    } // for
+
+    if (symcount > 0)  // build_export_list() won't make an index otherwise.
+    {
+        bucket_count = 1;
+        while (bucket_count < symcount)
+            bucket_count <<= 1;
+    } // if
+
+    return ALIGN_PTR(ctx->needed * sizeof (void *)) +
+           ALIGN_PTR(symcount * sizeof (ElfSymbols)) +
+           ALIGN_PTR(bucket_count * sizeof (int)) + nameslen;
+} // measure_metadata
+
+
+// Constructors get the process's argc, argv and envp, like the ones glibc
+//  runs do, unless the app says otherwise with MOJOELF_set_init_args().
+extern char **environ;
+static int init_argc = 0;
+static char **init_argv = NULL;
+static char **init_envp = NULL;
+
+#if MOJOELF_SUPPORT_THREADS
+static pthread_mutex_t init_args_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define lock_init_args() pthread_mutex_lock(&init_args_mutex)
+#define unlock_init_args() pthread_mutex_unlock(&init_args_mutex)
+#else
+#define lock_init_args() do {} while (0)
+#define unlock_init_args() do {} while (0)
+#endif
+
+#if defined(__linux__) && defined(__GLIBC__)
+// glibc passes argc, argv and envp to every .init_array function, including
+//  this one, which runs before the app's main().
+static void capture_init_args(int argc, char **argv, char **envp)
+{
+    lock_init_args();
+    if (init_argv == NULL)  // the app might have set them already.
+    {
+        init_argc = argc;
+        init_argv = argv;
+        init_envp = envp;
+    } // if
+    unlock_init_args();
+} // capture_init_args
+
+static void (*capture_init_args_ptr)(int, char **, char **)
+    __attribute__((section(".init_array"), used)) = capture_init_args;
+#endif
+
+void MOJOELF_set_init_args(int argc, char **argv, char **envp)
+{
+    lock_init_args();
+    init_argc = argc;
+    init_argv = argv;
+    init_envp = envp;
+    unlock_init_args();
+} // MOJOELF_set_init_args
+
+// Every image whose constructors have run gets the next number, so
+//  MOJOELF_dlclose_all() can run destructors in the reverse order.
+static uint64 init_sequence = 0;
+
+static inline void note_init(ElfHandle *h)
+{
+    h->init_seq = __sync_add_and_fetch(&init_sequence, 1);
+} // note_init
+
+static void run_init(void *init, void **init_array, const int init_array_count)
+{
+    int argc;
+    char **argv;
+    char **envp;
+
+    // A copy, so MOJOELF_set_init_args() can't change them halfway through.
+    lock_init_args();
+    argc = init_argc;
+    argv = init_argv;
+    envp = init_envp ? init_envp : environ;
+    unlock_init_args();
+
+    if (init != NULL)
+        ((ElfInitFn) init)(argc, argv, envp);
+
+    if (init_array != NULL)
+    {
+        int i;
+        for (i = 0; i < init_array_count; i++)
+            ((ElfInitFn) init_array[i])(argc, argv, envp);
+    } // if
+} // run_init
+
+static void run_pending_init(ElfHandle *h);
+
+// Returns nonzero if any of our imports resolved into h's mapping.
+static int imports_from(const ElfContext *ctx, const ElfHandle *h)
+{
+    const uintptr start = (uintptr) h->mmapaddr;
+    const uintptr end = start + h->mmaplen;
+    int i;
+
+    for (i = 0; i < ctx->importcount; i++)
+    {
+        const uintptr addr = ctx->symaddrs[ctx->imports[i]];
+        if ((addr >= start) && (addr < end))
+            return 1;
+    } // for
+
+    return 0;
+} // imports_from
+
+static void add_init_dep(ElfContext *ctx, ElfHandle *dep)
+{
+    ElfHandle *h = ctx->retval;
+    if ( (dep != h) && (__atomic_load_n(&dep->init_pending, __ATOMIC_ACQUIRE)) &&
+         (imports_from(ctx, dep)) )
+        h->init_deps[h->init_deps_count++] = dep;
+} // add_init_dep
+
+// find_namespace_symbol() and find_batch_symbol() can resolve our imports
+//  into handles whose constructors are still deferred. Those have to run
+//  before ours do, so note them. Like find_batch_deps(), we go by where
+//  the imports landed, since the lookups can run on several threads.
+static int collect_init_deps(ElfContext *ctx)
+{
+    ElfHandle *h = ctx->retval;
+    int candidates = 0;
+    int i;
+
+    if (ctx->ns != NULL)  // MOJOELF_namespace_dlopen() holds the lock.
+    {
+        const ElfNamespaceLib *lib;
+        for (lib = ctx->ns->first; lib != NULL; lib = lib->next)
+            candidates++;
+    } // if
+
+    if (ctx->batch != NULL)
+        candidates += ctx->batch->count;
+
+    if ((candidates == 0) || (ctx->importcount == 0) || (ctx->workspace != NULL))
+        return 1;
+
+    h->init_deps = (ElfHandle **) Malloc(candidates * sizeof (ElfHandle *));
+    if (h->init_deps == NULL)
+        return 0;
+
+    if (ctx->ns != NULL)
+    {
+        const ElfNamespaceLib *lib;
+        for (lib = ctx->ns->first; lib != NULL; lib = lib->next)
+            add_init_dep(ctx, lib->handle);
+    } // if
+
+    if (ctx->batch != NULL)
+    {
+        for (i = 0; i < ctx->batch->count; i++)
+            add_init_dep(ctx, ctx->batch->ctxs[i]->retval);
+    } // if
+
+    if (h->init_deps_count == 0)
+    {
+        Free(h->init_deps);
+        h->init_deps = NULL;
+    } // if
+
+    return 1;
+} // collect_init_deps
+
+// Run (or wait for) everything collect_init_deps() found. Once.
+static void run_init_deps(ElfHandle *h)
+{
+    ElfHandle **deps = h->init_deps;
+    const int count = h->init_deps_count;
+    int i;
+
+    h->init_deps = NULL;
+    h->init_deps_count = 0;
+    for (i = 0; i < count; i++)
+    {
+        if (__atomic_load_n(&deps[i]->init_pending, __ATOMIC_ACQUIRE))
+            run_pending_init(deps[i]);
+    } // for
+    Free(deps);
+} // run_init_deps
+
+static int call_so_init(ElfContext *ctx)
+{
+    if (ctx->skip_init)
+    {
+        note_init(ctx->retval);
+        return 1;  // restored from a snapshot; this already happened.
+    } // if
+    else if (!collect_init_deps(ctx))
+        return 0;
+    else if (ctx->flags & DEFERRED_INIT_FLAGS)
+    {
+        // The app wants these on a thread of its choosing, or not until
+        //  something gets looked up; save them for MOJOELF_run_init().
+        ElfHandle *h = ctx->retval;
+        h->init = ctx->init;
+        h->init_array = ctx->init_array;
+        h->init_array_count = ctx->init_array_count;
+        h->init_on_dlsym = ((ctx->flags & MOJOELF_FLAG_INIT_ON_DLSYM) != 0);
+        h->init_pending = 1;
+        return 1;
+    } // else if
+
+    run_init_deps(ctx->retval);
+    run_init(ctx->init, ctx->init_array, ctx->init_array_count);
+    note_init(ctx->retval);
+    return 1;
+} // call_so_init
+
+// Deferred constructors run once, on whichever thread asks first. Anyone
+//  else who asks while they're running waits for them to finish, except
+//  the thread running them, since constructors can look themselves up.
+#if MOJOELF_SUPPORT_THREADS
+static pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t init_cond = PTHREAD_COND_INITIALIZER;
+
+static void run_pending_init(ElfHandle *h)
+{
+    const pthread_t self = pthread_self();
+    int run = 0;
+
+    pthread_mutex_lock(&init_mutex);
+    if (h->init_pending == 1)
+    {
+        __atomic_store_n(&h->init_pending, 2, __ATOMIC_RELAXED);
+        h->init_thread = self;
+        run = 1;
+    } // if
+    else
+    {
+        while ((h->init_pending == 2) && (!pthread_equal(h->init_thread, self)))
+            pthread_cond_wait(&init_cond, &init_mutex);
+    } // else
+    pthread_mutex_unlock(&init_mutex);
+
+    if (run)
+    {
+        run_init_deps(h);
+        run_init(h->init, h->init_array, h->init_array_count);
+        note_init(h);
+        pthread_mutex_lock(&init_mutex);
+        __atomic_store_n(&h->init_pending, 0, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&init_cond);
+        pthread_mutex_unlock(&init_mutex);
+    } // if
+} // run_pending_init
+#else
+static void run_pending_init(ElfHandle *h)
+{
+    if (h->init_pending == 1)
+    {
+        h->init_pending = 2;
+        run_init_deps(h);
+        run_init(h->init, h->init_array, h->init_array_count);
+        note_init(h);
+        h->init_pending = 0;
+    } // if
+} // run_pending_init
+#endif
+
+// MOJOELF_FLAG_INIT_ON_DLSYM: the first lookup that finds something runs
+//  the constructors. After that, this is one load, and no locks.
+static inline void init_on_dlsym(ElfHandle *h)
+{
+    if ((h->init_on_dlsym) && (__atomic_load_n(&h->init_pending, __ATOMIC_ACQUIRE)))
+        run_pending_init(h);
+} // init_on_dlsym
+
+// Loads of identical bytes with identical callbacks can share one handle,
+//  if they ask for it with MOJOELF_FLAG_SHARE_IDENTICAL.
+typedef struct ElfShareKey
+{
+    uint8 digest[32];
+    uint64 imagelen;
+    MOJOELF_LoaderCallback loader;
+    MOJOELF_ResolverCallback resolver;
+    MOJOELF_UnloaderCallback unloader;
+    MOJOELF_BatchResolverCallback resolve_batch;
+    MOJOELF_IfuncCallback ifunc;
+    const char *cache_dir;
+    void *userdata;
+    unsigned int flags;
+} ElfShareKey;
+
+static ElfHandle *shared_handles = NULL;
+
+#if MOJOELF_SUPPORT_THREADS
+static pthread_mutex_t shared_handles_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define lock_shared_handles() pthread_mutex_lock(&shared_handles_mutex)
+#define unlock_shared_handles() pthread_mutex_unlock(&shared_handles_mutex)
+#else
+#define lock_shared_handles() do {} while (0)
+#define unlock_shared_handles() do {} while (0)
+#endif
+
+static void make_share_key(ElfContext *ctx, ElfShareKey *key)
+{
+    if (!ctx->digested)
+    {
+        sha256_buffer(ctx->buf, ctx->buflen, ctx->sharedigest);
+        ctx->digested = 1;
+    } // if
+
+    Memzero(key, sizeof (ElfShareKey));  // so padding compares equal, too.
+    Memcopy(key->digest, ctx->sharedigest, sizeof (key->digest));
+    key->imagelen = (uint64) ctx->buflen;
+    key->loader = ctx->loader;
+    key->resolver = ctx->resolver;
+    key->unloader = ctx->unloader;
+    key->resolve_batch = ctx->resolve_batch;
+    key->ifunc = ctx->ifunc;
+    key->cache_dir = ctx->cache_dir;
+    key->userdata = ctx->userdata;
+    key->flags = ctx->flags;
+} // make_share_key
+
+// Returns an existing handle with one more reference, or NULL.
+static ElfHandle *find_shared_handle(ElfContext *ctx)
+{
+    ElfHandle *h;
+    ElfShareKey key;
+
+    make_share_key(ctx, &key);
+
+    lock_shared_handles();
+    for (h = shared_handles; h != NULL; h = h->next_shared)
+    {
+        if (memcmp(h->sharekey, &key, sizeof (key)) == 0)
+        {
+            h->refcount++;
+            break;
+        } // if
+    } // for
+    unlock_shared_handles();
+
+    return h;
+} // find_shared_handle
+
+static int register_shared_handle(ElfContext *ctx)
+{
+    ElfHandle *h = ctx->retval;
+    ElfShareKey *key = (ElfShareKey *) Malloc(sizeof (ElfShareKey));
+    if (key == NULL)
+        return 0;
+
+    make_share_key(ctx, key);
+    h->sharekey = key;
+    h->refcount = 1;
+
+    lock_shared_handles();
+    h->next_shared = shared_handles;
+    shared_handles = h;
+    unlock_shared_handles();
+
+    return 1;
+} // register_shared_handle
+
+// Returns nonzero if this was the last reference, and it's time to unload.
+static int release_shared_handle(ElfHandle *h)
+{
+    int retval = 0;
+
+    if (h->sharekey == NULL)
+        return 1;  // not shared.
+
+    lock_shared_handles();
+    if (--h->refcount == 0)
+    {
+        ElfHandle **prev = &shared_handles;
+        while (*prev != h)
+            prev = &(*prev)->next_shared;
+        *prev = h->next_shared;
+        retval = 1;
+    } // if
+    unlock_shared_handles();
+
+    if (retval)
+        Free(h->sharekey);
+
+    return retval;
+} // release_shared_handle
+
+static void *noop_loader(const char *soname, const char *rpath, const char *runpath) { return NULL; }
+static void *noop_resolver(void *handle, const char *sym) { return NULL; }
+static void noop_unloader(void *handle) {}
+
+static void unload_dependencies(MOJOELF_UnloaderCallback unloader,
+                                void **dlopens, const int dlopens_count)
+{
+    int i;
+
+    if (dlopens != NULL)
+    {
+        for (i = 0; i < dlopens_count; i++)
+        {
+            if (dlopens[i])
+                unloader(dlopens[i]);
+        } // for
+    } // if
+} // unload_dependencies
+
+// Fill in everything an older MOJOELF_Callbacks didn't have, so we can keep
+//  a copy around and always treat it as the current version.
+static void copy_callbacks(MOJOELF_Callbacks *dst, const MOJOELF_Callbacks *src)
+{
+    Memzero(dst, sizeof (MOJOELF_Callbacks));
+    dst->loader = src->loader;
+    dst->resolver = src->resolver;
+    dst->unloader = src->unloader;
+    dst->version = MOJOELF_CALLBACKS_VERSION;
+
+    if (src->version >= 1)
+    {
+        dst->flags = src->flags;
+        dst->executor = src->executor;
+        dst->userdata = src->userdata;
+    } // if
+
+    if (src->version >= 2)
+        dst->resolve_batch = src->resolve_batch;
+
+    if (src->version >= 3)
+        dst->ifunc = src->ifunc;
+
+    if (src->version >= 4)
+        dst->cache_dir = src->cache_dir;
+
+    if (src->version >= 5)
+        dst->arena = src->arena;
+
+    if (src->version >= 6)
+    {
+        dst->map = src->map;
+        dst->protect = src->protect;
+        dst->unmap = src->unmap;
+    } // if
+
+    if (src->version >= 7)
+        dst->submit = src->submit;
+} // copy_callbacks
+
+// The passes that only look at the buffer: enough to sanity check an image,
+//  and to know how much memory loading it will take.
+static int scan_elf_image(ElfContext *ctx, const void *buf, const long buflen)
+{
+    Memzero(ctx, sizeof (ElfContext));
+    ctx->cachefd = -1;
+    ctx->layoutfd = -1;
+    ctx->buf = (const uint8 *) buf;
+    ctx->buflen = (size_t) buflen;
+    ctx->header = (const ElfHeader *) buf;
+    return (validate_elf_header(ctx) && process_program_headers(ctx) &&
+            index_dynamic_table(ctx) && process_section_headers(ctx));
+} // scan_elf_image
+
+// Everything MOJOELF_dlopen_workspace() will carve out of the workspace:
+//  the handle and its metadata, then the scratch arrays relocation needs,
+//  which collect_imports() and friends size by the symbol table. This
+//  assumes the worst, like every resolver and every relocation table.
+static size_t measure_workspace(const ElfContext *ctx)
+{
+    const size_t symcount = (size_t) ctx->symtabcount;
+    return sizeof (void *) +  // in case the app's workspace isn't aligned.
+           ALIGN_PTR(ALIGN_PTR(sizeof (ElfHandle)) + measure_metadata(ctx)) +
+           ALIGN_PTR(symcount * sizeof (uintptr)) +  // symaddrs
+           ALIGN_PTR(symcount) +  // collect_imports()'s seen
+           ALIGN_PTR(symcount * sizeof (uint32)) +  // imports
+           ALIGN_PTR(symcount) +  // ifuncs
+           (2 * ALIGN_PTR(symcount * sizeof (void *))) +  // batched names, addrs
+           (2 * ALIGN_PTR(symcount * sizeof (uint32))) +  // batched hashes, syms
+           ALIGN_PTR(sizeof (ElfRelocTask)) +  // resolve_imports()
+           ALIGN_PTR(3 * sizeof (ElfRelocTask));  // apply_relocations()
+} // measure_workspace
+
+// Sections that only the loader reads: relocations, the dynamic symbol and
+//  string tables, hash tables and symbol versions. We read all of those from
+//  the buffer, and keep our own copy of the exports, so once the load is
+//  done, the image's copies are dead weight.
+static int is_loader_only_section(const ElfSection *section)
+{
+    switch (section->sh_type)
+    {
+        case SHT_STRTAB:  // only .dynstr gets SHF_ALLOC.
+        case SHT_RELA:
+        case SHT_HASH:
+        case SHT_REL:
+        case SHT_DYNSYM:
+        case SHT_RELR:
+        case SHT_GNU_HASH:
+        case SHT_GNU_VERDEF:
+        case SHT_GNU_VERNEED:
+        case SHT_GNU_VERSYM:
+            return 1;
+    } // switch
+
+    return 0;
+} // is_loader_only_section
+
+// One dead section, before it gets merged with its neighbors.
+typedef struct ElfTrimSpan
+{
+    size_t offset;  // from mmapaddr.
+    size_t len;
+    size_t fileoffset;  // where it is in the buffer.
+    int init;
+} ElfTrimSpan;
+
+#define MOJOELF_TRIM_SPANS 16
+
+static void add_trim_range(ElfHandle *h, const size_t offset, const size_t end,
+                           const int init)
+{
+    const size_t start = (offset + (MOJOELF_PAGESIZE-1)) & ~((size_t) (MOJOELF_PAGESIZE-1));
+    const size_t stop = end & ~((size_t) (MOJOELF_PAGESIZE-1));
+    ElfTrimRange *range = NULL;
+    int i;
+
+    if (stop <= start)
+        return;  // doesn't cover a whole page.
+    else if (h->trim_count < MOJOELF_TRIM_RANGES)
+        range = &h->trims[h->trim_count++];
+    else  // full? Keep the biggest ones.
+    {
+        for (i = 0; i < h->trim_count; i++)
+        {
+            if ((h->trims[i].len < (stop - start)) && ((range == NULL) || (h->trims[i].len < range->len)))
+                range = &h->trims[i];
+        } // for
+        if (range == NULL)
+            return;
+    } // else
+
+    range->offset = start;
+    range->len = stop - start;
+    range->init = init;
+} // add_trim_range
+
+// Find whole pages of dead sections for MOJOELF_trim(). .init and the init
+//  arrays are dead too, once constructors run. Sections usually sit right
+//  next to each other, so neighbors merge when only zeroed padding is
+//  between them. Nothing here fails the load; we just trim less.
+static void plan_trim(ElfContext *ctx)
+{
+    const size_t offset = (size_t) ctx->header->e_shoff;
+    const ElfSection *section = (const ElfSection *) (ctx->buf + offset);
+    const int header_count = (int) ctx->header->e_shnum;
+    const ElfDynTable *init = ctx->dyntabs[DT_INIT];
+    ElfHandle *h = ctx->retval;
+    ElfTrimSpan spans[MOJOELF_TRIM_SPANS];
+    int spancount = 0;
+    int i, j;
+
+    h->trim_count = 0;
+
+    for (i = 0; (i < header_count) && (spancount < MOJOELF_TRIM_SPANS); i++, section++)
+    {
+        ElfTrimSpan span;
+
+        if ( (!(section->sh_flags & SHF_ALLOC)) || (section->sh_size == 0) ||
+             (section->sh_type == SHT_NOBITS) || (section->sh_addr < ctx->base) ||
+             ((section->sh_addr - ctx->base) + section->sh_size > ctx->mmaplen) )
+            continue;
+
+        if (is_loader_only_section(section))
+            span.init = 0;
+        else if ((section->sh_type == SHT_INIT_ARRAY) || (section->sh_type == SHT_PREINIT_ARRAY))
+            span.init = 1;
+        else if ((init != NULL) && (section->sh_addr == init->d_un.d_ptr) &&
+                 (section->sh_type == SHT_PROGBITS) && (section->sh_flags & SHF_EXECINSTR))
+            span.init = 1;  // .init
+        else
+            continue;
+
+        span.offset = (size_t) (section->sh_addr - ctx->base);
+        span.len = (size_t) section->sh_size;
+        span.fileoffset = (size_t) section->sh_offset;
+
+        // keep them sorted by address; there aren't many.
+        for (j = spancount; (j > 0) && (spans[j-1].offset > span.offset); j--)
+            spans[j] = spans[j-1];
+        spans[j] = span;
+        spancount++;
+    } // for
+
+    for (i = 0; i < spancount; i = j)
+    {
+        size_t end = spans[i].offset + spans[i].len;
+        size_t fileend = spans[i].fileoffset + spans[i].len;
+
+        for (j = i + 1; j < spancount; j++)
+        {
+            const ElfTrimSpan *next = &spans[j];
+            const size_t gap = (next->offset > end) ? (next->offset - end) : 0;
+            size_t k;
+
+            if ((next->init != spans[i].init) || (gap > 64))
+                break;
+            else if ((gap > 0) && ((next->fileoffset != fileend + gap) || (fileend + gap > ctx->buflen)))
+                break;
+
+            for (k = 0; k < gap; k++)
+            {
+                if (ctx->buf[fileend + k] != 0)
+                    break;
+            } // for
+
+            if (k < gap)
+                break;  // something lives in there.
+
+            if (next->offset + next->len > end)
+            {
+                end = next->offset + next->len;
+                fileend = next->fileoffset + next->len;
+            } // if
+        } // for
+
+        add_trim_range(h, spans[i].offset, end, spans[i].init);
+    } // for
+} // plan_trim
+
+// Everything the handle needs for as long as it's loaded is one block: the
+//  handle, then its dlopens, syms, buckets and symbol names. Reloads keep
+//  the handle the app already has, and the old dependencies are still in
+//  use until we're done, so their metadata gets a block of its own.
+static int alloc_handle(ElfContext *ctx)
+{
+    const size_t handlelen = ALIGN_PTR(sizeof (ElfHandle));
+    size_t metalen = 0;
+    ElfHandle *h = NULL;
+
+    // TLS blocks get allocated per thread, forever, so they can't come from
+    //  a workspace.
+    if ((ctx->workspace != NULL) && (ctx->tlsprogram != NULL))
+        DLOPEN_FAIL("Can't load a TLS image into a workspace");
+
+    metalen = measure_metadata(ctx);
+    if (ctx->reload != NULL)
+    {
+        h = ctx->reload->handle;
+        if ((metalen > 0) && ((h->metadata = Malloc(metalen)) == NULL))
+            return 0;
+        ctx->meta = (uint8 *) h->metadata;
+    } // if
+    else
+    {
+        h = (ElfHandle *) ctx_alloc(ctx, handlelen + metalen);
+        if (h == NULL)
+            return 0;
+        h->in_workspace = (ctx->workspace != NULL);
+        ctx->meta = ((uint8 *) h) + handlelen;
+    } // else
+
+    ctx->metalen = metalen;
+    ctx->retval = h;
+    h->callbacks = *ctx->callbacks;  // keep our own copy, for MOJOELF_dlreload().
+    h->mmapaddr = ((void *) MAP_FAILED);
+    h->entry = (void *) ctx->header->e_entry;
+    h->unloader = ctx->unloader;
+    plan_trim(ctx);
+    return 1;
+} // alloc_handle
+
+// The unusual ways into dlopen_internal(); MOJOELF_dlopen_mem() uses none.
+typedef struct ElfLoadRequest
+{
+    int layoutfd;  // MOJOELF_dlopen_remote()'s pre-relocated image, or -1.
+    void *layoutbase;  // the address that image was relocated for.
+    ElfReload *reload;  // MOJOELF_dlreload()'s old image, or NULL.
+    void *workspace;  // MOJOELF_dlopen_workspace()'s memory, or NULL.
+    size_t workspacelen;  // bytes available at workspace.
+    int serial;  // nonzero to relocate on this thread if there's no executor.
+} ElfLoadRequest;
+
+// One load in progress. dlopen_internal() runs it all at once;
+//  MOJOELF_load_step() runs it a little at a time.
+typedef struct ElfLoad
+{
+    ElfContext ctx;
+    MOJOELF_Callbacks callbacks;  // normalized copy of the app's.
+    ElfHandle *shared;  // MOJOELF_FLAG_SHARE_IDENTICAL found one, or NULL.
+    int phase;  // next entry in load_phases to run.
+    int failed;  // nonzero once a phase has failed.
+    const char *error;  // the failed phase's dlerror, for finish_load().
+} ElfLoad;
+
+typedef int (*ElfPhaseFn)(ElfContext *ctx);
+
+// Here we go. These run in order; any of them can fail the load. The ones
+//  that can take a while are chunked: they set ctx->yield and return early
+//  when a step runs out of time, and get called again with ctx->cursor
+//  where they left it.
+static const ElfPhaseFn load_phases[] =
+{
+    validate_elf_header,
+    process_program_headers,
+    index_dynamic_table,
+    process_section_headers,
+    alloc_handle,
+    open_image_cache,
+    map_pages,
+    copy_image,  // chunked.
+    setup_tls,
+    walk_dynamic_table,
+    build_export_list,  // chunked.
+    load_external_dependencies,
+    collect_imports,
+    resolve_imports,  // chunked.
+    mark_local_ifuncs,
+    restore_relocated_image,  // chunked.
+    prefetch_pages,
+    apply_relocations,  // chunked.
+    store_relocated_image,
+    protect_pages,
+    apply_deferred_relocations,
+    resolve_exported_ifuncs,
+    init_tls,
+    patch_plts,
+    call_so_init
+};
+
+#define LOAD_PHASE_COUNT ((int) (sizeof (load_phases) / sizeof (load_phases[0])))
+
+static void begin_load(ElfLoad *load, const void *buf, const long buflen,
+                       const MOJOELF_Callbacks *callbacks,
+                       const ElfLoadRequest *req)
+{
+    static const MOJOELF_Callbacks nullcb = { NULL, NULL, NULL };
+    const int layoutfd = req->layoutfd;
+    MOJOELF_Callbacks *cb = &load->callbacks;
+    ElfContext *ctx = &load->ctx;
+
+    assert(sizeof (ElfHeader) == MOJOELF_SIZEOF_ELF_HEADER);
+    assert(sizeof (ElfProgram) == MOJOELF_SIZEOF_PROGRAM_HEADER);
+    assert(sizeof (ElfSection) == MOJOELF_SIZEOF_SECTION_HEADER);
+
+    if (callbacks == NULL)
+        callbacks = &nullcb;
+
+    Memzero(load, sizeof (ElfLoad));
+    copy_callbacks(cb, callbacks);
+
+    // Server-provided images are always mapped our way.
+    if (layoutfd != -1)
+    {
+        cb->map = NULL;
+        cb->protect = NULL;
+        cb->unmap = NULL;
+    } // if
+
+    ctx->cachefd = -1;
+    ctx->layoutfd = layoutfd;
+    ctx->layoutbase = req->layoutbase;
+    ctx->reload = req->reload;
+    ctx->workspace = (uint8 *) req->workspace;
+    ctx->workspacelen = req->workspacelen;
+    ctx->callbacks = cb;
+    ctx->buf = (const uint8 *) buf;
+    ctx->buflen = (size_t) buflen;
+    ctx->loader = cb->loader ? cb->loader : noop_loader;
+    ctx->resolver = cb->resolver ? cb->resolver : noop_resolver;
+    ctx->unloader = cb->unloader ? cb->unloader : noop_unloader;
+    ctx->header = (const ElfHeader *) buf;
+    ctx->flags = cb->flags;
+    ctx->executor = cb->executor;
+    ctx->userdata = cb->userdata;
+    ctx->resolve_batch = cb->resolve_batch;
+    ctx->ifunc = cb->ifunc;
+    ctx->cache_dir = cb->cache_dir;
+    ctx->arena = (layoutfd == -1) ? (ElfArena *) cb->arena : NULL;
+    ctx->map = cb->map;
+    ctx->protect = cb->protect;
+
+    // Memory the app placed is the app's; we don't map files over it.
+    if (ctx->map != NULL)
+    {
+        ctx->cache_dir = NULL;
+        ctx->arena = NULL;
+        ctx->flags &= ~(MOJOELF_FLAG_SNAPSHOT | MOJOELF_FLAG_SHARE_TEXT);
+    } // if
+
+    // Server-provided images are already shared and already relocated, so
+    //  none of the other ways of avoiding that work apply to them. Reloads
+    //  are for images that are changing, so those don't bother either.
+    if ((layoutfd != -1) || (ctx->reload != NULL))
+    {
+        ctx->cache_dir = NULL;
+        ctx->flags &= ~(MOJOELF_FLAG_SNAPSHOT | MOJOELF_FLAG_SHARE_IDENTICAL |
+                        MOJOELF_FLAG_SHARE_TEXT);
+    } // if
+
+    // Workspace loads don't get to touch the heap, so everything that
+    //  would is off, and relocation happens serially, on this thread.
+    if (ctx->workspace != NULL)
+    {
+        ctx->cache_dir = NULL;
+        ctx->arena = NULL;
+        ctx->executor = NULL;
+        ctx->flags &= ~(MOJOELF_FLAG_THREADSAFE_RESOLVER |
+                        MOJOELF_FLAG_SNAPSHOT | MOJOELF_FLAG_SHARE_IDENTICAL |
+                        MOJOELF_FLAG_SHARE_TEXT | MOJOELF_FLAG_RELOADABLE);
+    } // if
+
+    // Snapshots are taken after constructors run, so deferring them means
+    //  no snapshot; restoring one would skip constructors we never ran.
+    if (ctx->flags & DEFERRED_INIT_FLAGS)
+        ctx->flags &= ~MOJOELF_FLAG_SNAPSHOT;
+
+    if (ctx->flags & MOJOELF_FLAG_SNAPSHOT)
+        ctx->snapshot = 1;
+
+    if (ctx->flags & MOJOELF_FLAG_SHARE_IDENTICAL)
+    {
+        load->shared = find_shared_handle(ctx);
+        if (load->shared != NULL)
+        {
+            load->phase = LOAD_PHASE_COUNT;  // nothing left to do.
+            return;
+        } // if
+    } // if
+
+    #if MOJOELF_SUPPORT_THREADS
+    if ((ctx->executor == NULL) && (ctx->workspace == NULL) && (!req->serial))
+        ctx->executor = internal_executor;
+    #endif
+} // begin_load
+
+// Run phases until load_phases[until] is next, one fails, or budget_usec is
+//  up. Zero means no limit. Returns nonzero when there's nothing left to do
+//  before until; for LOAD_PHASE_COUNT, that means it's time for finish_load().
+static int step_load(ElfLoad *load, const unsigned long budget_usec, const int until)
+{
+    ElfContext *ctx = &load->ctx;
+
+    ctx->deadline = budget_usec ? (now_usec() + budget_usec) : 0;
+
+    while ((!load->failed) && (load->phase < until))
+    {
+        ctx->yield = 0;
+        if (!load_phases[load->phase](ctx))
+        {
+            load->failed = 1;
+            load->error = take_dlerror();
+            break;
+        } // if
+        else if (ctx->yield)
+            return 0;  // more of this phase next step.
+
+        ctx->cursor = 0;
+        load->phase++;
+        if ((load->phase < until) && (out_of_time(ctx)))
+            return 0;
+    } // while
+
+    return 1;
+} // step_load
+
+// Returns the library, or NULL if any phase failed, or if the app gave up
+//  before they all ran. Either way, everything else the load had is freed.
+static void *finish_load(ElfLoad *load)
+{
+    ElfContext *ctx = &load->ctx;
+    ElfReload *reload = ctx->reload;
+    const int okay = ((!load->failed) && (load->phase == LOAD_PHASE_COUNT));
+
+    if (load->shared != NULL)
+        return load->shared;
+
+    if (okay)
+    {
+        if ((ctx->snapshot) && (!ctx->skip_init))
+            store_cached_image(ctx);
+
+        if ((ctx->flags & MOJOELF_FLAG_SHARE_IDENTICAL) && (!register_shared_handle(ctx)))
+            (void) take_dlerror();  // not fatal, it just won't be shared.
+
+        if (ctx->flags & MOJOELF_FLAG_RELOADABLE)
+            remember_imports(ctx);
+    } // if
+
+    if (ctx->cachefd != -1)
+        close(ctx->cachefd);
+    Free(ctx->sharedpages);
+    ctx_free(ctx, ctx->tasks);
+    ctx_free(ctx, ctx->nsdeps);
+    ctx_free(ctx, ctx->seen);
+    ctx_free(ctx, ctx->batchifuncs);
+    ctx_free(ctx, ctx->ifuncs);
+    ctx_free(ctx, ctx->imports);
+    ctx_free(ctx, ctx->importfrom);
+    ctx_free(ctx, ctx->symaddrs);
+
+    if (reload != NULL)  // we have our own references to these now.
+    {
+        unload_dependencies(ctx->unloader, reload->dlopens, reload->dlopens_count);
+        Free(reload->metadata);  // the old dlopens might have been in here.
+        free_import_table(reload->imports);
+        unmap_image(&load->callbacks, reload->arena, reload->mmapaddr, reload->mmaplen);
+    } // if
+
+    if (!okay)
+    {
+        if (ctx->retval != NULL)
+        {
+            ctx->retval->fini = NULL;  // don't try to call this in MOJOELF_dlclose()!
+            MOJOELF_dlclose(ctx->retval);  // clean up any half-complete stuff.
+        } // if
+        else if (reload != NULL)
+            Free(reload->handle);  // MOJOELF_dlreload() already emptied it.
+
+        if (!load->failed)
+            set_dlerror("Load was cancelled");
+        else if (load->error != NULL)
+            set_dlerror(load->error);
+        return NULL;
+    } // if
+
+    return ctx->retval;
+} // finish_load
+
+static void *dlopen_internal(const void *buf, const long buflen,
+                             const MOJOELF_Callbacks *callbacks,
+                             const ElfLoadRequest *req)
+{
+    ElfLoad load;
+    begin_load(&load, buf, buflen, callbacks, req);
+    step_load(&load, 0, LOAD_PHASE_COUNT);
+    return finish_load(&load);
+} // dlopen_internal
+
+void *MOJOELF_dlopen_mem(const void *buf, const long buflen,
+                         const MOJOELF_Callbacks *callbacks)
+{
+    ElfLoadRequest req;
+    Memzero(&req, sizeof (ElfLoadRequest));
+    req.layoutfd = -1;
+    return dlopen_internal(buf, buflen, callbacks, &req);
+} // MOJOELF_dlopen_mem
+
+long MOJOELF_workspace_size(const void *buf, const long buflen)
+{
+    ElfContext ctx;
+
+    if (!scan_elf_image(&ctx, buf, buflen))
+        return 0;
+    else if (ctx.tlsprogram != NULL)
+    {
+        set_dlerror("Can't load a TLS image into a workspace");
+        return 0;
+    } // else if
+
+    return (long) measure_workspace(&ctx);
+} // MOJOELF_workspace_size
+
+void *MOJOELF_dlopen_workspace(const void *buf, const long buflen,
+                               const MOJOELF_Callbacks *callbacks,
+                               void *workspace, const long workspacelen)
+{
+    const size_t misalign = (size_t) (((uintptr) workspace) % sizeof (void *));
+    const size_t skip = misalign ? (sizeof (void *) - misalign) : 0;
+    ElfLoadRequest req;
+
+    if ((workspace == NULL) || (workspacelen <= (long) skip))
+    {
+        set_dlerror("Workspace is too small");
+        return NULL;
+    } // if
+
+    Memzero(&req, sizeof (ElfLoadRequest));
+    req.layoutfd = -1;
+    req.workspace = ((uint8 *) workspace) + skip;
+    req.workspacelen = ((size_t) workspacelen) - skip;
+    return dlopen_internal(buf, buflen, callbacks, &req);
+} // MOJOELF_dlopen_workspace
+
+// Everything here comes straight from the buffer; nothing gets mapped,
+//  relocated or resolved, so this is cheap enough to run on every image an
+//  app might load, to plan the loads. Only the import and DT_NEEDED lists
+//  need memory.
+int MOJOELF_inspect(const void *buf, const long buflen, MOJOELF_ImageInfo *info)
+{
+    const ElfDynTable *dyntab = NULL;
+    unsigned char *weak = NULL;
+    const char **names = NULL;
+    ElfContext ctx;
+    int importcount = 0;
+    int i;
+
+    if (info == NULL)
+        DLOPEN_FAIL("Bogus image info");
+
+    Memzero(info, sizeof (MOJOELF_ImageInfo));
+
+    if (!scan_elf_image(&ctx, buf, buflen))
+        return 0;
+    else if (!dynamic_string(&ctx, ctx.dyntabs[DT_SONAME], "Bogus DT_SONAME string", &info->soname))
+        return 0;
+    else if (!dynamic_string(&ctx, ctx.dyntabs[DT_RPATH], "Bogus DT_RPATH string", &info->rpath))
+        return 0;
+    else if (!dynamic_string(&ctx, ctx.dyntabs[DT_RUNPATH], "Bogus DT_RUNPATH string", &info->runpath))
+        return 0;
+
+    // Undefined symbols are imports. Anything build_export_list() would
+    //  keep is an export, give or take init and fini.
+    for (i = 1; i < ctx.symtabcount; i++)
+    {
+        const ElfSymTable *symbol = ctx.symtab + i;
+        const char *symstr;
+
+        if (symbol->st_name >= ctx.strtablen)
+            DLOPEN_FAIL("Bogus symbol name");
+
+        symstr = ctx.strtab + symbol->st_name;
+        if (*symstr == '\0')
+            continue;
+        else if (symbol->st_shndx == SHN_UNDEF)
+            importcount++;
+        else if ((symbol->st_shndx != SHN_ABS) && (ELF_ST_TYPE(symbol->st_info) != STT_TLS))
+            info->export_count++;
+    } // for
+
+    if ((ctx.needed + importcount) > 0)
+    {
+        const size_t ptrslen = (ctx.needed + importcount) * sizeof (const char *);
+        names = (const char **) Malloc(ptrslen + importcount);
+        if (names == NULL)
+            return 0;
+        weak = ((unsigned char *) names) + ptrslen;
+    } // if
+
+    info->needed = names;
+    info->imports = names + ctx.needed;
+    info->imports_weak = weak;
+
+    dyntab = ctx.dyntab;
+    for (i = 0; i < ctx.dyntabcount; i++, dyntab++)
+    {
+        if (dyntab->d_tag == DT_NEEDED)
+        {
+            if (!dynamic_string(&ctx, dyntab, "Bogus DT_NEEDED string", &names[info->needed_count]))
+            {
+                MOJOELF_inspect_free(info);
+                return 0;
+            } // if
+            info->needed_count++;
+        } // if
+    } // for
+    assert(info->needed_count == ctx.needed);
+
+    for (i = 1; i < ctx.symtabcount; i++)
+    {
+        const ElfSymTable *symbol = ctx.symtab + i;
+        const char *symstr = ctx.strtab + symbol->st_name;
+        if ((*symstr != '\0') && (symbol->st_shndx == SHN_UNDEF))
+        {
+            weak[info->import_count] = (ELF_ST_BIND(symbol->st_info) == STB_WEAK);
+            names[ctx.needed + info->import_count] = symstr;
+            info->import_count++;
+        } // if
+    } // for
+
+    add_reloc_tables(&ctx);
+    info->reloc_count = (unsigned long) ctx.reloccount;
+    info->mmaplen = (unsigned long) ctx.mmaplen;
+    info->align = (unsigned long) ctx.align;
+    info->has_tls = (ctx.tlsprogram != NULL);
+    if (!info->has_tls)
+        info->workspace_size = (unsigned long) measure_workspace(&ctx);
+
+    return 1;
+} // MOJOELF_inspect
+
+void MOJOELF_inspect_free(MOJOELF_ImageInfo *info)
+{
+    if (info != NULL)
+    {
+        Free((void *) info->needed);  // imports are in the same block.
+        Memzero(info, sizeof (MOJOELF_ImageInfo));
+    } // if
+} // MOJOELF_inspect_free
+
+void *MOJOELF_load_begin(const void *buf, const long buflen,
+                         const MOJOELF_Callbacks *callbacks)
+{
+    ElfLoad *load = (ElfLoad *) Malloc(sizeof (ElfLoad));
+    ElfLoadRequest req;
+
+    if (load == NULL)
+        return NULL;
+
+    Memzero(&req, sizeof (ElfLoadRequest));
+    req.layoutfd = -1;
+    begin_load(load, buf, buflen, callbacks, &req);
+    return load;
+} // MOJOELF_load_begin
+
+int MOJOELF_load_step(void *_load, const unsigned long budget_usec)
+{
+    ElfLoad *load = (ElfLoad *) _load;
+    if (load == NULL)
+        return 1;  // MOJOELF_load_finish() will report this.
+    return step_load(load, budget_usec, LOAD_PHASE_COUNT);
+} // MOJOELF_load_step
+
+void *MOJOELF_load_finish(void *_load)
+{
+    ElfLoad *load = (ElfLoad *) _load;
+    void *retval = NULL;
+
+    if (load == NULL)
+    {
+        set_dlerror("Bogus load handle");
+        return NULL;
+    } // if
+
+    retval = finish_load(load);
+    Free(load);
+    return retval;
+} // MOJOELF_load_finish
+
+
+// MOJOELF_dlopen_many() runs every image through the same phases as
+//  MOJOELF_dlopen_mem(), a stretch at a time, and every image finishes one
+//  stretch before any of them start the next.
+typedef struct ElfBatchTask
+{
+    ElfLoad *load;
+    int until;  // run phases up to, but not including, this one.
+} ElfBatchTask;
+
+static void batch_phases_task(void *_task)
+{
+    ElfBatchTask *task = (ElfBatchTask *) _task;
+    step_load(task->load, 0, task->until);
+} // batch_phases_task
+
+static int find_phase(const ElfPhaseFn fn)
+{
+    int i;
+    for (i = 0; i < LOAD_PHASE_COUNT; i++)
+    {
+        if (load_phases[i] == fn)
+            return i;
+    } // for
+    assert(0);
+    return LOAD_PHASE_COUNT;
+} // find_phase
+
+// Returns the first image, in the app's order, that failed, or -1.
+static int run_batch_phases(ElfLoad *loads, ElfBatchTask *tasks, void **ptrs,
+                            const int count, const int until,
+                            MOJOELF_ExecutorCallback executor, void *userdata)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        tasks[i].load = &loads[i];
+        tasks[i].until = until;
+        ptrs[i] = &tasks[i];
+    } // for
+
+    if ((count > 1) && (executor != NULL))
+        executor(userdata, batch_phases_task, ptrs, count);
+    else
+    {
+        for (i = 0; i < count; i++)
+        {
+            batch_phases_task(ptrs[i]);
+            if (loads[i].failed)
+                break;
+        } // for
+    } // else
+
+    for (i = 0; i < count; i++)
+    {
+        if (loads[i].failed)
+            return i;
+    } // for
+
+    return -1;
+} // run_batch_phases
+
+// Our exported IFUNC resolvers, so is_batch_ifunc() can spot the rest of
+//  the set resolving something to one.
+static int note_batch_ifuncs(ElfContext *ctx)
+{
+    const uint8 *mmapaddr = (const uint8 *) ctx->retval->mmapaddr;
+    const ElfSymTable *symbol;
+    int count = 0;
+    int i;
+
+    symbol = ctx->symtab;
+    for (i = 0; i < ctx->symtabcount; i++, symbol++)
+    {
+        if ((ELF_ST_TYPE(symbol->st_info) == STT_GNU_IFUNC) && (symbol->st_shndx != SHN_UNDEF))
+            count++;
+    } // for
+
+    if (count == 0)
+        return 1;  // nothing to do.
+
+    ctx->batchifuncs = (uintptr *) ctx_alloc(ctx, count * sizeof (uintptr));
+    if (ctx->batchifuncs == NULL)
+        return 0;
+
+    symbol = ctx->symtab;
+    for (i = 0; i < ctx->symtabcount; i++, symbol++)
+    {
+        if ((ELF_ST_TYPE(symbol->st_info) == STT_GNU_IFUNC) && (symbol->st_shndx != SHN_UNDEF))
+            ctx->batchifuncs[ctx->batchifunccount++] = (uintptr) (mmapaddr + (symbol->st_value - ctx->base));
+    } // for
+
+    return 1;
+} // note_batch_ifuncs
+
+// An image depends on another one in the set if it imported anything from
+//  it, or names its DT_SONAME in a DT_NEEDED entry. deps gets a nonzero
+//  byte for each.
+static void find_batch_deps(const ElfContext *ctx, uint8 *deps)
+{
+    const ElfBatch *batch = ctx->batch;
+    const ElfDynTable *dyntab = ctx->dyntab;
+    int i, j;
+
+    for (i = 0; i < ctx->importcount; i++)
+    {
+        const int image = find_batch_image(ctx, ctx->symaddrs[ctx->imports[i]]);
+        if (image != -1)
+            deps[image] = 1;
+    } // for
+
+    // load_external_dependencies() already checked these strings.
+    for (i = 0; i < ctx->dyntabcount; i++, dyntab++)
+    {
+        if (dyntab->d_tag != DT_NEEDED)
+            continue;
+        for (j = 0; j < batch->count; j++)
+        {
+            const char *soname = batch->sonames[j];
+            if ((j != ctx->batchindex) && (soname != NULL) &&
+                (Strcmp(soname, ctx->strtab + dyntab->d_un.d_val) == 0))
+                deps[j] = 1;
+        } // for
+    } // for
+} // find_batch_deps
+
+// Depth first, so everything an image depends on gets initialized before
+//  it does. Cycles get broken wherever we first walk into them, so the
+//  app's order decides those.
+static void order_batch_image(const uint8 *deps, const int count, const int i,
+                              uint8 *visited, int *order, int *ordered)
+{
+    int j;
+
+    if (visited[i])
+        return;  // already ordered, or we're in a cycle.
+
+    visited[i] = 1;
+    for (j = 0; j < count; j++)
+    {
+        if (deps[(i * count) + j])
+            order_batch_image(deps, count, j, visited, order, ordered);
+    } // for
+
+    order[(*ordered)++] = i;
+} // order_batch_image
+
+int MOJOELF_dlopen_many(const void * const *bufs, const long *buflens,
+                        const int count, const MOJOELF_Callbacks *callbacks,
+                        void **libs)
+{
+    const int after_exports = find_phase(build_export_list) + 1;
+    const int after_deps = find_phase(load_external_dependencies) + 1;
+    const int after_resolve = find_phase(resolve_imports) + 1;
+    const int after_protect = find_phase(protect_pages) + 1;
+    MOJOELF_ExecutorCallback executor = NULL;
+    MOJOELF_Callbacks cb;
+    ElfLoadRequest req;
+    ElfBatch batch;
+    ElfLoad *loads = NULL;
+    ElfBatchTask *tasks = NULL;
+    void **ptrs = NULL;
+    uint8 *deps = NULL;
+    uint8 *visited = NULL;
+    int *order = NULL;
+    int ordered = 0;
+    int failed = -1;
+    int retval = 0;
+    int i;
+
+    if ((bufs == NULL) || (buflens == NULL) || (libs == NULL) || (count <= 0))
+        DLOPEN_FAIL("Bogus image list");
+
+    Memzero(libs, count * sizeof (void *));
+    Memzero(&batch, sizeof (ElfBatch));
+    Memzero(&cb, sizeof (MOJOELF_Callbacks));
+    if (callbacks != NULL)
+        copy_callbacks(&cb, callbacks);
+
+    // A shared handle was resolved against some other set.
+    cb.flags &= ~MOJOELF_FLAG_SHARE_IDENTICAL;
+
+    loads = (ElfLoad *) Malloc(count * sizeof (ElfLoad));
+    tasks = (ElfBatchTask *) Malloc(count * sizeof (ElfBatchTask));
+    ptrs = (void **) Malloc(count * sizeof (void *));
+    deps = (uint8 *) Malloc(((size_t) count) * count);
+    visited = (uint8 *) Malloc(count);
+    order = (int *) Malloc(count * sizeof (int));
+    batch.ctxs = (ElfContext **) Malloc(count * sizeof (ElfContext *));
+    batch.sonames = (const char **) Malloc(count * sizeof (const char *));
+    batch.count = count;
+    if ( (loads == NULL) || (tasks == NULL) || (ptrs == NULL) ||
+         (deps == NULL) || (visited == NULL) || (order == NULL) ||
+         (batch.ctxs == NULL) || (batch.sonames == NULL) )
+        goto done;
+
+    Memzero(&req, sizeof (ElfLoadRequest));
+    req.layoutfd = -1;
+    for (i = 0; i < count; i++)
+    {
+        ElfContext *ctx = &loads[i].ctx;
+        begin_load(&loads[i], bufs[i], buflens[i], &cb, &req);
+        executor = ctx->executor;
+        ctx->executor = NULL;  // we're parallel across images instead.
+        ctx->batch = &batch;
+        ctx->batchindex = i;
+        batch.ctxs[i] = ctx;
+    } // for
+
+    // Everything up to the export indexes only touches each image's own
+    //  stuff, so that all happens at once. The loader might not be
+    //  thread-safe, so dependencies get loaded one image at a time.
+    failed = run_batch_phases(loads, tasks, ptrs, count, after_exports, executor, cb.userdata);
+    if (failed != -1)
+        goto finish;
+
+    for (i = 0; i < count; i++)
+    {
+        const ElfContext *ctx = batch.ctxs[i];
+        const ElfDynTable *soname = ctx->dyntabs[DT_SONAME];
+        if ((soname != NULL) && (soname->d_un.d_val < ctx->strtablen))
+            batch.sonames[i] = ctx->strtab + soname->d_un.d_val;
+        if (!note_batch_ifuncs(batch.ctxs[i]))
+        {
+            loads[i].failed = 1;
+            loads[i].error = take_dlerror();
+            failed = i;
+            goto finish;
+        } // if
+    } // for
+
+    failed = run_batch_phases(loads, tasks, ptrs, count, after_deps, NULL, NULL);
+    if (failed != -1)
+        goto finish;
+
+    // Resolving can fall back to the app, so that's parallel if it says
+    //  it's okay. Relocating is all ours.
+    failed = run_batch_phases(loads, tasks, ptrs, count, after_resolve,
+                              (cb.flags & MOJOELF_FLAG_THREADSAFE_RESOLVER) ? executor : NULL,
+                              cb.userdata);
+    if (failed != -1)
+        goto finish;
+
+    failed = run_batch_phases(loads, tasks, ptrs, count, after_protect, executor, cb.userdata);
+    if (failed != -1)
+        goto finish;
+
+    // IFUNC resolvers and constructors run last, and in dependency order.
+    for (i = 0; i < count; i++)
+        find_batch_deps(batch.ctxs[i], deps + (i * count));
+    for (i = 0; i < count; i++)
+        order_batch_image(deps, count, i, visited, order, &ordered);
+    assert(ordered == count);
+
+    for (i = 0; i < count; i++)
+    {
+        step_load(&loads[order[i]], 0, LOAD_PHASE_COUNT);
+        if (loads[order[i]].failed)
+        {
+            failed = order[i];
+            break;
+        } // if
+    } // for
+
+finish:
+    // It's all or nothing, since the images might point into each other.
+    //  Only the ones that got initialized come back from finish_load(), and
+    //  those get closed in the reverse order.
+    for (i = 0; i < count; i++)
+        libs[i] = finish_load(&loads[i]);
+
+    if (failed == -1)
+        retval = 1;
+    else
+    {
+        for (i = ordered - 1; i >= 0; i--)
+        {
+            MOJOELF_dlclose(libs[order[i]]);
+            libs[order[i]] = NULL;
+        } // for
+        set_dlerror(loads[failed].error);
+    } // else
+
+done:
+
+    Free(batch.sonames);
+    Free(batch.ctxs);
+    Free(order);
+    Free(visited);
+    Free(deps);
+    Free(ptrs);
+    Free(tasks);
+    Free(loads);
+    return retval;
+} // MOJOELF_dlopen_many
+
+
+// Make room for this many global exports. The index only grows; rebuilding
+//  it walks the handles backwards, so each chain ends up in load order.
+static int grow_namespace_index(ElfNamespace *ns, const int symcount)
+{
+    uint32 bucket_count = ns->bucket_mask + 1;
+    ElfNamespaceSym **buckets = NULL;
+    ElfNamespaceLib *lib;
+    int i;
+
+    if ((ns->buckets != NULL) && (((uint32) symcount) <= bucket_count))
+        return 1;  // still big enough.
+
+    bucket_count = 16;
+    while (bucket_count < (uint32) symcount)
+        bucket_count <<= 1;
+
+    buckets = (ElfNamespaceSym **) Malloc(bucket_count * sizeof (ElfNamespaceSym *));
+    if (buckets == NULL)
+        return 0;
+
+    for (lib = ns->last; lib != NULL; lib = lib->prev)
+    {
+        if (!lib->global)
+            continue;
+
+        for (i = lib->handle->syms_count - 1; i >= 0; i--)
+        {
+            ElfNamespaceSym *s = &lib->syms[i];
+            const uint32 bucket = s->sym->hash & (bucket_count - 1);
+            s->next = buckets[bucket];
+            buckets[bucket] = s;
+        } // for
+    } // for
+
+    Free(ns->buckets);
+    ns->buckets = buckets;
+    ns->bucket_mask = bucket_count - 1;
+    return 1;
+} // grow_namespace_index
+
+// The newest handle goes last in load order, so its exports go on the end
+//  of their chains, behind anything that was already there. Members that
+//  satisfied our DT_NEEDED entries stay loaded until we're closed.
+static int add_namespace_lib(ElfNamespace *ns, ElfHandle *h,
+                             const char *soname, const int global,
+                             ElfHandle **deps, const int depcount)
+{
+    const size_t sonamelen = soname ? (strlen(soname) + 1) : 0;
+    const size_t symslen = h->syms_count * sizeof (ElfNamespaceSym);
+    const size_t depslen = depcount * sizeof (ElfHandle *);
+    ElfNamespaceLib *lib = NULL;
+    int i;
+
+    if ((global) && (!grow_namespace_index(ns, ns->symcount + h->syms_count)))
+        return 0;
+
+    lib = (ElfNamespaceLib *) Malloc(sizeof (ElfNamespaceLib) + depslen + symslen + sonamelen);
+    if (lib == NULL)
+        return 0;
+
+    lib->ns = ns;
+    lib->handle = h;
+    lib->global = global;
+    lib->deps = (ElfHandle **) (lib + 1);
+    lib->depcount = depcount;
+    lib->syms = (ElfNamespaceSym *) (((uint8 *) lib->deps) + depslen);
+    if (soname != NULL)
+    {
+        char *str = ((char *) lib->syms) + symslen;
+        Strcpy(str, soname);
+        lib->soname = str;
+    } // if
+
+    for (i = 0; i < depcount; i++)
+    {
+        lib->deps[i] = deps[i];
+        deps[i]->nslib->users++;
+    } // for
+
+    for (i = 0; i < h->syms_count; i++)
+    {
+        ElfNamespaceSym *s = &lib->syms[i];
+        s->sym = &h->syms[i];
+        s->handle = h;
+        if (global)
+        {
+            ElfNamespaceSym **prev = &ns->buckets[s->sym->hash & ns->bucket_mask];
+            while (*prev != NULL)
+                prev = &(*prev)->next;
+            *prev = s;
+        } // if
+    } // for
+
+    if (global)
+        ns->symcount += h->syms_count;
+
+    lib->prev = ns->last;
+    if (ns->last != NULL)
+        ns->last->next = lib;
+    else
+        ns->first = lib;
+    ns->last = lib;
+
+    h->nslib = lib;
+    return 1;
+} // add_namespace_lib
+
+// Returns nonzero if h has to stay loaded for the namespace members that
+//  depend on it; it'll be closed for real when the last of them is.
+//  Otherwise, the namespace stays locked until remove_namespace_lib(), so
+//  nobody starts depending on h while its destructors run.
+static int defer_namespace_close(ElfHandle *h)
+{
+    ElfNamespaceLib *lib = h->nslib;
+
+    if (lib == NULL)
+        return 0;
+
+    lock_namespace(lib->ns);
+    if (lib->users > 0)
+    {
+        lib->closed = 1;
+        unlock_namespace(lib->ns);
+        return 1;
+    } // if
+
+    return 0;
+} // defer_namespace_close
+
+// Drop our uses of the members we depended on, closing any that the app
+//  already tried to. Call after h is unloaded, so their destructors run
+//  after ours. This frees lib.
+static void release_namespace_deps(ElfNamespaceLib *lib)
+{
+    int i;
+
+    for (i = 0; i < lib->depcount; i++)
+    {
+        ElfNamespaceLib *dep;
+        int close_it;
+
+        lock_namespace(lib->ns);
+        dep = lib->deps[i]->nslib;
+        close_it = ((--dep->users == 0) && (dep->closed));
+        unlock_namespace(lib->ns);
+
+        if (close_it)
+            MOJOELF_dlclose(dep->handle);
+    } // for
+
+    Free(lib);
+} // release_namespace_deps
+
+// Caller has the namespace locked, from defer_namespace_close(); this
+//  unlocks it. lib is still valid after, for release_namespace_deps().
+static void remove_namespace_lib(ElfNamespaceLib *lib)
+{
+    ElfNamespace *ns = lib->ns;
+    int i;
+
+    if (lib->global)
+    {
+        for (i = 0; i < lib->handle->syms_count; i++)
+        {
+            ElfNamespaceSym *s = &lib->syms[i];
+            ElfNamespaceSym **prev = &ns->buckets[s->sym->hash & ns->bucket_mask];
+            while (*prev != s)
+                prev = &(*prev)->next;
+            *prev = s->next;
+        } // for
+        ns->symcount -= lib->handle->syms_count;
+    } // if
+
+    if (lib->prev != NULL)
+        lib->prev->next = lib->next;
+    else
+        ns->first = lib->next;
+
+    if (lib->next != NULL)
+        lib->next->prev = lib->prev;
+    else
+        ns->last = lib->prev;
+
+    lib->handle->nslib = NULL;
+    unlock_namespace(ns);
+} // remove_namespace_lib
+
+void *MOJOELF_namespace_create(const MOJOELF_Callbacks *callbacks)
+{
+    ElfNamespace *ns = (ElfNamespace *) Malloc(sizeof (ElfNamespace));
+    #if MOJOELF_SUPPORT_THREADS
+    pthread_mutexattr_t attr;
+    #endif
+
+    if (ns == NULL)
+        return NULL;
+
+    if (callbacks != NULL)
+        copy_callbacks(&ns->callbacks, callbacks);
+
+    // A shared handle was resolved against somebody else's namespace, and
+    //  reloading would pull the exports out from under the index.
+    ns->callbacks.flags &= ~(MOJOELF_FLAG_SHARE_IDENTICAL | MOJOELF_FLAG_RELOADABLE);
+
+    #if MOJOELF_SUPPORT_THREADS
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&ns->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    #endif
+
+    return ns;
+} // MOJOELF_namespace_create
+
+void *MOJOELF_namespace_dlopen(void *_ns, const void *buf, const long buflen,
+                               const int visibility)
+{
+    ElfNamespace *ns = (ElfNamespace *) _ns;
+    const int global = ((visibility & MOJOELF_NAMESPACE_GLOBAL) != 0);
+    ElfContext *ctx = NULL;
+    ElfLoadRequest req;
+    ElfLoad load;
+    void *retval = NULL;
+
+    if (ns == NULL)
+    {
+        set_dlerror("Bogus namespace");
+        return NULL;
+    } // if
+
+    Memzero(&req, sizeof (ElfLoadRequest));
+    req.layoutfd = -1;
+
+    lock_namespace(ns);
+
+    begin_load(&load, buf, buflen, &ns->callbacks, &req);
+    ctx = &load.ctx;
+    ctx->ns = ns;
+
+    // Join the namespace before the constructors run, so they can find
+    //  our exports with MOJOELF_namespace_dlsym(), like glibc's would.
+    step_load(&load, 0, find_phase(call_so_init));
+    if (!load.failed)
+    {
+        const ElfDynTable *soname = ctx->dyntabs[DT_SONAME];
+        const char *str = NULL;
+        if ((soname != NULL) && (soname->d_un.d_val < ctx->strtablen))
+            str = ctx->strtab + soname->d_un.d_val;
+        if (!add_namespace_lib(ns, ctx->retval, str, global, ctx->nsdeps, ctx->nsdepcount))
+        {
+            load.failed = 1;
+            load.error = take_dlerror();
+        } // if
+    } // if
+
+    step_load(&load, 0, LOAD_PHASE_COUNT);
+    retval = finish_load(&load);  // MOJOELF_dlclose() leaves on failure.
+
+    unlock_namespace(ns);
+
+    return retval;
+} // MOJOELF_namespace_dlopen
+
+void *MOJOELF_namespace_dlsym(void *_ns, const char *sym)
+{
+    ElfNamespace *ns = (ElfNamespace *) _ns;
+    const ElfNamespaceSym *s = NULL;
+    ElfHandle *h = NULL;
+    void *retval = NULL;
+
+    if (ns == NULL)
+    {
+        set_dlerror("Bogus namespace");
+        return NULL;
+    } // if
+
+    lock_namespace(ns);
+    s = find_global_symbol(ns, sym, gnu_hash(sym));
+    if (s != NULL)
+    {
+        retval = s->sym->addr;
+        h = s->handle;
+    } // if
+    unlock_namespace(ns);
+
+    if (h != NULL)  // not under the lock; constructors can take a while.
+        init_on_dlsym(h);
+
+    if ((retval == NULL) && (ns->callbacks.resolver != NULL))
+        retval = ns->callbacks.resolver(NULL, sym);  // last try.
+
+    if (retval == NULL)
+        set_dlerror("Symbol not found");
+    return retval;
+} // MOJOELF_namespace_dlsym
+
+// Everything still in here gets closed, newest first, so each handle's
+//  destructors run before the destructors of anything it imports from.
+void MOJOELF_namespace_destroy(void *_ns)
+{
+    ElfNamespace *ns = (ElfNamespace *) _ns;
+
+    if (ns == NULL)
+        return;
+
+    lock_namespace(ns);
+    while (ns->last != NULL)
+        MOJOELF_dlclose(ns->last->handle);  // this takes it out of the list.
+    unlock_namespace(ns);
+
+    Free(ns->buckets);
+    #if MOJOELF_SUPPORT_THREADS
+    pthread_mutex_destroy(&ns->mutex);
+    #endif
+    Free(ns);
+} // MOJOELF_namespace_destroy
+
+
+void *MOJOELF_dlsym(void *lib, const char *sym)
+{
+    ElfHandle *h = (ElfHandle *) lib;
+    void *retval = NULL;
+
+    if (h == NULL)
+    {
+        set_dlerror("Bogus library handle");
+        return NULL;
+    } // if
+
+    retval = find_exported_symbol(h, sym);
+    if (retval == NULL)
+        set_dlerror("Symbol not found");
+    else
+        init_on_dlsym(h);
+    return retval;
+} // MOJOELF_dlsym
+
+
+static void run_fini(ElfHandle *h)
+{
+    int i;
+
+    if (h->init_pending)
+        return;  // never initialized, so there's nothing to finalize.
+
+    // ELF spec says FINI_ARRAY is executed in reverse order, so count down.
+    if (h->fini_array != NULL)
+    {
+        for (i = h->fini_array_count-1; i >= 0; i--)
+            ((ElfFiniFn) h->fini_array[i])();
+    } // if
+
+    if (h->fini != NULL)
+        ((ElfFiniFn) h->fini)();
+} // run_fini
+
+// Everything but the handle itself, its mapping, and its dependencies.
+static void free_image_state(ElfHandle *h)
+{
+    free_tls(h->tls);
+    release_shared_text(h->sharedtext);
+    free_import_table(h->imports);
+    Free(h->init_deps);  // never initialized, so these never ran.
+    Free(h->metadata);  // NULL unless it didn't fit after the handle.
+} // free_image_state
+
+int MOJOELF_run_init(void *lib)
+{
+    ElfHandle *h = (ElfHandle *) lib;
+
+    if (h == NULL)
+        DLOPEN_FAIL("Bogus library handle");
+
+    // Only the first caller runs them, even if several race to do it.
+    if (__atomic_load_n(&h->init_pending, __ATOMIC_ACQUIRE))
+        run_pending_init(h);
+
+    return 1;
+} // MOJOELF_run_init
+
+void MOJOELF_dlclose(void *lib)
+{
+    ElfHandle *h = (ElfHandle *) lib;
+    ElfNamespaceLib *nslib = NULL;
+
+    if (h == NULL)
+        return;
+    else if (!release_shared_handle(h))
+        return;  // someone else is still using it.
+    else if (defer_namespace_close(h))
+        return;  // later namespace members still import from it.
+
+    nslib = h->nslib;
+    run_fini(h);
+    if (nslib != NULL)  // destructors could still see the namespace.
+        remove_namespace_lib(nslib);
+    unload_dependencies(h->unloader, h->dlopens, h->dlopens_count);
+
+    unmap_image(&h->callbacks, h->arena, h->mmapaddr, h->mmaplen);
+    free_image_state(h);
+    if (!h->in_workspace)  // otherwise, the app owns this memory.
+        Free(h);
+
+    if (nslib != NULL)
+        release_namespace_deps(nslib);
+} // MOJOELF_dlclose
+
+// Newest constructors first; images that never ran any go last, and have
+//  no destructors to run anyhow.
+static int cmp_init_seq_desc(const void *_a, const void *_b)
+{
+    const ElfHandle *a = *((const ElfHandle * const *) _a);
+    const ElfHandle *b = *((const ElfHandle * const *) _b);
+    return (a->init_seq < b->init_seq) ? 1 : ((a->init_seq > b->init_seq) ? -1 : 0);
+} // cmp_init_seq_desc
+
+static int cmp_mmapaddr(const void *_a, const void *_b)
+{
+    const uintptr a = (uintptr) (*((const ElfHandle * const *) _a))->mmapaddr;
+    const uintptr b = (uintptr) (*((const ElfHandle * const *) _b))->mmapaddr;
+    return (a < b) ? -1 : ((a > b) ? 1 : 0);
+} // cmp_mmapaddr
+
+// Images that sit next to each other, like consecutive loads into an arena,
+//  get unmapped (or handed back to the arena) in one call.
+static void unmap_images(ElfHandle **handles, const int count)
+{
+    int i = 0;
+
+    qsort(handles, count, sizeof (ElfHandle *), cmp_mmapaddr);
+
+    while (i < count)
+    {
+        ElfHandle *h = handles[i++];
+        uint8 *addr = (uint8 *) h->mmapaddr;
+        size_t len = h->mmaplen;
+
+        if ((addr != MAP_FAILED) && (h->callbacks.map == NULL))
+        {
+            const size_t guard = h->arena ? h->arena->guard : 0;
+            while (i < count)
+            {
+                const ElfHandle *next = handles[i];
+                if ( (next->arena != h->arena) || (next->callbacks.map != NULL) ||
+                     (((uint8 *) next->mmapaddr) != (addr + len + guard)) )
+                    break;
+                len = (((uint8 *) next->mmapaddr) + next->mmaplen) - addr;
+                i++;
+            } // while
+        } // if
+
+        unmap_image(&h->callbacks, h->arena, addr, len);
+    } // while
+} // unmap_images
+
+void MOJOELF_dlclose_all(void **libs, const int count, const unsigned int flags)
+{
+    ElfHandle **handles = NULL;
+    ElfNamespaceLib **nslibs = NULL;
+    int closing = 0;
+    int i;
+
+    if ((libs == NULL) || (count <= 0))
+        return;
+
+    handles = (ElfHandle **) Malloc(count * (sizeof (ElfHandle *) + sizeof (ElfNamespaceLib *)));
+    if (handles == NULL)
+    {
+        for (i = count - 1; i >= 0; i--)  // do it the slow way.
+            MOJOELF_dlclose(libs[i]);
+        return;
+    } // if
+
+    // members that others in this list depend on get closed when those are.
+    nslibs = (ElfNamespaceLib **) (handles + count);
+    for (i = 0; i < count; i++)
+    {
+        ElfHandle *h = (ElfHandle *) libs[i];
+        if ((h != NULL) && (release_shared_handle(h)) && (!defer_namespace_close(h)))
+        {
+            nslibs[closing] = h->nslib;
+            handles[closing++] = h;
+        } // if
+    } // for
+
+    // Every destructor runs before anything gets unmapped, so the ones that
+    //  call into other images still find them there.
+    qsort(handles, closing, sizeof (ElfHandle *), cmp_init_seq_desc);
+    for (i = 0; i < closing; i++)
+        run_fini(handles[i]);
+
+    // The OS is about to take back everything else, all at once.
+    if (flags & MOJOELF_CLOSE_EXITING)
+    {
+        for (i = 0; i < closing; i++)
+        {
+            if (handles[i]->nslib != NULL)  // defer_namespace_close() locked it.
+                unlock_namespace(handles[i]->nslib->ns);
+        } // for
+        Free(handles);
+        return;
+    } // if
+
+    for (i = 0; i < closing; i++)
+    {
+        ElfHandle *h = handles[i];
+        if (h->nslib != NULL)
+            remove_namespace_lib(h->nslib);
+        unload_dependencies(h->unloader, h->dlopens, h->dlopens_count);
+    } // for
+
+    unmap_images(handles, closing);
+
+    for (i = 0; i < closing; i++)
+    {
+        ElfHandle *h = handles[i];
+        free_image_state(h);
+        if (!h->in_workspace)  // otherwise, the app owns this memory.
+            Free(h);
+    } // for
+
+    // this might close members we deferred above, now that nothing needs them.
+    for (i = 0; i < closing; i++)
+    {
+        if (nslibs[i] != NULL)
+            release_namespace_deps(nslibs[i]);
+    } // for
+
+    Free(handles);
+} // MOJOELF_dlclose_all
+
+
+// Give back the whole pages between start and end. MADV_DONTNEED drops them
+//  right away, so RSS goes down now, not whenever the kernel gets around to
+//  it; anything that reads them later gets zeros (or the file's copy).
+static long release_pages(void *start, void *end)
+{
+    const uintptr first = (((uintptr) start) + (MOJOELF_PAGESIZE-1)) & ~((uintptr) (MOJOELF_PAGESIZE-1));
+    const uintptr last = ((uintptr) end) & ~((uintptr) (MOJOELF_PAGESIZE-1));
+
+    if (last <= first)
+        return 0;
+    else if (madvise((void *) first, (size_t) (last - first), MADV_DONTNEED) == -1)
+        return 0;
+    return (long) (last - first);
+} // release_pages
+
+long MOJOELF_trim(void *lib, const unsigned int flags)
+{
+    ElfHandle *h = (ElfHandle *) lib;
+    long retval = 0;
+    int i = 0;
+
+    if (h == NULL)
+    {
+        set_dlerror("Bogus library handle");
+        return -1;
+    } // if
+
+    // other images resolve against these, and expect to keep doing it.
+    if (flags & MOJOELF_TRIM_EXPORTS)
+    {
+        if (h->nslib != NULL)
+        {
+            set_dlerror("Can't drop a namespace handle's exports");
+            return -1;
+        } // if
+        else if (h->sharekey != NULL)
+        {
+            set_dlerror("Can't drop a shared handle's exports");
+            return -1;
+        } // else if
+    } // if
+
+    while (i < h->trim_count)
+    {
+        ElfTrimRange *range = &h->trims[i];
+        if ((range->init) && (__atomic_load_n(&h->init_pending, __ATOMIC_ACQUIRE)))
+            i++;  // constructors still need this; maybe next time.
+        else
+        {
+            uint8 *ptr = ((uint8 *) h->mmapaddr) + range->offset;
+            retval += release_pages(ptr, ptr + range->len);
+            *range = h->trims[--h->trim_count];  // either way, it's done.
+        } // else
+    } // while
+
+    // syms, their names, and buckets were carved one after another, so
+    //  they're one span of the handle's metadata.
+    if ((flags & MOJOELF_TRIM_EXPORTS) && (h->buckets != NULL))
+    {
+        void *start = h->syms;
+        void *end = h->buckets + (h->bucket_mask + 1);
+        h->buckets = NULL;
+        h->bucket_mask = 0;
+        h->syms = NULL;
+        h->syms_count = 0;
+        retval += release_pages(start, end);
+    } // if
+
+    return retval;
+} // MOJOELF_trim
 
-static int fixup_rela_internal(ElfContext *ctx, const ElfDynTable *dt_rela,
-                               const ElfDynTable *dt_relasz)
+void *MOJOELF_dlreload(void *lib, const void *buf, const long buflen)
 {
-    const size_t offset = ((size_t) dt_rela->d_un.d_ptr) - ctx->base;
-    const size_t relasz = (size_t) dt_relasz->d_un.d_val;
-    const size_t count = relasz / MOJOELF_SIZEOF_RELAENT;
-    const ElfRelA *rela = (const ElfRelA *) (ctx->buf + offset);
-    int i;
+    ElfHandle *h = (ElfHandle *) lib;
+    MOJOELF_Callbacks callbacks;
+    ElfLoadRequest req;
+    ElfReload reload;
+    ElfContext ctx;
 
-    for (i = 0; i < count; i++, rela++)
+    if (h == NULL)
     {
-        if (!do_fixup(ctx, ELF_R_TYPE(rela->r_info), ELF_R_SYM(rela->r_info),
-                      rela->r_offset, rela->r_addend))
-            return 0;
-    } // for
-
-    return 1;
-} // fixup_rela_internal
+        set_dlerror("Bogus library handle");
+        return NULL;
+    } // if
+    else if (h->sharekey != NULL)
+    {
+        set_dlerror("Can't reload a shared handle");
+        return NULL;
+    } // else if
+    else if (h->in_workspace)
+    {
+        set_dlerror("Can't reload a workspace handle");
+        return NULL;
+    } // else if
+    else if (h->nslib != NULL)
+    {
+        set_dlerror("Can't reload a namespace handle");
+        return NULL;
+    } // else if
+    else if (!scan_elf_image(&ctx, buf, buflen))
+        return NULL;  // old image is untouched.
+
+    Memzero(&reload, sizeof (ElfReload));
+    reload.handle = h;
+    reload.mmapaddr = h->mmapaddr;
+    reload.mmaplen = h->mmaplen;
+    reload.arena = h->arena;
+    reload.dlopens = h->dlopens;
+    reload.dlopens_count = h->dlopens_count;
+    reload.imports = h->imports;
+    reload.metadata = h->metadata;
+    callbacks = h->callbacks;
+
+    run_fini(h);
+    h->imports = NULL;
+    h->metadata = NULL;
+    free_image_state(h);
+    Memzero(h, sizeof (ElfHandle));
+
+    Memzero(&req, sizeof (ElfLoadRequest));
+    req.layoutfd = -1;
+    req.reload = &reload;
+
+    // Same handle back, or NULL (and the handle is gone) on failure.
+    return dlopen_internal(buf, buflen, &callbacks, &req);
+} // MOJOELF_dlreload
 
-static inline int fixup_rela(ElfContext *ctx)
-{
-    const ElfDynTable *dt_rela = ctx->dyntabs[DT_RELA];
-    const ElfDynTable *dt_relasz = ctx->dyntabs[DT_RELASZ];
-    if (dt_rela == NULL)  // it's optional, we're done if it's not there.
-        return 1;
-    return fixup_rela_internal(ctx, dt_rela, dt_relasz);
-} // fixup_rela
 
-static int fixup_rel_internal(ElfContext *ctx, const ElfDynTable *dt_rel,
-                              const ElfDynTable *dt_relsz)
+#if MOJOELF_SUPPORT_DLOPEN_FILE
+static void *dlopen_file_internal(const char *fname, const MOJOELF_Callbacks *cb,
+                                  const ElfLoadRequest *req)
 {
-    const size_t offset = ((size_t) dt_rel->d_un.d_ptr) - ctx->base;
-    const size_t relsz = (size_t) dt_relsz->d_un.d_val;
-    const size_t count = relsz / MOJOELF_SIZEOF_RELENT;
-    const ElfRel *rel = (const ElfRel *) (ctx->buf + offset);
-    int i;
+    void *retval = NULL;
+    struct stat statbuf;
+    int fd = open(fname, O_RDONLY);
+    uint8 *buf = NULL;
 
-    for (i = 0; i < count; i++, rel++)
+    if (fd == -1)
+        set_dlerror(strerror(errno));
+    else if (fstat(fd, &statbuf) == -1)
+        set_dlerror(strerror(errno));
+    else if ((buf = (uint8 *) Alloc(statbuf.st_size)) == NULL)
+        set_dlerror("out of memory");
+    else if (read(fd, buf, statbuf.st_size) != statbuf.st_size)
+        set_dlerror(strerror(errno));
+    else
     {
-        if (!do_fixup(ctx, ELF_R_TYPE(rel->r_info), ELF_R_SYM(rel->r_info),
-                      rel->r_offset, 0))
-            return 0;
-    } // for
+        close(fd);
+        fd = -1;
+        retval = dlopen_internal(buf, statbuf.st_size, cb, req);
+    } // else
 
-    return 1;
-} // fixup_rel_internal
+    if (fd != -1)
+        close(fd);
 
-static inline int fixup_rel(ElfContext *ctx)
-{
-    const ElfDynTable *dt_rel = ctx->dyntabs[DT_REL];
-    const ElfDynTable *dt_relsz = ctx->dyntabs[DT_RELSZ];
-    if (dt_rel == NULL)  // it's optional, we're done if it's not there.
-        return 1;
-    return fixup_rel_internal(ctx, dt_rel, dt_relsz);
-} // fixup_rel
+    if (buf != NULL)
+        Free(buf);
+
+    return retval;
+} // dlopen_file_internal
 
-static inline int fixup_jmprel(ElfContext *ctx)
+void *MOJOELF_dlopen_file(const char *fname, const MOJOELF_Callbacks *cb)
 {
-    const ElfDynTable *dt_jmprel = ctx->dyntabs[DT_JMPREL];
-    const ElfDynTable *dt_jmprelsz = ctx->dyntabs[DT_PLTRELSZ];
+    ElfLoadRequest req;
+    Memzero(&req, sizeof (ElfLoadRequest));
+    req.layoutfd = -1;
+    return dlopen_file_internal(fname, cb, &req);
+} // MOJOELF_dlopen_file
+#endif
 
-    if (dt_jmprel == NULL)  // it's optional, we're done if it's not there.
-        return 1;
 
-    if (ctx->dyntabs[DT_PLTREL]->d_un.d_val == DT_RELA)
-        return fixup_rela_internal(ctx, dt_jmprel, dt_jmprelsz);
+// Async loads run MOJOELF_dlopen_mem() or MOJOELF_dlopen_file() on another
+//  thread: the app's, through the submit callback, or one we start just for
+//  this load. That thread relocates on its own unless the app gave us an
+//  executor; a batch of async loads is already parallel, and each one
+//  starting internal_executor()'s threads too would be hundreds of them. The app finds out it's done through its callback, a pipe it
+//  can poll, or by waiting in MOJOELF_async_finish(), which hands back the
+//  library and frees the rest.
+#if MOJOELF_SUPPORT_THREADS
+typedef struct ElfAsyncLoad
+{
+    const void *buf;  // image to load, if fname is NULL.
+    long buflen;  // size in bytes of buf.
+    char *fname;  // MOJOELF_dlopen_file_async()'s copy of the filename.
+    MOJOELF_Callbacks callbacks;  // our own copy, in the current version.
+    MOJOELF_AsyncCallback done;  // called on the worker when finished.
+    void *userdata;  // passed to done.
+    void *lib;  // the loaded library, once finished.
+    const char *error;  // the worker's dlerror, if lib is NULL.
+    int finished;  // nonzero once lib and error are set.
+    int in_callback;  // nonzero while done is running; load must live.
+    pthread_t callback_thread;  // the thread running done.
+    int released;  // done called MOJOELF_async_finish(); free after it returns.
+    int pipefds[2];  // MOJOELF_async_fd()'s pipe, or -1.
+    pthread_mutex_t mutex;  // protects everything from lib on down.
+    pthread_cond_t cond;  // signaled once finished.
+} ElfAsyncLoad;
+
+static void free_async_load(ElfAsyncLoad *load)
+{
+    if (load->pipefds[0] != -1)
+    {
+        close(load->pipefds[0]);
+        close(load->pipefds[1]);
+    } // if
 
-    assert(ctx->dyntabs[DT_PLTREL]->d_un.d_val == DT_REL);
-    return fixup_rel_internal(ctx, dt_jmprel, dt_jmprelsz);
-} // fixup_jmprel
+    pthread_cond_destroy(&load->cond);
+    pthread_mutex_destroy(&load->mutex);
+    Free(load->fname);
+    Free(load);
+} // free_async_load
 
-static int fixup_relocations(ElfContext *ctx)
+static inline void signal_async_pipe(ElfAsyncLoad *load)
 {
-    if (!fixup_rela(ctx))
-        return 0;
-    else if (!fixup_rel(ctx))
-        return 0;
-    else if (!fixup_jmprel(ctx))
-        return 0;
-    return 1;
-} // fixup_relocations
+    if (write(load->pipefds[1], "", 1) != 1)
+        return;  // not much we can do; a full pipe is readable anyhow.
+} // signal_async_pipe
 
-static int add_exported_symbol(ElfContext *ctx, const char *sym, void *addr)
+static void async_load_task(void *_load)
 {
-    // !!! FIXME: We should really use a hash table for all this.
-    const int syms_count = ctx->retval->syms_count;
-    ElfSymbols *syms = ctx->retval->syms;
+    ElfAsyncLoad *load = (ElfAsyncLoad *) _load;
+    MOJOELF_AsyncCallback done = load->done;
+    const char *error = NULL;
+    ElfLoadRequest req;
+    void *lib = NULL;
+    int released = 0;
+
+    Memzero(&req, sizeof (ElfLoadRequest));
+    req.layoutfd = -1;
+    req.serial = 1;
+
+    #if MOJOELF_SUPPORT_DLOPEN_FILE
+    if (load->fname != NULL)
+        lib = dlopen_file_internal(load->fname, &load->callbacks, &req);
+    else
+    #endif
+        lib = dlopen_internal(load->buf, load->buflen, &load->callbacks, &req);
 
-    // We don't check for duplicates here. You get the first one in the list!
+    error = take_dlerror();
 
-    syms[syms_count].sym = (char *) Malloc(strlen(sym) + 1);
-    if (syms[syms_count].sym == NULL)
-        return 0;
+    pthread_mutex_lock(&load->mutex);
+    load->lib = lib;
+    load->error = error;
+    load->finished = 1;
+    if (done != NULL)  // MOJOELF_async_finish() elsewhere waits for done.
+    {
+        load->in_callback = 1;
+        load->callback_thread = pthread_self();
+    } // if
+    if (load->pipefds[0] != -1)
+        signal_async_pipe(load);
+    pthread_cond_broadcast(&load->cond);
+    pthread_mutex_unlock(&load->mutex);
 
-    Strcpy(syms[syms_count].sym, sym);
-    syms[syms_count].addr = addr;
-    ctx->retval->syms_count++;
+    if (done == NULL)
+        return;  // the app might free load from here on.
 
-    return 1;
-} // add_exported_symbol
+    done(load->userdata, load);
 
+    pthread_mutex_lock(&load->mutex);
+    load->in_callback = 0;
+    released = load->released;
+    pthread_cond_broadcast(&load->cond);
+    pthread_mutex_unlock(&load->mutex);
 
-static int build_export_list(ElfContext *ctx)
+    if (released)  // done finished it, so it's ours to free.
+        free_async_load(load);
+} // async_load_task
+
+static void *async_load_thread(void *load)
 {
-    const ElfSymTable *symbol = ctx->symtab;
-    int symcount = 0;
-    int i;
+    async_load_task(load);
+    return NULL;
+} // async_load_thread
+
+static void *start_async_load(ElfAsyncLoad *load, const MOJOELF_Callbacks *cb,
+                              MOJOELF_AsyncCallback done, void *userdata)
+{
+    int started = 0;
+
+    if (cb != NULL)
+        copy_callbacks(&load->callbacks, cb);
+    load->done = done;
+    load->userdata = userdata;
+    load->pipefds[0] = load->pipefds[1] = -1;
+    pthread_mutex_init(&load->mutex, NULL);
+    pthread_cond_init(&load->cond, NULL);
 
-    for (i = 1; i <= ctx->symtabcount; i++, symbol++)
+    if (load->callbacks.submit != NULL)
     {
-        const uintptr offset = symbol->st_value ? (symbol->st_value - ctx->base) : 0;
-        void *addr = ((uint8 *) ctx->retval->mmapaddr) + offset;
-        const char *symstr;
+        started = load->callbacks.submit(load->callbacks.userdata,
+                                         async_load_task, load);
+    } // if
+    else
+    {
+        pthread_attr_t attr;
+        pthread_t thread;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        started = (pthread_create(&thread, &attr, async_load_thread, load) == 0);
+        pthread_attr_destroy(&attr);
+    } // else
 
-        if (offset > ctx->retval->mmaplen)
-            DLOPEN_FAIL("Bogus symbol address");
-        else if (symbol->st_name >= ctx->strtablen)
-            DLOPEN_FAIL("Bogus symbol name");
+    if (!started)
+    {
+        set_dlerror("Couldn't start async load");
+        free_async_load(load);
+        return NULL;
+    } // if
 
-        symstr = ctx->strtab + symbol->st_name;
+    return load;
+} // start_async_load
 
-        if ((*symstr != '\0') && 
-            (symbol->st_shndx != SHN_UNDEF) &&
-            (symbol->st_shndx != SHN_ABS) &&
-            (addr != ctx->init) &&
-            (addr != ctx->retval->fini))
-        {
-            symcount++;
-        } // if
-    } // for
+void *MOJOELF_dlopen_async(const void *buf, const long buflen,
+                           const MOJOELF_Callbacks *cb,
+                           MOJOELF_AsyncCallback done, void *userdata)
+{
+    ElfAsyncLoad *load = (ElfAsyncLoad *) Malloc(sizeof (ElfAsyncLoad));
+    if (load == NULL)
+        return NULL;
 
-    if (symcount == 0)
-        return 1;  // nothing to do!
+    load->buf = buf;  // the app keeps this around until we're finished.
+    load->buflen = buflen;
+    return start_async_load(load, cb, done, userdata);
+} // MOJOELF_dlopen_async
 
-    ctx->retval->syms = (ElfSymbols *) Malloc(sizeof (ElfSymbols) * symcount);
-    if (ctx->retval->syms == NULL)
-        return 0;
+#if MOJOELF_SUPPORT_DLOPEN_FILE
+void *MOJOELF_dlopen_file_async(const char *fname, const MOJOELF_Callbacks *cb,
+                                MOJOELF_AsyncCallback done, void *userdata)
+{
+    ElfAsyncLoad *load = (ElfAsyncLoad *) Malloc(sizeof (ElfAsyncLoad));
+    if (load == NULL)
+        return NULL;
+    else if ((load->fname = (char *) Malloc(strlen(fname) + 1)) == NULL)
+    {
+        Free(load);
+        return NULL;
+    } // else if
 
-    symbol = ctx->symtab;
-    for (i = 1; i <= ctx->symtabcount; i++, symbol++)
+    Strcpy(load->fname, fname);
+    return start_async_load(load, cb, done, userdata);
+} // MOJOELF_dlopen_file_async
+#endif
+
+// The pipe only gets made if someone asks for it.
+int MOJOELF_async_fd(void *_load)
+{
+    ElfAsyncLoad *load = (ElfAsyncLoad *) _load;
+    int retval = -1;
+
+    if (load == NULL)
     {
-        const uintptr offset = symbol->st_value ? (symbol->st_value - ctx->base) : 0;
-        void *addr = ((uint8 *) ctx->retval->mmapaddr) + offset;
-        const char *symstr = ctx->strtab + symbol->st_name;
+        set_dlerror("Bogus async load");
+        return -1;
+    } // if
 
-        if ((*symstr != '\0') && 
-            (symbol->st_shndx != SHN_UNDEF) &&
-            (symbol->st_shndx != SHN_ABS) &&
-            (addr != ctx->init) &&
-            (addr != ctx->retval->fini))
+    pthread_mutex_lock(&load->mutex);
+    if (load->pipefds[0] == -1)
+    {
+        if (pipe(load->pipefds) == -1)
         {
-            dbgprintf(("Exporting '%s' as '%p' ...\n", symstr, addr));
-            if (!add_exported_symbol(ctx, symstr, addr))
-                return 0;
-            else if (ctx->retval->syms_count == symcount)
-                break;  // found them all.
+            load->pipefds[0] = load->pipefds[1] = -1;
+            set_dlerror("Couldn't create pipe");
         } // if
-    } // for
+        else
+        {
+            fcntl(load->pipefds[0], F_SETFD, FD_CLOEXEC);
+            fcntl(load->pipefds[1], F_SETFD, FD_CLOEXEC);
+            if (load->finished)
+                signal_async_pipe(load);
+        } // else
+    } // if
+    retval = load->pipefds[0];
+    pthread_mutex_unlock(&load->mutex);
 
-    assert(ctx->retval->syms_count == symcount);
-    return 1;
-} // build_export_list
+    return retval;
+} // MOJOELF_async_fd
 
+int MOJOELF_async_done(void *_load)
+{
+    ElfAsyncLoad *load = (ElfAsyncLoad *) _load;
+    int retval = 0;
 
-static int call_so_init(ElfContext *ctx)
+    if (load == NULL)
+        DLOPEN_FAIL("Bogus async load");
+
+    pthread_mutex_lock(&load->mutex);
+    retval = load->finished;
+    pthread_mutex_unlock(&load->mutex);
+    return retval;
+} // MOJOELF_async_done
+
+void *MOJOELF_async_finish(void *_load)
 {
-    if (ctx->init != NULL)
-        ((ElfInitFn) ctx->init)(0, NULL, NULL);
+    ElfAsyncLoad *load = (ElfAsyncLoad *) _load;
+    void *retval = NULL;
 
-    if (ctx->init_array != NULL)
+    if (load == NULL)
     {
-        int i;
-        for (i = 0; i < ctx->init_array_count; i++)
-            ((ElfInitFn) ctx->init_array[i])(0, NULL, NULL);
+        set_dlerror("Bogus async load");
+        return NULL;
     } // if
 
-    return 1;
-} // call_so_init
+    // if done is running on another thread, it gets to finish with load.
+    pthread_mutex_lock(&load->mutex);
+    while ( (!load->finished) ||
+            ((load->in_callback) && (!pthread_equal(load->callback_thread, pthread_self()))) )
+        pthread_cond_wait(&load->cond, &load->mutex);
 
-static void *noop_loader(const char *soname, const char *rpath, const char *runpath) { return NULL; }
-static void *noop_resolver(void *handle, const char *sym) { return NULL; }
-static void noop_unloader(void *handle) {}
+    retval = load->lib;
+    if (retval == NULL)
+        set_dlerror(load->error);  // hand the worker's error to this thread.
 
-void *MOJOELF_dlopen_mem(const void *buf, const long buflen,
-                         const MOJOELF_Callbacks *callbacks)
-{
-    static const MOJOELF_Callbacks nullcb = { NULL, NULL, NULL };
-    ElfHandle *handle = NULL;
-    ElfContext ctx;
+    if (load->in_callback)  // called from done; free it once done returns.
+    {
+        load->released = 1;
+        pthread_mutex_unlock(&load->mutex);
+        return retval;
+    } // if
 
-    assert(sizeof (ElfHeader) == MOJOELF_SIZEOF_ELF_HEADER);
-    assert(sizeof (ElfProgram) == MOJOELF_SIZEOF_PROGRAM_HEADER);
-    assert(sizeof (ElfSection) == MOJOELF_SIZEOF_SECTION_HEADER);
+    pthread_mutex_unlock(&load->mutex);
+    free_async_load(load);
+    return retval;
+} // MOJOELF_async_finish
+#endif
 
-    handle = (ElfHandle *) Malloc(sizeof (ElfHandle));
-    if (handle == NULL)
-        return NULL;
 
-    if (callbacks == NULL)
-        callbacks = &nullcb;
+#if MOJOELF_SUPPORT_REMOTE
+// Image server support (see mojoelfd/). The server lays each image out in a
+//  memfd, relocated for an address range it reserves for that image, and
+//  hands clients that memfd, plus one holding the ELF file itself, over a
+//  SOCK_SEQPACKET Unix socket. Only R_RELATIVE relocations are done on the
+//  server; anything that depends on the client's callbacks (symbol lookups,
+//  IFUNCs, TLS, initializers) still happens in the client.
+#define MOJOELF_REMOTE_MAGIC 0x454A4F4D  // "MOJE"
+#define MOJOELF_REMOTE_VERSION 1
+
+typedef struct ElfRemoteReply
+{
+    uint32 magic;  // MOJOELF_REMOTE_MAGIC
+    uint32 version;  // MOJOELF_REMOTE_VERSION
+    uint32 found;  // zero if the server doesn't know that name.
+    uint32 reserved;
+    uint64 base;  // address the layout was relocated for.
+    uint64 mmaplen;  // size in bytes of the layout memfd.
+    uint64 imagelen;  // size in bytes of the ELF file memfd.
+} ElfRemoteReply;
+
+typedef struct ElfRemoteImage
+{
+    int layoutfd;  // memfd with the relocated image.
+    int elffd;  // memfd with the original ELF file.
+    void *base;  // PROT_NONE reservation, so images never overlap.
+    size_t mmaplen;
+    size_t imagelen;
+} ElfRemoteImage;
+
+// These get sealed once they're filled in, so clients can map them without
+//  worrying that the server (or anyone else with the fd) changes them later.
+static int create_memfd(const char *name, const size_t len)
+{
+    const int flags = MFD_CLOEXEC_FLAG | MFD_ALLOW_SEALING_FLAG;
+    const int fd = (int) syscall(SYS_memfd_create, name, flags);
+    if (fd == -1)
+        return -1;
+    else if (ftruncate(fd, (off_t) len) == -1)
+    {
+        close(fd);
+        return -1;
+    } // else if
+    return fd;
+} // create_memfd
+
+void MOJOELF_remote_free(void *_img)
+{
+    ElfRemoteImage *img = (ElfRemoteImage *) _img;
+    if (img == NULL)
+        return;
+    if (img->layoutfd != -1)
+        close(img->layoutfd);
+    if (img->elffd != -1)
+        close(img->elffd);
+    if (img->base != ((void *) MAP_FAILED))
+        munmap(img->base, img->mmaplen);
+    Free(img);
+} // MOJOELF_remote_free
+
+void *MOJOELF_remote_prepare(const void *buf, const long buflen)
+{
+    ElfRemoteImage *img = NULL;
+    uint8 *layout = (uint8 *) MAP_FAILED;
+    uint8 *image = (uint8 *) MAP_FAILED;
+    ElfHandle handle;
+    ElfContext ctx;
+    int okay = 0;
+    int t;
 
+    Memzero(&handle, sizeof (ElfHandle));
     Memzero(&ctx, sizeof (ElfContext));
+    ctx.cachefd = -1;
+    ctx.layoutfd = -1;
     ctx.buf = (const uint8 *) buf;
     ctx.buflen = (size_t) buflen;
-    ctx.loader = callbacks->loader ? callbacks->loader : noop_loader;
-    ctx.resolver = callbacks->resolver ? callbacks->resolver : noop_resolver;
-    ctx.unloader = callbacks->unloader ? callbacks->unloader : noop_unloader;
     ctx.header = (const ElfHeader *) buf;
-    ctx.retval = handle;
-    ctx.retval->mmapaddr = ((void *) MAP_FAILED);
-    ctx.retval->entry = (void *) ctx.header->e_entry;
-    ctx.retval->unloader = ctx.unloader;
-
-    // here we go.
-    if (!validate_elf_header(&ctx)) goto fail;
-    else if (!process_program_headers(&ctx)) goto fail;
-    else if (!map_pages(&ctx)) goto fail;
-    else if (!walk_dynamic_table(&ctx)) goto fail;
-    else if (!process_section_headers(&ctx)) goto fail;
-    else if (!load_external_dependencies(&ctx)) goto fail;
-    else if (!build_export_list(&ctx)) goto fail;
-    else if (!fixup_relocations(&ctx)) goto fail;
-    else if (!protect_pages(&ctx)) goto fail;
-    else if (!call_so_init(&ctx)) goto fail;
-
-    // we made it!
-    return ctx.retval;
-
-fail:
-    ctx.retval->fini = NULL;  // don't try to call this in MOJOELF_dlclose()!
-    MOJOELF_dlclose(ctx.retval);  // clean up any half-complete stuff.
-    return NULL;
-} // MOJOELF_dlopen_mem
+    ctx.retval = &handle;
+    handle.mmapaddr = ((void *) MAP_FAILED);
 
+    if (!validate_elf_header(&ctx))
+        return NULL;
+    else if (!process_program_headers(&ctx))
+        return NULL;
+    else if (!index_dynamic_table(&ctx))
+        return NULL;
 
-void *MOJOELF_dlsym(void *lib, const char *sym)
-{
-    const ElfHandle *h = (const ElfHandle *) lib;
-    int i;
+    img = (ElfRemoteImage *) Malloc(sizeof (ElfRemoteImage));
+    if (img == NULL)
+        return NULL;
 
-    if (h == NULL)
+    img->layoutfd = img->elffd = -1;
+    img->mmaplen = ctx.mmaplen;
+    img->imagelen = (size_t) buflen;
+
+    // Hold on to this address range for as long as we serve this image, so
+    //  every image we hand out gets its own spot.
+    img->base = mmap((void *) ctx.base, ctx.mmaplen, PROT_NONE,
+                     MAP_ANON | MAP_PRIVATE | (ctx.base ? MAP_FIXED_NOREPLACE : 0),
+                     -1, 0);
+    if (img->base == ((void *) MAP_FAILED))
     {
-        set_dlerror("Bogus library handle");
-        return NULL;
+        set_dlerror("mmap failed");
+        goto done;
+    } // if
+    else if ((ctx.base) && (img->base != ((void *) ctx.base)))
+    {
+        set_dlerror("Couldn't reserve image's fixed address");
+        goto done;
+    } // else if
+
+    img->layoutfd = create_memfd("mojoelf-layout", ctx.mmaplen);
+    if (img->layoutfd != -1)
+        layout = (uint8 *) mmap(NULL, ctx.mmaplen, PROT_READ | PROT_WRITE, MAP_SHARED, img->layoutfd, 0);
+    if (layout == ((uint8 *) MAP_FAILED))
+    {
+        set_dlerror("Couldn't create image layout");
+        goto done;
     } // if
 
-    // !!! FIXME: can we hash these?
-    for (i = 0; i < h->syms_count; i++)
+    handle.mmapaddr = layout;
+    handle.mmaplen = ctx.mmaplen;
+    if (!copy_segments(&ctx, 1))
+        goto done;
+
+    add_reloc_tables(&ctx);
+    for (t = 0; t < ctx.reloctabcount; t++)
     {
-        if (Strcmp(h->syms[i].sym, sym) == 0)
-            return h->syms[i].addr;
+        const ElfRelocTable *table = &ctx.reloctabs[t];
+        size_t i;
+        for (i = 0; i < table->count; i++)
+        {
+            uint32 r_type, r_sym;
+            uintptr r_offset;
+            intptr r_addend;
+            get_reloc(table, i, &r_type, &r_sym, &r_offset, &r_addend);
+            if (r_type == R_RELATIVE)  // same math as do_fixup(), for base.
+            {
+                uintptr *fixup = (uintptr *) (layout + (r_offset - ctx.base));
+                if (table->is_rela)
+                    *fixup = (uintptr) (((uint8 *) img->base) + r_addend);
+                else
+                    *fixup += (uintptr) img->base;
+            } // if
+        } // for
     } // for
 
-    set_dlerror("Symbol not found");
-    return NULL;
-} // MOJOELF_dlsym
-
+    img->elffd = create_memfd("mojoelf-image", img->imagelen);
+    if (img->elffd != -1)
+        image = (uint8 *) mmap(NULL, img->imagelen, PROT_READ | PROT_WRITE, MAP_SHARED, img->elffd, 0);
+    if (image == ((uint8 *) MAP_FAILED))
+    {
+        set_dlerror("Couldn't create image copy");
+        goto done;
+    } // if
 
-void MOJOELF_dlclose(void *lib)
-{
-    ElfHandle *h = (ElfHandle *) lib;
-    int i;
+    memcpy(image, buf, img->imagelen);
 
-    if (h == NULL)
-        return;
+    // F_SEAL_WRITE fails while we still have writable mappings.
+    munmap(layout, ctx.mmaplen);
+    munmap(image, img->imagelen);
+    layout = image = (uint8 *) MAP_FAILED;
 
-    // ELF spec says FINI_ARRAY is executed in reverse order, so count down.
-    if (h->fini_array != NULL)
+    if ( (fcntl(img->layoutfd, F_ADD_SEALS, MOJOELF_REMOTE_SEALS | F_SEAL_SEAL) == -1) ||
+         (fcntl(img->elffd, F_ADD_SEALS, MOJOELF_REMOTE_SEALS | F_SEAL_SEAL) == -1) )
     {
-        for (i = h->fini_array_count-1; i >= 0; i--)
-            ((ElfFiniFn) h->fini_array[i])();
+        set_dlerror("Couldn't seal image");
+        goto done;
     } // if
 
-    if (h->fini != NULL)
-        ((ElfFiniFn) h->fini)();
+    okay = 1;
 
-    if (h->dlopens != NULL)
+done:
+    if (layout != ((uint8 *) MAP_FAILED))
+        munmap(layout, ctx.mmaplen);
+    if (image != ((uint8 *) MAP_FAILED))
+        munmap(image, img->imagelen);
+
+    if (!okay)
     {
-        for (i = 0; i < h->dlopens_count; i++)
-        {
-            if (h->dlopens[i])
-                h->unloader(h->dlopens[i]);
-        } // for
-        free(h->dlopens);
+        MOJOELF_remote_free(img);
+        return NULL;
     } // if
 
-    if (h->mmapaddr != MAP_FAILED)
-        munmap(h->mmapaddr, h->mmaplen);
+    return img;
+} // MOJOELF_remote_prepare
 
-    if (h->syms != NULL)
+int MOJOELF_remote_send(int sock, void *_img)
+{
+    const ElfRemoteImage *img = (const ElfRemoteImage *) _img;
+    union { struct cmsghdr hdr; char buf[CMSG_SPACE(sizeof (int) * 2)]; } cmsg;
+    ElfRemoteReply reply;
+    struct msghdr msg;
+    struct iovec iov;
+
+    Memzero(&reply, sizeof (reply));
+    reply.magic = MOJOELF_REMOTE_MAGIC;
+    reply.version = MOJOELF_REMOTE_VERSION;
+
+    Memzero(&msg, sizeof (msg));
+    iov.iov_base = &reply;
+    iov.iov_len = sizeof (reply);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (img != NULL)  // NULL just tells the client we don't have it.
     {
-        for (i = 0; i < h->syms_count; i++)
-            free(h->syms[i].sym);
-        free(h->syms);
+        const int fds[2] = { img->layoutfd, img->elffd };
+        reply.found = 1;
+        reply.base = (uint64) (uintptr) img->base;
+        reply.mmaplen = (uint64) img->mmaplen;
+        reply.imagelen = (uint64) img->imagelen;
+        Memzero(&cmsg, sizeof (cmsg));
+        cmsg.hdr.cmsg_level = SOL_SOCKET;
+        cmsg.hdr.cmsg_type = SCM_RIGHTS;
+        cmsg.hdr.cmsg_len = CMSG_LEN(sizeof (fds));
+        memcpy(CMSG_DATA(&cmsg.hdr), fds, sizeof (fds));
+        msg.msg_control = cmsg.buf;
+        msg.msg_controllen = sizeof (cmsg.buf);
     } // if
 
-    free(h);
-} // MOJOELF_dlclose
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != (ssize_t) sizeof (reply))
+        DLOPEN_FAIL("Couldn't send reply");
 
+    return 1;
+} // MOJOELF_remote_send
 
-#if MOJOELF_SUPPORT_DLOPEN_FILE
-void *MOJOELF_dlopen_file(const char *fname, const MOJOELF_Callbacks *cb)
+static int is_sealed(const int fd)
 {
-    void *retval = NULL;
-    struct stat statbuf;
-    int fd = open(fname, O_RDONLY);
-    uint8 *buf = NULL;
+    const int seals = fcntl(fd, F_GET_SEALS);
+    return ((seals != -1) && ((seals & MOJOELF_REMOTE_SEALS) == MOJOELF_REMOTE_SEALS));
+} // is_sealed
 
-    if (fd == -1)
-        set_dlerror(strerror(errno));
-    else if (fstat(fd, &statbuf) == -1)
-        set_dlerror(strerror(errno));
-    else if ((buf = (uint8 *) malloc(statbuf.st_size)) == NULL)
-        set_dlerror("out of memory");
-    else if (read(fd, buf, statbuf.st_size) != statbuf.st_size)
-        set_dlerror(strerror(errno));
-    else
+// Ask the server for an image, and get back its two memfds.
+static int request_remote_image(const char *sockpath, const char *name,
+                                ElfRemoteReply *reply, int *fds)
+{
+    union { struct cmsghdr hdr; char buf[CMSG_SPACE(sizeof (int) * 2)]; } cmsg;
+    const size_t namelen = strlen(name);
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *hdr;
+    ssize_t rc;
+    int sock;
+
+    if (strlen(sockpath) >= sizeof (addr.sun_path))
+        DLOPEN_FAIL("Socket path too long");
+
+    Memzero(&addr, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    Strcpy(addr.sun_path, sockpath);
+
+    sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        DLOPEN_FAIL("Couldn't create socket");
+    else if (connect(sock, (struct sockaddr *) &addr, sizeof (addr)) == -1)
     {
-        close(fd);
-        fd = -1;
-        retval = MOJOELF_dlopen_mem(buf, statbuf.st_size, cb);
-    } // else
+        close(sock);
+        DLOPEN_FAIL("Couldn't connect to image server");
+    } // else if
+    else if (send(sock, name, namelen, MSG_NOSIGNAL) != (ssize_t) namelen)
+    {
+        close(sock);
+        DLOPEN_FAIL("Couldn't send request");
+    } // else if
+
+    Memzero(&msg, sizeof (msg));
+    Memzero(&cmsg, sizeof (cmsg));
+    iov.iov_base = reply;
+    iov.iov_len = sizeof (*reply);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof (cmsg.buf);
+    rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    close(sock);
+
+    // grab any fds first, so we can't leak them on errors.
+    hdr = (rc > 0) ? CMSG_FIRSTHDR(&msg) : NULL;
+    if ((hdr != NULL) && (hdr->cmsg_level == SOL_SOCKET) &&
+        (hdr->cmsg_type == SCM_RIGHTS) &&
+        (hdr->cmsg_len == CMSG_LEN(sizeof (int) * 2)))
+        memcpy(fds, CMSG_DATA(hdr), sizeof (int) * 2);
+
+    if ((rc != (ssize_t) sizeof (*reply)) ||
+        (reply->magic != MOJOELF_REMOTE_MAGIC) ||
+        (reply->version != MOJOELF_REMOTE_VERSION))
+        DLOPEN_FAIL("Bogus reply from image server");
+    else if (!reply->found)
+        DLOPEN_FAIL("Image server doesn't have that image");
+    else if ((fds[0] == -1) || (fds[1] == -1))
+        DLOPEN_FAIL("Image server didn't send the image");
+    else if ((!is_sealed(fds[0])) || (!is_sealed(fds[1])))
+        DLOPEN_FAIL("Image server sent an unsealed image");
 
-    if (fd != -1)
-        close(fd);
+    return 1;
+} // request_remote_image
 
-    if (buf != NULL)
-        free(buf);
+void *MOJOELF_dlopen_remote(const char *sockpath, const char *name,
+                            const MOJOELF_Callbacks *cb)
+{
+    void *buf = MAP_FAILED;
+    void *retval = NULL;
+    ElfRemoteReply reply;
+    int fds[2] = { -1, -1 };
+
+    if (request_remote_image(sockpath, name, &reply, fds))
+    {
+        buf = mmap(NULL, (size_t) reply.imagelen, PROT_READ, MAP_PRIVATE, fds[1], 0);
+        if (buf == MAP_FAILED)
+            set_dlerror("mmap failed");
+        else
+        {
+            ElfLoadRequest req;
+            Memzero(&req, sizeof (ElfLoadRequest));
+            req.layoutfd = fds[0];
+            req.layoutbase = (void *) (uintptr) reply.base;
+            retval = dlopen_internal(buf, (long) reply.imagelen, cb, &req);
+        } // else
+    } // if
+
+    if (buf != MAP_FAILED)
+        munmap(buf, (size_t) reply.imagelen);
+    if (fds[0] != -1)
+        close(fds[0]);
+    if (fds[1] != -1)
+        close(fds[1]);
 
     return retval;
-} // MOJOELF_dlopen_file
+} // MOJOELF_dlopen_remote
 #endif
 
 
@@ -16,21 +16,153 @@ extern "C" {
 typedef void *(*MOJOELF_LoaderCallback)(const char *soname, const char *rpath, const char *runpath);
 typedef void *(*MOJOELF_ResolverCallback)(void *handle, const char *sym);
 typedef void (*MOJOELF_UnloaderCallback)(void *handle);
+typedef void (*MOJOELF_TaskCallback)(void *task);
+typedef void (*MOJOELF_ExecutorCallback)(void *userdata, MOJOELF_TaskCallback fn, void **tasks, int count);
+typedef void (*MOJOELF_BatchResolverCallback)(void *handle, const char **names, const unsigned int *hashes, void **out, int count);
+typedef void *(*MOJOELF_IfuncCallback)(void *userdata, const char *sym, void *resolver);
+typedef void *(*MOJOELF_MapCallback)(void *userdata, void *base, unsigned long len, unsigned long align, int fixed);
+typedef int (*MOJOELF_ProtectCallback)(void *userdata, void *addr, unsigned long len, int prot);
+typedef void (*MOJOELF_UnmapCallback)(void *userdata, void *addr, unsigned long len);
+typedef void *(*MOJOELF_AllocCallback)(void *userdata, unsigned long len);
+typedef void (*MOJOELF_FreeCallback)(void *userdata, void *ptr);
+typedef int (*MOJOELF_SubmitCallback)(void *userdata, MOJOELF_TaskCallback fn, void *task);
+typedef void (*MOJOELF_AsyncCallback)(void *userdata, void *load);
+
+// Bump this when fields are added to the end of MOJOELF_Callbacks.
+#define MOJOELF_CALLBACKS_VERSION 7
+
+// Bits for MOJOELF_Callbacks::flags.
+#define MOJOELF_FLAG_THREADSAFE_RESOLVER (1 << 0)
+#define MOJOELF_FLAG_PATCH_PLT (1 << 1)
+#define MOJOELF_FLAG_STATIC_TLS (1 << 2)
+#define MOJOELF_FLAG_SNAPSHOT (1 << 3)
+#define MOJOELF_FLAG_SHARE_IDENTICAL (1 << 4)
+#define MOJOELF_FLAG_SHARE_TEXT (1 << 5)
+#define MOJOELF_FLAG_RELOADABLE (1 << 6)
+#define MOJOELF_FLAG_DEFER_INIT (1 << 7)
+#define MOJOELF_FLAG_INIT_ON_DLSYM (1 << 8)
+#define MOJOELF_FLAG_PREFETCH (1 << 9)
+#define MOJOELF_FLAG_PREFETCH_ASYNC (1 << 10)
+
+// A library can put MOJOELF_SNAPSHOT_NOTE in one of its source files to say
+//  its initializers are safe to snapshot, like MOJOELF_FLAG_SNAPSHOT does.
+#define MOJOELF_NOTE_SNAPSHOT 1
+#define MOJOELF_SNAPSHOT_NOTE \
+    __asm__(".pushsection .note.mojoelf,\"a\",@note\n" \
+            ".balign 4\n.long 8\n.long 0\n.long 1\n" \
+            ".asciz \"MojoELF\"\n.popsection\n")
+
+// Bits for MOJOELF_namespace_dlopen().
+#define MOJOELF_NAMESPACE_LOCAL 0
+#define MOJOELF_NAMESPACE_GLOBAL (1 << 0)
+
+// Bits for MOJOELF_dlclose_all().
+#define MOJOELF_CLOSE_EXITING (1 << 0)
+
+// Bits for MOJOELF_trim().
+#define MOJOELF_TRIM_EXPORTS (1 << 0)
+
+// Bits for MOJOELF_arena_create().
+#define MOJOELF_ARENA_GUARD_PAGES (1 << 0)
 
 typedef struct MOJOELF_Callbacks
 {
     MOJOELF_LoaderCallback loader;
     MOJOELF_ResolverCallback resolver;
     MOJOELF_UnloaderCallback unloader;
+
+    // Everything below here is ignored unless version is nonzero.
+    int version;  // set this to MOJOELF_CALLBACKS_VERSION.
+    unsigned int flags;  // MOJOELF_FLAG_* bits.
+    MOJOELF_ExecutorCallback executor;
+    void *userdata;  // passed to the executor, ifunc, mapping and submit callbacks.
+
+    // version 2 and later...
+    MOJOELF_BatchResolverCallback resolve_batch;
+
+    // version 3 and later...
+    MOJOELF_IfuncCallback ifunc;
+
+    // version 4 and later...
+    const char *cache_dir;  // cache relocated images here, or NULL.
+
+    // version 5 and later...
+    void *arena;  // from MOJOELF_arena_create(), or NULL.
+
+    // version 6 and later...
+    MOJOELF_MapCallback map;  // NULL to use mmap().
+    MOJOELF_ProtectCallback protect;  // NULL to use mprotect().
+    MOJOELF_UnmapCallback unmap;  // only used with map.
+
+    // version 7 and later...
+    MOJOELF_SubmitCallback submit;  // runs async loads; NULL for a thread.
 } MOJOELF_Callbacks;
 
+// What MOJOELF_inspect() found. The strings point into the image's buffer.
+typedef struct MOJOELF_ImageInfo
+{
+    const char *soname;  // DT_SONAME, or NULL.
+    const char *rpath;  // DT_RPATH, or NULL.
+    const char *runpath;  // DT_RUNPATH, or NULL.
+    const char **needed;  // DT_NEEDED entries, in order.
+    int needed_count;
+    const char **imports;  // symbols it wants from somewhere else.
+    const unsigned char *imports_weak;  // nonzero if that import can be missing.
+    int import_count;
+    int export_count;  // symbols other images can import from it.
+    unsigned long mmaplen;  // bytes of address space a load maps.
+    unsigned long align;  // alignment that mapping needs.
+    unsigned long reloc_count;  // relocations a load applies.
+    int has_tls;  // nonzero if it has thread-local storage.
+    unsigned long workspace_size;  // what MOJOELF_workspace_size() says, or 0.
+} MOJOELF_ImageInfo;
+
 void *MOJOELF_dlopen_mem(const void *buf, const long buflen, const MOJOELF_Callbacks *cb);
 void *MOJOELF_dlopen_file(const char *fname, const MOJOELF_Callbacks *cb);
 void *MOJOELF_dlsym(void *lib, const char *sym);
 void MOJOELF_dlclose(void *lib);
+void MOJOELF_dlclose_all(void **libs, const int count, const unsigned int flags);
+long MOJOELF_trim(void *lib, const unsigned int flags);
+void *MOJOELF_dlreload(void *lib, const void *buf, const long buflen);
+long MOJOELF_workspace_size(const void *buf, const long buflen);
+void *MOJOELF_dlopen_workspace(const void *buf, const long buflen, const MOJOELF_Callbacks *cb, void *workspace, const long workspacelen);
+int MOJOELF_dlopen_many(const void * const *bufs, const long *buflens, const int count, const MOJOELF_Callbacks *cb, void **libs);
+int MOJOELF_inspect(const void *buf, const long buflen, MOJOELF_ImageInfo *info);
+void MOJOELF_inspect_free(MOJOELF_ImageInfo *info);
 const char *MOJOELF_dlerror(void);
+int MOJOELF_run_init(void *lib);
+void MOJOELF_set_init_args(int argc, char **argv, char **envp);
+int MOJOELF_profile_save(void *lib);
 const void *MOJOELF_getentry(void *lib);
 void MOJOELF_getmmaprange(void *lib, void **addr, unsigned long *len);
+int MOJOELF_tls_thread_init(void);
+int MOJOELF_set_allocator(MOJOELF_AllocCallback alloc, MOJOELF_FreeCallback dealloc, void *userdata);
+void *MOJOELF_arena_create(const unsigned long size, const unsigned int flags);
+void MOJOELF_arena_destroy(void *arena);
+
+// Sets of handles that import from each other; see "Namespaces" in README.md.
+void *MOJOELF_namespace_create(const MOJOELF_Callbacks *cb);
+void *MOJOELF_namespace_dlopen(void *ns, const void *buf, const long buflen, const int visibility);
+void *MOJOELF_namespace_dlsym(void *ns, const char *sym);
+void MOJOELF_namespace_destroy(void *ns);
+
+// Loading a little at a time; see "Incremental loading" in README.md.
+void *MOJOELF_load_begin(const void *buf, const long buflen, const MOJOELF_Callbacks *cb);
+int MOJOELF_load_step(void *load, const unsigned long budget_usec);
+void *MOJOELF_load_finish(void *load);
+
+// Loading on another thread; see "Async loading" in README.md.
+void *MOJOELF_dlopen_async(const void *buf, const long buflen, const MOJOELF_Callbacks *cb, MOJOELF_AsyncCallback done, void *userdata);
+void *MOJOELF_dlopen_file_async(const char *fname, const MOJOELF_Callbacks *cb, MOJOELF_AsyncCallback done, void *userdata);
+int MOJOELF_async_fd(void *load);
+int MOJOELF_async_done(void *load);
+void *MOJOELF_async_finish(void *load);
+
+// Image server support; see mojoelfd/ for the server side.
+void *MOJOELF_dlopen_remote(const char *sockpath, const char *name, const MOJOELF_Callbacks *cb);
+void *MOJOELF_remote_prepare(const void *buf, const long buflen);
+int MOJOELF_remote_send(int sock, void *img);
+void MOJOELF_remote_free(void *img);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,16 @@
+#!/bin/sh
+
+# MojoELF; load ELF binaries from a memory buffer.
+#
+# Please see the file LICENSE.txt in the source's root directory.
+#
+#  This file written by Ryan C. Gordon.
+
+cd `dirname "$0"`
+set -e
+set -x
+
+gcc -Wall -O2 -I.. -o mojoelfd mojoelfd.c ../mojoelf.c -ldl -lpthread
+
+# end of make.sh ...
+
@@ -0,0 +1,168 @@
+/**
+ * MojoELF; load ELF binaries from a memory buffer.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+// A tiny image server: it loads and relocates each image once, and hands
+//  the results to any process that asks with MOJOELF_dlopen_remote().
+//
+//  usage: mojoelfd <socketpath> <name>=<file> [<name>=<file> ...]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "mojoelf.h"
+
+// How long a client gets to send its request, or take our reply, before
+//  we hang up on it and move on to the next one.
+#ifndef MOJOELFD_CLIENT_TIMEOUT_MS
+#define MOJOELFD_CLIENT_TIMEOUT_MS 1000
+#endif
+
+typedef struct ServedImage
+{
+    const char *name;
+    void *img;
+} ServedImage;
+
+static void *prepare_file(const char *fname)
+{
+    void *retval = NULL;
+    char *buf = NULL;
+    long len = 0;
+    FILE *io = fopen(fname, "rb");
+    if (io == NULL)
+        return NULL;
+
+    if ((fseek(io, 0, SEEK_END) == 0) && ((len = ftell(io)) > 0) &&
+        (fseek(io, 0, SEEK_SET) == 0) &&
+        ((buf = (char *) malloc(len)) != NULL) &&
+        (fread(buf, len, 1, io) == 1))
+    {
+        retval = MOJOELF_remote_prepare(buf, len);
+    } // if
+
+    free(buf);
+    fclose(io);
+    return retval;
+} // prepare_file
+
+int main(int argc, char **argv)
+{
+    ServedImage *images = NULL;
+    struct sockaddr_un addr;
+    int count = 0;
+    int sock = -1;
+    int i;
+
+    if (argc < 3)
+    {
+        fprintf(stderr, "USAGE: %s <socketpath> <name>=<file> [...]\n", argv[0]);
+        return 1;
+    } // if
+
+    images = (ServedImage *) calloc(argc, sizeof (ServedImage));
+    if (images == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    } // if
+
+    for (i = 2; i < argc; i++)
+    {
+        char *fname = strchr(argv[i], '=');
+        if (fname == NULL)
+        {
+            fprintf(stderr, "Bad argument '%s'\n", argv[i]);
+            return 1;
+        } // if
+
+        *(fname++) = '\0';
+        images[count].name = argv[i];
+        images[count].img = prepare_file(fname);
+        if (images[count].img == NULL)
+        {
+            const char *err = MOJOELF_dlerror();
+            fprintf(stderr, "Failed to prepare '%s': %s\n", fname, err ? err : "couldn't read file");
+            return 1;
+        } // if
+        count++;
+    } // for
+
+    if (strlen(argv[1]) >= sizeof (addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long\n");
+        return 1;
+    } // if
+
+    memset(&addr, '\0', sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, argv[1]);
+    unlink(argv[1]);
+
+    signal(SIGPIPE, SIG_IGN);
+    sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if ( (sock == -1) ||
+         (bind(sock, (struct sockaddr *) &addr, sizeof (addr)) == -1) ||
+         (listen(sock, 64) == -1) )
+    {
+        perror("socket");
+        return 1;
+    } // if
+
+    // Requests are one small message each way, and we serve them one at a
+    //  time, so a client that connects and then stalls would hold up
+    //  everyone else. The timeouts cut those off.
+    while (1)
+    {
+        struct timeval tv;
+        char name[256];
+        void *img = NULL;
+        ssize_t len;
+        const int client = accept(sock, NULL, NULL);
+        if (client == -1)
+            continue;
+
+        tv.tv_sec = MOJOELFD_CLIENT_TIMEOUT_MS / 1000;
+        tv.tv_usec = (MOJOELFD_CLIENT_TIMEOUT_MS % 1000) * 1000;
+        if ( (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv)) == -1) ||
+             (setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv)) == -1) )
+        {
+            close(client);
+            continue;
+        } // if
+
+        len = recv(client, name, sizeof (name) - 1, 0);
+        if (len > 0)
+        {
+            name[len] = '\0';
+            for (i = 0; i < count; i++)
+            {
+                if (strcmp(images[i].name, name) == 0)
+                {
+                    img = images[i].img;
+                    break;
+                } // if
+            } // for
+
+            if (!MOJOELF_remote_send(client, img))
+                fprintf(stderr, "Failed to send '%s'\n", name);
+        } // if
+
+        close(client);
+    } // while
+
+    return 0;
+} // main
+
+// end of mojoelfd.c ...
+
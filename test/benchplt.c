@@ -0,0 +1,90 @@
+/**
+ * MojoELF; load ELF binaries from a memory buffer.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "mojoelf.h"
+
+// This loads benchplt_lib.so twice, once normally and once with
+//  MOJOELF_FLAG_PATCH_PLT, and times calls that go through its PLT.
+
+// For expedience, we just #include the .c file.
+#define MOJOELF_SUPPORT_DLERROR 1
+#define MOJOELF_SUPPORT_DLOPEN_FILE 1
+#include "mojoelf.c"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (((double) ts.tv_sec) * 1000000000.0) + ((double) ts.tv_nsec);
+} // now
+
+static double bench(const char *fname, const unsigned int flags, const int iterations)
+{
+    MOJOELF_Callbacks callbacks;
+    int (*kernel)(int) = NULL;
+    double best = 0.0;
+    void *lib = NULL;
+    int i;
+
+    memset(&callbacks, '\0', sizeof (callbacks));
+    callbacks.version = MOJOELF_CALLBACKS_VERSION;
+    callbacks.flags = flags;
+
+    lib = MOJOELF_dlopen_file(fname, &callbacks);
+    if (lib == NULL)
+    {
+        printf("failed '%s'! (%s)\n", fname, MOJOELF_dlerror());
+        exit(1);
+    } // if
+
+    kernel = (int (*)(int)) MOJOELF_dlsym(lib, "plt_kernel");
+    if (kernel == NULL)
+    {
+        printf("Couldn't find 'plt_kernel' in '%s'.\n", fname);
+        exit(1);
+    } // if
+
+    kernel(iterations);  // warm up.
+
+    // take the best of a few runs to keep noise down.
+    for (i = 0; i < 5; i++)
+    {
+        const double start = now();
+        const int rc = kernel(iterations);
+        const double elapsed = now() - start;
+        if (rc != iterations)
+        {
+            printf("plt_kernel returned %d, expected %d!\n", rc, iterations);
+            exit(1);
+        } // if
+        if ((i == 0) || (elapsed < best))
+            best = elapsed;
+    } // for
+
+    MOJOELF_dlclose(lib);
+    return best / ((double) iterations);
+} // bench
+
+int main(int argc, char **argv)
+{
+    const char *fname = (argc > 1) ? argv[1] : "./benchplt_lib.so";
+    const int iterations = (argc > 2) ? atoi(argv[2]) : 100000000;
+    const double indirect = bench(fname, 0, iterations);
+    const double direct = bench(fname, MOJOELF_FLAG_PATCH_PLT, iterations);
+
+    printf("indirect PLT: %.3f ns/call\n", indirect);
+    printf("patched PLT:  %.3f ns/call\n", direct);
+    printf("saving:       %.3f ns/call\n", indirect - direct);
+    return 0;
+} // main
+
+// end of benchplt.c ...
+
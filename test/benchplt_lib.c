@@ -0,0 +1,31 @@
+/**
+ * MojoELF; load ELF binaries from a memory buffer.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+// This is loaded by benchplt.c. Since plt_callee() is a public symbol in a
+//  -fPIC library, every call to it goes through the PLT.
+
+__attribute__((noinline)) int plt_callee(int x)
+{
+    __asm__ __volatile__("" : "+r" (x));  // don't let this get folded away.
+    return x + 1;
+} // plt_callee
+
+int plt_kernel_runs = 0;
+
+int plt_kernel(int iterations)
+{
+    int i;
+    int x = 0;
+    for (i = 0; i < iterations; i++)
+        x = plt_callee(x);
+    plt_kernel_runs++;
+    return x;
+} // plt_kernel
+
+// end of benchplt_lib.c ...
+
@@ -0,0 +1,230 @@
+/**
+ * MojoELF; load ELF binaries from a memory buffer.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "mojoelf.h"
+
+// This loads benchthreads_lib.so on more and more threads at once, each
+//  thread with its own copy of the image, and then does MOJOELF_dlsym() on
+//  one shared handle from more and more threads at once. Every answer gets
+//  checked, and so does every thread's dlerror(), so this is a stress test,
+//  too: it exits with 1 if anything went wrong.
+
+// For expedience, we just #include the .c file.
+#define MOJOELF_SUPPORT_DLERROR 1
+#define MOJOELF_SUPPORT_DLOPEN_FILE 1
+#include "mojoelf.c"
+
+#define MAX_BENCH_THREADS 64
+
+static uint8 *image = NULL;
+static long imagelen = 0;
+static void *shared_lib = NULL;
+static char symnames[256][16];
+static volatile int failures = 0;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (((double) ts.tv_sec) * 1000000000.0) + ((double) ts.tv_nsec);
+} // now
+
+static void fail(const char *what)
+{
+    if (__sync_fetch_and_add(&failures, 1) < 10)  // don't flood the terminal.
+        printf("FAILED: %s\n", what);
+} // fail
+
+static int check_symbol(void *lib, const int n)
+{
+    int (*fn)(void) = (int (*)(void)) MOJOELF_dlsym(lib, symnames[n]);
+    if ((fn == NULL) || (fn() != n))
+    {
+        fail("wrong symbol");
+        return 0;
+    } // if
+    return 1;
+} // check_symbol
+
+static void *load_thread(void *arg)
+{
+    static const uint8 junk[64] = { 0 };  // not an ELF file.
+    const int loads = *(const int *) arg;
+    uint8 *buf = (uint8 *) malloc(imagelen);  // our own copy of the image.
+    int i;
+
+    if (buf == NULL)
+    {
+        fail("out of memory");
+        return NULL;
+    } // if
+
+    memcpy(buf, image, imagelen);
+
+    for (i = 0; i < loads; i++)
+    {
+        const char *err = NULL;
+        void *lib = NULL;
+
+        // Our failures should only show up on our thread, and only once,
+        //  no matter what the other threads are doing.
+        if (MOJOELF_dlopen_mem(junk, sizeof (junk), NULL) != NULL)
+            fail("loaded junk");
+        else if (((err = MOJOELF_dlerror()) == NULL) || (strcmp(err, "Not an ELF file") != 0))
+            fail("wrong error for junk");
+        else if (MOJOELF_dlerror() != NULL)
+            fail("dlerror didn't clear");
+
+        lib = MOJOELF_dlopen_mem(buf, imagelen, NULL);
+        if (lib == NULL)
+        {
+            fail("dlopen");
+            break;
+        } // if
+        else if (MOJOELF_dlerror() != NULL)
+            fail("another thread's error showed up here");
+
+        check_symbol(lib, i % 256);
+        MOJOELF_dlclose(lib);
+    } // for
+
+    free(buf);
+    return NULL;
+} // load_thread
+
+static void *dlsym_thread(void *arg)
+{
+    const int lookups = *(const int *) arg;
+    const int start = rand() % 256;  // don't all hit the same names at once.
+    int i;
+
+    for (i = 0; i < lookups; i++)
+    {
+        if (!check_symbol(shared_lib, (start + i) % 256))
+            break;
+    } // for
+
+    if (MOJOELF_dlsym(shared_lib, "not_a_symbol") != NULL)
+        fail("found a symbol that doesn't exist");
+    else if (MOJOELF_dlerror() == NULL)
+        fail("no error for missing symbol");
+
+    return NULL;
+} // dlsym_thread
+
+// Returns nanoseconds it took for all the threads to finish.
+static double run_threads(void *(*fn)(void *), const int threadcount, int *arg)
+{
+    pthread_t threads[MAX_BENCH_THREADS];
+    const double start = now();
+    int i;
+
+    for (i = 0; i < threadcount; i++)
+    {
+        if (pthread_create(&threads[i], NULL, fn, arg) != 0)
+        {
+            printf("pthread_create failed!\n");
+            exit(1);
+        } // if
+    } // for
+
+    for (i = 0; i < threadcount; i++)
+        pthread_join(threads[i], NULL);
+
+    return now() - start;
+} // run_threads
+
+static int read_image(const char *fname)
+{
+    FILE *io = fopen(fname, "rb");
+    if (io == NULL)
+        return 0;
+
+    fseek(io, 0, SEEK_END);
+    imagelen = ftell(io);
+    fseek(io, 0, SEEK_SET);
+    image = (uint8 *) malloc(imagelen);
+    if ((image == NULL) || (fread(image, imagelen, 1, io) != 1))
+    {
+        fclose(io);
+        return 0;
+    } // if
+
+    fclose(io);
+    return 1;
+} // read_image
+
+int main(int argc, char **argv)
+{
+    const char *fname = (argc > 1) ? argv[1] : "./benchthreads_lib.so";
+    int maxthreads = (argc > 2) ? atoi(argv[2]) : 8;
+    int loads = (argc > 3) ? atoi(argv[3]) : 2000;
+    int lookups = (argc > 4) ? atoi(argv[4]) : 1000000;
+    double base = 0.0;
+    int threads;
+    int i;
+
+    if ((maxthreads < 1) || (maxthreads > MAX_BENCH_THREADS))
+        maxthreads = MAX_BENCH_THREADS;
+
+    if (!read_image(fname))
+    {
+        printf("Couldn't read '%s'.\n", fname);
+        return 1;
+    } // if
+
+    for (i = 0; i < 256; i++)
+        snprintf(symnames[i], sizeof (symnames[i]), "bench_sym_%02x", i);
+
+    printf("dlopen/dlclose, each thread loading its own copy:\n");
+    for (threads = 1; threads <= maxthreads; threads *= 2)
+    {
+        const double elapsed = run_threads(load_thread, threads, &loads);
+        const double rate = (((double) threads) * loads) / (elapsed / 1000000000.0);
+        if (threads == 1)
+            base = rate;
+        printf("  %2d threads: %10.0f loads/sec (%.2fx)\n", threads, rate, rate / base);
+    } // for
+
+    shared_lib = MOJOELF_dlopen_mem(image, imagelen, NULL);
+    if (shared_lib == NULL)
+    {
+        printf("failed '%s'! (%s)\n", fname, MOJOELF_dlerror());
+        return 1;
+    } // if
+
+    printf("dlsym, every thread sharing one handle:\n");
+    for (threads = 1; threads <= maxthreads; threads *= 2)
+    {
+        const double elapsed = run_threads(dlsym_thread, threads, &lookups);
+        const double rate = (((double) threads) * lookups) / (elapsed / 1000000000.0);
+        if (threads == 1)
+            base = rate;
+        printf("  %2d threads: %10.0f lookups/sec (%.2fx)\n", threads, rate, rate / base);
+    } // for
+
+    MOJOELF_dlclose(shared_lib);
+    free(image);
+
+    if (failures)
+    {
+        printf("%d failures!\n", (int) failures);
+        return 1;
+    } // if
+
+    printf("no failures.\n");
+    return 0;
+} // main
+
+// end of benchthreads.c ...
+
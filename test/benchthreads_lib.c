@@ -0,0 +1,22 @@
+/**
+ * MojoELF; load ELF binaries from a memory buffer.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+// This is loaded by benchthreads.c: 256 exported functions, each of which
+//  returns its own number, so lookups can be checked.
+
+#define SYM1(n) int bench_sym_##n(void) { return 0x##n; }
+#define SYM16(n) SYM1(n##0) SYM1(n##1) SYM1(n##2) SYM1(n##3) \
+                 SYM1(n##4) SYM1(n##5) SYM1(n##6) SYM1(n##7) \
+                 SYM1(n##8) SYM1(n##9) SYM1(n##a) SYM1(n##b) \
+                 SYM1(n##c) SYM1(n##d) SYM1(n##e) SYM1(n##f)
+
+SYM16(0) SYM16(1) SYM16(2) SYM16(3) SYM16(4) SYM16(5) SYM16(6) SYM16(7)
+SYM16(8) SYM16(9) SYM16(a) SYM16(b) SYM16(c) SYM16(d) SYM16(e) SYM16(f)
+
+// end of benchthreads_lib.c ...
+
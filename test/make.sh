@@ -5,7 +5,12 @@ set -e
 set -x
 
 #gcc -Wall -O0 -ggdb3 -o mojoelf mojoelf.c -ldl
-gcc -Wall -O0 -ggdb3 -I.. -o test test.c -ldl
-gcc -Wall -O0 -ggdb3 -I.. -I/usr/include/SDL -o testsdl testsdl.c -ldl
+gcc -Wall -O0 -ggdb3 -I.. -o test test.c -ldl -lpthread
+gcc -Wall -O0 -ggdb3 -I.. -I/usr/include/SDL -o testsdl testsdl.c -ldl -lpthread
 gcc -fPIC -shared -Wall -O0 -g -o hello.so hello.c
 
+gcc -Wall -O2 -I.. -o benchplt benchplt.c -ldl -lpthread
+gcc -fPIC -shared -Wall -O2 -o benchplt_lib.so benchplt_lib.c
+
+gcc -Wall -O2 -I.. -o benchthreads benchthreads.c -ldl -lpthread
+gcc -fPIC -shared -nostartfiles -Wall -O2 -o benchthreads_lib.so benchthreads_lib.c